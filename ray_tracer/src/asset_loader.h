@@ -0,0 +1,220 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "thread_pool.h"
+#include "texture_cache.h"
+#include "environment.h"
+
+// Loads the textures and meshes of a scene on the thread pool while generate_world keeps putting
+// the scene together. Textures are created right away and filled in by a task, so materials can
+// hold them before they are loaded. Meshes are parsed and turned into triangles in a task and get
+// added to the world, in the order they were requested, by finish_loading. Nothing may render the
+// world before finish_loading returns.
+//
+// Without a pool everything loads right away on the calling thread, which keeps the memory on
+// the node of that thread when building NUMA replicas.
+
+struct Pending_Mesh
+{
+	std::vector<shared_ptr<Hittable>> triangles;
+};
+
+struct Asset_Loader
+{
+	Thread_Pool* pool;
+	Texture_Cache* texture_cache;
+	Task_Group group;
+
+	// deque so the meshes don't move while tasks fill them in
+	std::deque<Pending_Mesh> meshes;
+};
+
+inline void
+start_loading(Asset_Loader& loader, Thread_Pool* pool, Texture_Cache& texture_cache)
+{
+	loader.pool = pool;
+	loader.texture_cache = &texture_cache;
+	loader.group = {};
+	loader.meshes.clear();
+}
+
+inline void
+run_load_task(Asset_Loader& loader, std::function<void()> task)
+{
+	if (loader.pool)
+	{
+		submit_task(*loader.pool, loader.group, std::move(task));
+	}
+	else
+	{
+		task();
+	}
+}
+
+// Uses the tiled version of a texture, made with "ray_tracer convert", when there is one next to it.
+// Small ones are mapped whole, the ones that would take a good part of the texture cache budget
+// are paged in through the cache. Images are decoded in a task.
+inline shared_ptr<Texture>
+load_texture(Asset_Loader& loader, const char* image_file, const char* tiled_file)
+{
+	FILE* f = fopen(tiled_file, "rb");
+	if (f)
+	{
+		uint64_t size = get_file_size(f);
+		fclose(f);
+		if (size > loader.texture_cache->budget_bytes / 4)
+		{
+			return make_shared<Cached_Texture>(*loader.texture_cache, tiled_file);
+		}
+		image_file = tiled_file;
+	}
+
+	auto texture = make_shared<Image_Texture>();
+	std::string file_name = image_file;
+	run_load_task(loader, [texture, file_name]
+	{
+		TRACE_SCOPE("texture load");
+		texture->load(file_name.c_str());
+	});
+	return texture;
+}
+
+// Appends the corners of every triangle of a triangulated OBJ to positions, 9 floats per triangle.
+inline bool
+read_mesh_positions(const char* file_name, std::vector<float>& positions)
+{
+	fastObjMesh* mesh = fast_obj_read(file_name);
+	if (!mesh)
+	{
+		fprintf(stderr, "ERROR: Could not load mesh file '%s'.\n", file_name);
+		return false;
+	}
+
+	positions.reserve(positions.size() + size_t(mesh->face_count) * 9);
+	for (unsigned int i = 0; i < mesh->face_count * 3; i++)
+	{
+		unsigned int index = mesh->indices[i].p;
+		positions.insert(positions.end(), mesh->positions + index * 3, mesh->positions + index * 3 + 3);
+	}
+
+	fast_obj_destroy(mesh);
+	return true;
+}
+
+inline void
+add_mesh_triangles(const float* positions, size_t triangle_count, v3f offset, shared_ptr<Material> material, std::vector<shared_ptr<Hittable>>& triangles)
+{
+	triangles.reserve(triangles.size() + triangle_count);
+	for (size_t i = 0; i < triangle_count; i++)
+	{
+		const float* p = positions + i * 9;
+		v3f a = v3f{ p[0], p[1], p[2] } + offset;
+		v3f b = v3f{ p[3], p[4], p[5] } + offset;
+		v3f c = v3f{ p[6], p[7], p[8] } + offset;
+		triangles.push_back(make_shared<Triangle>(a, b, c, material));
+	}
+}
+
+inline void
+build_mesh_triangles(const char* file_name, v3f offset, shared_ptr<Material> material, std::vector<shared_ptr<Hittable>>& triangles)
+{
+	std::vector<float> positions;
+	if (read_mesh_positions(file_name, positions))
+	{
+		add_mesh_triangles(positions.data(), positions.size() / 9, offset, material, triangles);
+	}
+}
+
+// Triangulated OBJ (as exported with "triangulate faces"), moved by offset.
+inline void
+load_mesh(Asset_Loader& loader, const char* file_name, v3f offset, shared_ptr<Material> material)
+{
+	loader.meshes.push_back(Pending_Mesh{});
+	Pending_Mesh* mesh = &loader.meshes.back();
+	std::string name = file_name;
+	run_load_task(loader, [mesh, name, offset, material]
+	{
+		TRACE_SCOPE("mesh load");
+		build_mesh_triangles(name.c_str(), offset, material, mesh->triangles);
+	});
+}
+
+// A mesh already read into positions, 9 floats per triangle, which have to stay around until
+// finish_loading.
+inline void
+load_mesh_positions(Asset_Loader& loader, const float* positions, size_t triangle_count, v3f offset, shared_ptr<Material> material)
+{
+	loader.meshes.push_back(Pending_Mesh{});
+	Pending_Mesh* mesh = &loader.meshes.back();
+	run_load_task(loader, [mesh, positions, triangle_count, offset, material]
+	{
+		TRACE_SCOPE("mesh load");
+		add_mesh_triangles(positions, triangle_count, offset, material, mesh->triangles);
+	});
+}
+
+// Lat-long environment map, .hdr or any other image stb_image reads.
+inline shared_ptr<Environment_Map>
+load_environment(Asset_Loader& loader, const char* file_name)
+{
+	auto environment = make_shared<Environment_Map>();
+	std::string name = file_name;
+	run_load_task(loader, [environment, name]
+	{
+		TRACE_SCOPE("environment load");
+		load_environment_map(*environment, name.c_str());
+	});
+	return environment;
+}
+
+// Cube map from the faces right, left, top, bottom, front and back in directory, all with the same
+// extension (".jpg", ".hdr", ...). It gets resampled to a lat-long map width texels wide.
+inline shared_ptr<Environment_Map>
+load_cube_environment(Asset_Loader& loader, const char* directory, const char* extension, int width)
+{
+	auto environment = make_shared<Environment_Map>();
+	std::string base = std::string(directory) + "/";
+	std::string ext = extension;
+	run_load_task(loader, [environment, base, ext, width]
+	{
+		TRACE_SCOPE("environment load");
+		const char* names[6] = { "right", "left", "top", "bottom", "front", "back" };
+		std::string files[6];
+		const char* face_files[6];
+		for (int face = 0; face < 6; face++)
+		{
+			files[face] = base + names[face] + ext;
+			face_files[face] = files[face].c_str();
+		}
+		load_cube_environment_map(*environment, face_files, width);
+	});
+	return environment;
+}
+
+// Waits for every load and adds the meshes to the world. An environment map that didn't load
+// leaves the world with its constant background.
+inline void
+finish_loading(Asset_Loader& loader, World& world)
+{
+	if (loader.pool)
+	{
+		wait_for_tasks(*loader.pool, loader.group);
+	}
+
+	if (world.environment && world.environment->texels.empty())
+	{
+		world.environment = nullptr;
+	}
+
+	for (Pending_Mesh& mesh : loader.meshes)
+	{
+		for (shared_ptr<Hittable>& triangle : mesh.triangles)
+		{
+			world.add_object(triangle);
+		}
+	}
+	loader.meshes.clear();
+}
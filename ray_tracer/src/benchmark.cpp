@@ -0,0 +1,58 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+#include "ray_tracer.h"
+#include "fast_math.h"
+#include "render_counters.h"
+#include "hittable.h"
+#include "texture.h"
+#include "material.h"
+#include "environment.h"
+#include "lights.h"
+#include "bvh.h"
+#include "ray_sort.h"
+#include "camera.h"
+#include "benchmark.h"
+
+// benchmark [filter] [--repetitions n] [--csv]
+//
+// Runs the kernels with filter in their name ("intersect/", "sphere", ...), all of them without
+// one. --csv prints one line per kernel, for comparing against an earlier run.
+int main(int argc, char** argv)
+{
+	Benchmark_Settings settings = {};
+	settings.repetitions = 15;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc)
+		{
+			int repetitions = atoi(argv[++i]);
+			settings.repetitions = MAX(1, repetitions);
+		}
+		else if (strcmp(argv[i], "--csv") == 0)
+		{
+			settings.csv = true;
+		}
+		else if (argv[i][0] != '-')
+		{
+			settings.filter = argv[i];
+		}
+		else
+		{
+			std::cerr << "usage: benchmark [filter] [--repetitions n] [--csv]\n";
+			return 1;
+		}
+	}
+
+	run_benchmarks(settings);
+	return 0;
+}
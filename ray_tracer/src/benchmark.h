@@ -0,0 +1,636 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+// Microbenchmarks of the kernels rendering spends its time in, built as their own executable
+// from benchmark.cpp. Every kernel goes over inputs prepared up front, runs once to warm up the
+// caches and then a number of times, and the median time is reported along with the fastest run
+// and how much the runs spread, so the numbers are comparable between builds (USE_SIMD_VECTORS,
+// USE_FAST_MATH, compilers) and a noisy machine shows up as a wide spread instead of a regression.
+
+struct Benchmark_Settings
+{
+	// only the kernels with this in their name run, all of them when null
+	const char* filter;
+	int repetitions;
+	bool csv;
+};
+
+// the kernels add their results in here so the compiler can't drop them
+static volatile float benchmark_sink;
+
+inline bool
+benchmark_enabled(Benchmark_Settings& settings, const char* name)
+{
+	return !settings.filter || strstr(name, settings.filter) != nullptr;
+}
+
+// Runs kernel(iterations) once to warm up and then settings.repetitions times, and prints the
+// nanoseconds per iteration of the median run.
+template <typename Kernel>
+inline void
+run_benchmark(Benchmark_Settings& settings, const char* name, int iterations, Kernel kernel)
+{
+	if (!benchmark_enabled(settings, name) || iterations <= 0)
+	{
+		return;
+	}
+
+	benchmark_sink = kernel(iterations);
+
+	std::vector<double> times;
+	for (int run = 0; run < settings.repetitions; run++)
+	{
+		double start = get_time_ms();
+		benchmark_sink = kernel(iterations);
+		times.push_back((get_time_ms() - start) * 1e6 / double(iterations));
+	}
+	std::sort(times.begin(), times.end());
+
+	double mean = .0;
+	for (double time : times)
+	{
+		mean += time;
+	}
+	mean /= double(times.size());
+	double variance = .0;
+	for (double time : times)
+	{
+		variance += (time - mean) * (time - mean);
+	}
+	double deviation = sqrt(variance / double(times.size()));
+
+	double median = times[times.size() / 2];
+	double ops_per_second = median > .0 ? 1e9 / median : .0;
+	if (settings.csv)
+	{
+		printf("%s,%.3f,%.0f,%.3f,%.3f\n", name, median, ops_per_second, times[0], 100.0 * deviation / mean);
+	}
+	else
+	{
+		printf("%-36s %10.2f ns/op %14.0f ops/s %10.2f ns min %6.1f%%\n", name, median, ops_per_second, times[0], 100.0 * deviation / mean);
+	}
+}
+
+// a power of two so the kernels can wrap around with a mask
+#define BENCHMARK_INPUT_COUNT 4096
+#define BENCHMARK_INPUT_MASK (BENCHMARK_INPUT_COUNT - 1)
+
+// Rays from around the unit cube towards it, about half of them hit the shapes in it, random
+// vectors in the same cube and random numbers in [0, 1).
+struct Benchmark_Inputs
+{
+	std::vector<Ray> rays;
+	std::vector<v3f> inverse_directions;
+	std::vector<v3f> vectors;
+	std::vector<float> numbers;
+};
+
+inline void
+benchmark_vectors(Benchmark_Settings& settings, Benchmark_Inputs& inputs, int iterations)
+{
+	run_benchmark(settings, "vector/dot cross normalize", iterations, [&](int n)
+	{
+		v3f sum = {};
+		for (int i = 0; i < n; i++)
+		{
+			v3f a = inputs.vectors[i & BENCHMARK_INPUT_MASK];
+			v3f b = inputs.vectors[(i + 1) & BENCHMARK_INPUT_MASK];
+			sum += dot(a, b) * normalize(cross(a, b));
+		}
+		return sum.x + sum.y + sum.z;
+	});
+
+	run_benchmark(settings, "vector/fast sincos", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float s = .0f;
+			float c = .0f;
+			fast_sincos(inputs.numbers[i & BENCHMARK_INPUT_MASK] * 2.0f * PI, s, c);
+			sum += s + c;
+		}
+		return sum;
+	});
+}
+
+inline void
+benchmark_intersections(Benchmark_Settings& settings, Benchmark_Inputs& inputs, int iterations)
+{
+	auto material = make_shared<Lambertian>(V3f(.5f, .5f, .5f));
+	Sphere sphere(V3f(.0f, .0f, .0f), 1.0f, material);
+	Triangle triangle(V3f(-1.0f, -1.0f, .0f), V3f(.0f, 1.0f, .0f), V3f(1.0f, -1.0f, .0f), material);
+	Plane plane(V3f(.0f, 1.0f, .0f), .0f, material);
+
+	// through the base class, like the renderer calls them
+	Hittable* shapes[] = { &sphere, &triangle, &plane };
+	const char* names[] = { "intersect/sphere hit", "intersect/triangle hit", "intersect/plane hit" };
+	for (int shape = 0; shape < 3; shape++)
+	{
+		Hittable* object = shapes[shape];
+		run_benchmark(settings, names[shape], iterations, [&](int n)
+		{
+			float sum = .0f;
+			Hit_Record rec = {};
+			for (int i = 0; i < n; i++)
+			{
+				if (object->hit(inputs.rays[i & BENCHMARK_INPUT_MASK], .0001f, infinity, rec))
+				{
+					sum += rec.t;
+				}
+			}
+			return sum;
+		});
+	}
+
+	Bounds box = { V3f(-1.0f, -1.0f, -1.0f), V3f(1.0f, 1.0f, 1.0f) };
+	run_benchmark(settings, "intersect/bounds entry", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float t = bounds_entry(box, inputs.rays[i & BENCHMARK_INPUT_MASK].origin, inputs.inverse_directions[i & BENCHMARK_INPUT_MASK], .0f, infinity);
+			sum += t != infinity ? t : .0f;
+		}
+		return sum;
+	});
+}
+
+inline void
+benchmark_materials(Benchmark_Settings& settings, Benchmark_Inputs& inputs, int iterations)
+{
+	auto lambertian = make_shared<Lambertian>(V3f(.5f, .5f, .5f));
+	auto metal = make_shared<Metal>(V3f(.8f, .8f, .8f), .3f);
+	auto dielectric = make_shared<Dielectric>(1.5f);
+	auto light = make_shared<Diffuse_Light>(V3f(4.0f, 4.0f, 4.0f));
+
+	Sphere sphere(V3f(.0f, .0f, .0f), 1.0f, lambertian);
+	Hit_Record shading_rec = {};
+	sphere.hit(Ray(V3f(.0f, .0f, 3.0f), V3f(.0f, .0f, -1.0f)), .0001f, infinity, shading_rec);
+
+	// scatter draws its random numbers from random_float, which is a part of the time
+	Material* materials[] = { lambertian.get(), metal.get(), dielectric.get() };
+	const char* names[] = { "material/lambertian scatter", "material/metal scatter", "material/dielectric scatter" };
+	for (int m = 0; m < 3; m++)
+	{
+		Material* material = materials[m];
+		run_benchmark(settings, names[m], iterations / 4, [&](int n)
+		{
+			float sum = .0f;
+			v3f attenuation = {};
+			for (int i = 0; i < n; i++)
+			{
+				Ray r = inputs.rays[i & BENCHMARK_INPUT_MASK];
+				r.direction = normalize(r.direction);
+				material->scatter(shading_rec, r, attenuation);
+				sum += r.direction.x;
+			}
+			return sum;
+		});
+	}
+
+	Material* sampled[] = { lambertian.get(), metal.get() };
+	const char* sampled_names[] = { "material/lambertian pdf and evaluate", "material/metal pdf and evaluate" };
+	for (int m = 0; m < 2; m++)
+	{
+		Material* material = sampled[m];
+		run_benchmark(settings, sampled_names[m], iterations, [&](int n)
+		{
+			float sum = .0f;
+			for (int i = 0; i < n; i++)
+			{
+				v3f incoming = normalize(inputs.rays[i & BENCHMARK_INPUT_MASK].direction);
+				v3f scattered = inputs.vectors[i & BENCHMARK_INPUT_MASK];
+				sum += material->scatter_pdf(shading_rec, incoming, scattered);
+				sum += material->evaluate_scatter(shading_rec, incoming, scattered).g;
+			}
+			return sum;
+		});
+	}
+
+	run_benchmark(settings, "material/diffuse light emitted", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float u = inputs.numbers[i & BENCHMARK_INPUT_MASK];
+			sum += light->emitted(u, 1.0f - u, inputs.vectors[i & BENCHMARK_INPUT_MASK]).r;
+		}
+		return sum;
+	});
+}
+
+inline void
+benchmark_textures(Benchmark_Settings& settings, Benchmark_Inputs& inputs, int iterations)
+{
+	Solid_Color solid(V3f(.2f, .4f, .6f));
+	Checker_Texture checker(V3f(.2f, .3f, .1f), V3f(.9f, .9f, .9f));
+	Texture* textures[] = { &solid, &checker };
+	const char* names[] = { "texture/solid color value", "texture/checker value" };
+	for (int t = 0; t < 2; t++)
+	{
+		Texture* texture = textures[t];
+		run_benchmark(settings, names[t], iterations, [&](int n)
+		{
+			float sum = .0f;
+			for (int i = 0; i < n; i++)
+			{
+				float u = inputs.numbers[i & BENCHMARK_INPUT_MASK];
+				float v = inputs.numbers[(i + 1) & BENCHMARK_INPUT_MASK];
+				sum += texture->value(u, v, inputs.vectors[i & BENCHMARK_INPUT_MASK]).g;
+			}
+			return sum;
+		});
+	}
+
+	if (!benchmark_enabled(settings, "texture/image value") && !benchmark_enabled(settings, "texture/image sample"))
+	{
+		return;
+	}
+
+	// the earth map of the default scene, the benchmark runs from the same directory as the renderer
+	Image_Texture image;
+	if (!image.load("../resources/earthmap.jpg"))
+	{
+		return;
+	}
+	Texture* texture = &image;
+
+	run_benchmark(settings, "texture/image value", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float u = inputs.numbers[i & BENCHMARK_INPUT_MASK];
+			float v = inputs.numbers[(i + 1) & BENCHMARK_INPUT_MASK];
+			sum += texture->value(u, v, inputs.vectors[i & BENCHMARK_INPUT_MASK]).g;
+		}
+		return sum;
+	});
+
+	// a footprint of a few texels, so the lookups blend two mip levels
+	Hit_Record rec = {};
+	rec.dudx = rec.dvdy = 1.0f / 512.0f;
+	run_benchmark(settings, "texture/image sample", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			rec.u = inputs.numbers[i & BENCHMARK_INPUT_MASK];
+			rec.v = inputs.numbers[(i + 1) & BENCHMARK_INPUT_MASK];
+			sum += texture->sample(rec).g;
+		}
+		return sum;
+	});
+}
+
+inline void
+benchmark_sampling(Benchmark_Settings& settings, Benchmark_Inputs& inputs, int iterations)
+{
+	run_benchmark(settings, "sample/random float", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			sum += random_float();
+		}
+		return sum;
+	});
+
+	run_benchmark(settings, "sample/random in unit vector", iterations / 4, [&](int n)
+	{
+		v3f sum = {};
+		for (int i = 0; i < n; i++)
+		{
+			sum += random_in_unit_vector();
+		}
+		return sum.x;
+	});
+
+	run_benchmark(settings, "sample/random in unit disk", iterations / 4, [&](int n)
+	{
+		v3f sum = {};
+		for (int i = 0; i < n; i++)
+		{
+			sum += random_in_unit_disk();
+		}
+		return sum.x;
+	});
+
+	// tables of the size of an environment map and of the lights of a big scene
+	std::vector<float> weights;
+	for (int i = 0; i < 512 * 256; i++)
+	{
+		weights.push_back(random_float() * random_float());
+	}
+	Distribution_1D distribution_1d;
+	build_distribution(distribution_1d, weights.data(), 1024);
+	Distribution_2D distribution_2d;
+	build_distribution(distribution_2d, weights.data(), 512, 256);
+	Alias_Table alias_table;
+	build_alias_table(alias_table, weights.data(), 1024);
+
+	run_benchmark(settings, "sample/distribution 1d", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float pdf = .0f;
+			int offset = 0;
+			sum += sample_distribution(distribution_1d, inputs.numbers[i & BENCHMARK_INPUT_MASK], pdf, offset) + pdf;
+		}
+		return sum;
+	});
+
+	run_benchmark(settings, "sample/distribution 2d", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float u = .0f;
+			float v = .0f;
+			float pdf = .0f;
+			sample_distribution(distribution_2d, inputs.numbers[i & BENCHMARK_INPUT_MASK], inputs.numbers[(i + 1) & BENCHMARK_INPUT_MASK], u, v, pdf);
+			sum += u + v + pdf;
+		}
+		return sum;
+	});
+
+	run_benchmark(settings, "sample/alias table", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			float pmf = .0f;
+			sum += float(sample_alias_table(alias_table, inputs.numbers[i & BENCHMARK_INPUT_MASK], pmf)) + pmf;
+		}
+		return sum;
+	});
+
+	auto material = make_shared<Lambertian>(V3f(.5f, .5f, .5f));
+	Sphere sphere(V3f(.0f, .0f, .0f), 1.0f, material);
+	Hittable* light = &sphere;
+	run_benchmark(settings, "sample/sphere direction", iterations, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			v3f direction = {};
+			float pdf = .0f;
+			v3f from = 4.0f * inputs.vectors[i & BENCHMARK_INPUT_MASK] + V3f(.0f, 5.0f, .0f);
+			if (light->sample_direction(from, inputs.numbers[i & BENCHMARK_INPUT_MASK], inputs.numbers[(i + 1) & BENCHMARK_INPUT_MASK], direction, pdf))
+			{
+				sum += pdf;
+			}
+		}
+		return sum;
+	});
+
+	// a grid of 400 small lights over the floor the shading points are on
+	World world = {};
+	auto emitter = make_shared<Diffuse_Light>(V3f(4.0f, 4.0f, 4.0f));
+	for (int z = 0; z < 20; z++)
+	{
+		for (int x = 0; x < 20; x++)
+		{
+			world.add_object(make_shared<Sphere>(V3f(float(x) - 10.0f, 2.0f, float(z) - 10.0f), .1f, emitter));
+		}
+	}
+	Light_Selection selections[] = { LIGHT_SELECTION_POWER, LIGHT_SELECTION_BVH };
+	const char* selection_names[] = { "sample/pick light, power", "sample/pick light, light bvh" };
+	for (int s = 0; s < 2; s++)
+	{
+		if (!benchmark_enabled(settings, selection_names[s]))
+		{
+			continue;
+		}
+
+		auto sampler = build_light_sampler(world, selections[s]);
+		run_benchmark(settings, selection_names[s], iterations / 4, [&](int n)
+		{
+			float sum = .0f;
+			for (int i = 0; i < n; i++)
+			{
+				v3f p = V3f(inputs.vectors[i & BENCHMARK_INPUT_MASK].x * 10.0f, .0f, inputs.vectors[i & BENCHMARK_INPUT_MASK].z * 10.0f);
+				float pmf = .0f;
+				int picked = pick_light(*sampler, p, V3f(.0f, 1.0f, .0f), inputs.numbers[i & BENCHMARK_INPUT_MASK], pmf);
+				sum += float(picked) + pmf;
+			}
+			return sum;
+		});
+	}
+}
+
+inline void
+benchmark_traversal(Benchmark_Settings& settings)
+{
+	auto material = make_shared<Lambertian>(V3f(.5f, .5f, .5f));
+
+	// primary visibility of a field of small spheres, the camera rays of 4x2 pixel blocks one
+	// at a time and as packets
+	const int film_size = 256;
+	const int camera_rays = film_size * film_size;
+	if (benchmark_enabled(settings, "trace/camera ray, single") || benchmark_enabled(settings, "trace/camera ray, packets"))
+	{
+		World world = {};
+		for (int z = 0; z < 64; z++)
+		{
+			for (int x = 0; x < 64; x++)
+			{
+				world.add_object(make_shared<Sphere>(V3f(float(x) - 32.0f, .3f, -float(z)), .3f, material));
+			}
+		}
+		world.add_object(make_shared<Plane>(V3f(.0f, 1.0f, .0f), .0f, material));
+		world.bvh = build_bvh(world);
+
+		Camera camera(V3f(.0f, 3.0f, 6.0f), V3f(.0f, .0f, -20.0f), V3f(.0f, 1.0f, .0f), 1.0f, 60.0f, .0f, 1.0f);
+		auto camera_ray = [&camera, film_size](int i)
+		{
+			// 4x2 blocks in scanline order
+			int block = i / RAY_PACKET_SIZE;
+			int lane = i % RAY_PACKET_SIZE;
+			int x = (block % (film_size / 4)) * 4 + lane % 4;
+			int y = (block / (film_size / 4)) * 2 + lane / 4;
+			return camera.get_ray((float(x) + .5f) / float(film_size), (float(y) + .5f) / float(film_size));
+		};
+
+		run_benchmark(settings, "trace/camera ray, single", camera_rays, [&](int n)
+		{
+			float sum = .0f;
+			for (int i = 0; i < n; i++)
+			{
+				Hit_Record rec = {};
+				float t_max = infinity;
+				Ray r = camera_ray(i);
+				if (bvh_closest_hit(*world.bvh, r, .0001f, t_max, rec))
+				{
+					sum += rec.t;
+				}
+			}
+			return sum;
+		});
+
+		run_benchmark(settings, "trace/camera ray, packets", camera_rays, [&](int n)
+		{
+			float sum = .0f;
+			for (int i = 0; i < n; i += RAY_PACKET_SIZE)
+			{
+				Ray_Packet packet;
+				for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+				{
+					packet.rays[lane] = camera_ray(i + lane);
+				}
+				prepare_ray_packet(packet, RAY_PACKET_SIZE);
+
+				Hit_Record recs[RAY_PACKET_SIZE] = {};
+				int hits = bvh_closest_hit(*world.bvh, packet, .0001f, recs);
+				for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+				{
+					if (hits & (1 << lane))
+					{
+						sum += recs[lane].t;
+					}
+				}
+			}
+			return sum;
+		});
+	}
+
+	// second diffuse bounces off a bumpy sphere of two million triangles and the ground, far more
+	// than the caches hold, traced in the order of their pixels and sorted by ray_sort_key a buffer
+	// at a time. The first bounces start next to each other in pixel order already.
+	if (!benchmark_enabled(settings, "trace/diffuse bounce, unsorted") && !benchmark_enabled(settings, "trace/diffuse bounce, sorted"))
+	{
+		return;
+	}
+
+	World mesh_world = {};
+	const int rings = 1000;
+	const int segments = 1000;
+	auto mesh_vertex = [rings, segments](int ring, int segment)
+	{
+		float theta = PI * float(ring) / float(rings);
+		float phi = 2.0f * PI * float(segment % segments) / float(segments);
+		float radius = 2.0f + .05f * (float)sin(13.0f * theta) * (float)cos(17.0f * phi);
+		return radius * V3f((float)sin(theta) * (float)cos(phi), (float)cos(theta), (float)sin(theta) * (float)sin(phi));
+	};
+	for (int ring = 0; ring < rings; ring++)
+	{
+		for (int segment = 0; segment < segments; segment++)
+		{
+			v3f a = mesh_vertex(ring, segment);
+			v3f b = mesh_vertex(ring, segment + 1);
+			v3f c = mesh_vertex(ring + 1, segment);
+			v3f d = mesh_vertex(ring + 1, segment + 1);
+			mesh_world.add_object(make_shared<Triangle>(a, b, c, material));
+			mesh_world.add_object(make_shared<Triangle>(b, d, c, material));
+		}
+	}
+	mesh_world.add_object(make_shared<Plane>(V3f(.0f, 1.0f, .0f), 2.1f, material));
+	mesh_world.bvh = build_bvh(mesh_world);
+
+	Camera mesh_camera(V3f(.0f, .0f, 6.0f), V3f(.0f, .0f, .0f), V3f(.0f, 1.0f, .0f), 1.0f, 45.0f, .0f, 1.0f);
+	std::vector<Ray> bounce_rays;
+	for (int y = 0; y < film_size; y++)
+	{
+		for (int x = 0; x < film_size; x++)
+		{
+			Ray r = mesh_camera.get_ray((float(x) + .5f) / float(film_size), (float(y) + .5f) / float(film_size));
+			for (int bounce = 0; bounce < 2; bounce++)
+			{
+				Hit_Record rec = {};
+				float t_max = infinity;
+				v3f attenuation = {};
+				if (!bvh_closest_hit(*mesh_world.bvh, r, .0001f, t_max, rec) || !rec.mat->scatter(rec, r, attenuation))
+				{
+					break;
+				}
+				if (bounce == 1)
+				{
+					bounce_rays.push_back(r);
+				}
+			}
+		}
+	}
+	Bounds sort_bounds = ray_sort_bounds(mesh_world);
+	const int bounce_count = int(bounce_rays.size());
+
+	run_benchmark(settings, "trace/diffuse bounce, unsorted", bounce_count, [&](int n)
+	{
+		float sum = .0f;
+		for (int i = 0; i < n; i++)
+		{
+			Hit_Record rec = {};
+			float t_max = infinity;
+			if (bvh_closest_hit(*mesh_world.bvh, bounce_rays[i], .0001f, t_max, rec))
+			{
+				sum += rec.t;
+			}
+		}
+		return sum;
+	});
+
+	std::vector<uint64_t> keys;
+	run_benchmark(settings, "trace/diffuse bounce, sorted", bounce_count, [&](int n)
+	{
+		float sum = .0f;
+		for (int first = 0; first < n; first += RAY_SORT_BUFFER_SIZE)
+		{
+			int count = MIN(RAY_SORT_BUFFER_SIZE, n - first);
+			keys.clear();
+			for (int i = 0; i < count; i++)
+			{
+				keys.push_back((ray_sort_key(sort_bounds, bounce_rays[first + i]) << RAY_SORT_INDEX_BITS) | uint64_t(i));
+			}
+			std::sort(keys.begin(), keys.end());
+			for (int i = 0; i < count; i++)
+			{
+				Hit_Record rec = {};
+				float t_max = infinity;
+				int index = first + int(keys[i] & ((uint64_t(1) << RAY_SORT_INDEX_BITS) - 1));
+				if (bvh_closest_hit(*mesh_world.bvh, bounce_rays[index], .0001f, t_max, rec))
+				{
+					sum += rec.t;
+				}
+			}
+		}
+		return sum;
+	});
+}
+
+inline void
+run_benchmarks(Benchmark_Settings& settings)
+{
+	const int iterations = 1024 * 1024;
+	seed_random(1, 0);
+
+	Benchmark_Inputs inputs;
+	for (int i = 0; i < BENCHMARK_INPUT_COUNT; i++)
+	{
+		v3f origin = random_v3f(-4.0f, 4.0f);
+		v3f target = random_v3f(-1.5f, 1.5f);
+		inputs.rays.push_back(Ray(origin, target - origin));
+		inputs.inverse_directions.push_back(inverse_direction(target - origin));
+		inputs.vectors.push_back(random_v3f(-1.0f, 1.0f));
+		inputs.numbers.push_back(random_float());
+	}
+
+	if (settings.csv)
+	{
+		printf("kernel,median ns/op,ops/s,min ns/op,deviation %%\n");
+	}
+	else
+	{
+		printf("USE_SIMD_VECTORS=%d USE_FAST_MATH=%d, sizeof(v3f)=%d, sizeof(Ray)=%d, %d runs per kernel\n", USE_SIMD_VECTORS, USE_FAST_MATH, int(sizeof(v3f)), int(sizeof(Ray)), settings.repetitions);
+	}
+
+	benchmark_vectors(settings, inputs, iterations);
+	benchmark_intersections(settings, inputs, iterations);
+	benchmark_materials(settings, inputs, iterations);
+	benchmark_textures(settings, inputs, iterations);
+	benchmark_sampling(settings, inputs, iterations);
+	benchmark_traversal(settings);
+}
@@ -0,0 +1,673 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// Bounding volume hierarchy over the objects of the world, built with binned SAH once the world is
+// complete. Objects without bounds (planes) are kept aside and tested against every ray. Nodes are
+// stored depth first, so the first child of a node comes right after it.
+//
+// Coherent rays, like the camera rays of neighbouring pixels, can go through it together as a
+// packet. A node is skipped for the whole packet when interval arithmetic over the origins and
+// directions shows none of the rays can reach it, otherwise the rays are tested against it four
+// at a time with SSE (one at a time without SSE2) and only the ones that hit its bounds go on to
+// its objects.
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_DEPTH 64
+#define RAY_PACKET_SIZE 8
+
+struct Bvh_Node
+{
+	Bounds bounds;
+	// second child for interior nodes, first object for leaves
+	int index;
+	// objects in a leaf, 0 for interior nodes
+	int count;
+};
+
+struct Bvh
+{
+	std::vector<Bvh_Node> nodes;
+	// objects of the leaves, in leaf order
+	std::vector<Hittable*> objects;
+	std::vector<Hittable*> unbounded;
+};
+
+struct Ray_Packet
+{
+	int count;
+	Ray rays[RAY_PACKET_SIZE];
+
+	// the rays as structure of arrays for the bounds tests, lanes past count repeat the first ray
+	alignas(16) float origin[3][RAY_PACKET_SIZE];
+	alignas(16) float inverse[3][RAY_PACKET_SIZE];
+	alignas(16) float t_max[RAY_PACKET_SIZE];
+
+	// ranges of the origins and inverse directions, only used when the directions of all rays
+	// have the same signs
+	bool coherent;
+	Bounds origin_range;
+	Bounds inverse_range;
+};
+
+inline float
+bounds_area(Bounds b)
+{
+	v3f extent = b.max - b.min;
+	return 2.0f * (extent.x*extent.y + extent.y*extent.z + extent.z*extent.x);
+}
+
+inline bool
+is_unbounded(Bounds b)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (!(b.max.e[axis] - b.min.e[axis] < infinity))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// 1 / d, with zero turned into a huge value of the same sign so slab tests never multiply
+// zero by infinity
+inline float
+safe_inverse(float d)
+{
+	if (fabs(d) < 1e-20f)
+	{
+		d = d < .0f ? -1e-20f : 1e-20f;
+	}
+	return 1.0f / d;
+}
+
+inline v3f
+inverse_direction(v3f direction)
+{
+	return V3f(safe_inverse(direction.x), safe_inverse(direction.y), safe_inverse(direction.z));
+}
+
+// Where the ray enters the bounds between t_min and t_max, infinity when it doesn't.
+inline float
+bounds_entry(Bounds& bounds, v3f origin, v3f inverse, float t_min, float t_max)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float t0 = (bounds.min.e[axis] - origin.e[axis]) * inverse.e[axis];
+		float t1 = (bounds.max.e[axis] - origin.e[axis]) * inverse.e[axis];
+		if (t0 > t1)
+		{
+			std::swap(t0, t1);
+		}
+		t_min = t0 > t_min ? t0 : t_min;
+		t_max = t1 < t_max ? t1 : t_max;
+	}
+	return t_min <= t_max ? t_min : infinity;
+}
+
+struct Bvh_Build_Object
+{
+	Bounds bounds;
+	v3f center;
+	Hittable* object;
+};
+
+inline int
+build_bvh_node(Bvh& bvh, std::vector<Bvh_Build_Object>& build, int first, int end, int depth)
+{
+	int node_index = int(bvh.nodes.size());
+	bvh.nodes.push_back(Bvh_Node{});
+
+	Bounds bounds = empty_bounds();
+	Bounds centers = empty_bounds();
+	for (int i = first; i < end; i++)
+	{
+		bounds = union_bounds(bounds, build[i].bounds);
+		centers = union_bounds(centers, build[i].center);
+	}
+
+	int count = end - first;
+	int axis = largest_axis(centers);
+	float extent = centers.max.e[axis] - centers.min.e[axis];
+	if (count <= BVH_MAX_LEAF_SIZE || extent <= .0f || depth + 1 >= BVH_MAX_DEPTH)
+	{
+		bvh.nodes[node_index] = Bvh_Node{ bounds, int(bvh.objects.size()), count };
+		for (int i = first; i < end; i++)
+		{
+			bvh.objects.push_back(build[i].object);
+		}
+		return node_index;
+	}
+
+	// sort the centers into bins along the axis and split between the bins where the surface
+	// area heuristic is lowest
+	int bin_counts[BVH_BIN_COUNT] = {};
+	Bounds bin_bounds[BVH_BIN_COUNT];
+	for (int bin = 0; bin < BVH_BIN_COUNT; bin++)
+	{
+		bin_bounds[bin] = empty_bounds();
+	}
+	float bin_scale = float(BVH_BIN_COUNT) / extent;
+	auto bin_of = [&centers, axis, bin_scale](Bvh_Build_Object& object)
+	{
+		int bin = int((object.center.e[axis] - centers.min.e[axis]) * bin_scale);
+		return bin < BVH_BIN_COUNT - 1 ? bin : BVH_BIN_COUNT - 1;
+	};
+	for (int i = first; i < end; i++)
+	{
+		int bin = bin_of(build[i]);
+		bin_counts[bin]++;
+		bin_bounds[bin] = union_bounds(bin_bounds[bin], build[i].bounds);
+	}
+
+	float right_costs[BVH_BIN_COUNT] = {};
+	Bounds right = empty_bounds();
+	int right_count = 0;
+	for (int bin = BVH_BIN_COUNT - 1; bin > 0; bin--)
+	{
+		right = union_bounds(right, bin_bounds[bin]);
+		right_count += bin_counts[bin];
+		right_costs[bin] = right_count ? right_count * bounds_area(right) : .0f;
+	}
+
+	int best_split = 1;
+	float best_cost = infinity;
+	Bounds left = empty_bounds();
+	int left_count = 0;
+	for (int split = 1; split < BVH_BIN_COUNT; split++)
+	{
+		left = union_bounds(left, bin_bounds[split - 1]);
+		left_count += bin_counts[split - 1];
+		float cost = (left_count ? left_count * bounds_area(left) : .0f) + right_costs[split];
+		if (cost < best_cost)
+		{
+			best_cost = cost;
+			best_split = split;
+		}
+	}
+
+	// the lowest and the highest center are in the first and the last bin, so both sides get
+	// something
+	auto middle = std::partition(build.begin() + first, build.begin() + end, [&bin_of, best_split](Bvh_Build_Object& object)
+	{
+		return bin_of(object) < best_split;
+	});
+	int middle_index = int(middle - build.begin());
+
+	build_bvh_node(bvh, build, first, middle_index, depth + 1);
+	int second = build_bvh_node(bvh, build, middle_index, end, depth + 1);
+	bvh.nodes[node_index] = Bvh_Node{ bounds, second, 0 };
+	return node_index;
+}
+
+inline shared_ptr<Bvh>
+build_bvh(World& world)
+{
+	auto bvh = make_shared<Bvh>();
+	std::vector<Bvh_Build_Object> build;
+	build.reserve(world.objects.size());
+	for (shared_ptr<Hittable>& object : world.objects)
+	{
+		Bounds bounds = object->bounds();
+		if (is_unbounded(bounds))
+		{
+			bvh->unbounded.push_back(object.get());
+			continue;
+		}
+
+		// a little padding so flat bounds of axis aligned triangles don't lose hits to rounding
+		v3f padding = V3f(1e-4f, 1e-4f, 1e-4f);
+		bounds = Bounds{ bounds.min - padding, bounds.max + padding };
+		build.push_back(Bvh_Build_Object{ bounds, bounds_center(bounds), object.get() });
+	}
+
+	if (!build.empty())
+	{
+		bvh->nodes.reserve(2 * build.size());
+		build_bvh_node(*bvh, build, 0, int(build.size()), 0);
+	}
+	return bvh;
+}
+
+// Closest hit between t_min and t_max, which is moved to the hit.
+inline bool
+bvh_closest_hit(Bvh& bvh, Ray& r, float t_min, float& t_max, Hit_Record& rec)
+{
+	bool hit = false;
+	for (Hittable* object : bvh.unbounded)
+	{
+		if (object->hit(r, t_min, t_max, rec))
+		{
+			t_max = rec.t;
+			rec.object = object;
+			hit = true;
+		}
+	}
+	if (bvh.nodes.empty())
+	{
+		return hit;
+	}
+
+	// nodes left to visit and where the ray enters them, nearer children are visited first
+	int stack[BVH_MAX_DEPTH];
+	float stack_entries[BVH_MAX_DEPTH];
+	int stack_size = 0;
+
+	v3f inverse = inverse_direction(r.direction);
+	int node_index = 0;
+	if (bounds_entry(bvh.nodes[0].bounds, r.origin, inverse, .0f, t_max) == infinity)
+	{
+		return hit;
+	}
+
+	for (;;)
+	{
+		Bvh_Node& node = bvh.nodes[node_index];
+		RENDER_COUNT(nodes_visited);
+		if (node.count > 0)
+		{
+			for (int i = node.index; i < node.index + node.count; i++)
+			{
+				Hittable* object = bvh.objects[i];
+				if (object->hit(r, t_min, t_max, rec))
+				{
+					t_max = rec.t;
+					rec.object = object;
+					hit = true;
+				}
+			}
+		}
+		else
+		{
+			int first = node_index + 1;
+			int second = node.index;
+			float first_entry = bounds_entry(bvh.nodes[first].bounds, r.origin, inverse, .0f, t_max);
+			float second_entry = bounds_entry(bvh.nodes[second].bounds, r.origin, inverse, .0f, t_max);
+			if (first_entry > second_entry)
+			{
+				std::swap(first, second);
+				std::swap(first_entry, second_entry);
+			}
+			if (first_entry != infinity)
+			{
+				if (second_entry != infinity)
+				{
+					stack[stack_size] = second;
+					stack_entries[stack_size] = second_entry;
+					stack_size++;
+				}
+				node_index = first;
+				continue;
+			}
+		}
+
+		// skip the nodes that start behind the closest hit found since they were pushed
+		do
+		{
+			if (stack_size == 0)
+			{
+				return hit;
+			}
+			stack_size--;
+		} while (stack_entries[stack_size] > t_max);
+		node_index = stack[stack_size];
+	}
+}
+
+// Whether anything is hit between t_min and t_max, in no particular order.
+inline bool
+bvh_any_hit(Bvh& bvh, Ray& r, float t_min, float t_max)
+{
+	Hit_Record rec = {};
+	for (Hittable* object : bvh.unbounded)
+	{
+		if (object->hit(r, t_min, t_max, rec))
+		{
+			return true;
+		}
+	}
+	if (bvh.nodes.empty())
+	{
+		return false;
+	}
+
+	int stack[BVH_MAX_DEPTH + 1];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	v3f inverse = inverse_direction(r.direction);
+	while (stack_size > 0)
+	{
+		int node_index = stack[--stack_size];
+		Bvh_Node& node = bvh.nodes[node_index];
+		RENDER_COUNT(nodes_visited);
+		if (bounds_entry(node.bounds, r.origin, inverse, .0f, t_max) == infinity)
+		{
+			continue;
+		}
+
+		if (node.count > 0)
+		{
+			for (int i = node.index; i < node.index + node.count; i++)
+			{
+				if (bvh.objects[i]->hit(r, t_min, t_max, rec))
+				{
+					return true;
+				}
+			}
+		}
+		else
+		{
+			stack[stack_size++] = node.index;
+			stack[stack_size++] = node_index + 1;
+		}
+	}
+	return false;
+}
+
+// Fills in the arrays of a packet once count rays are in packet.rays, every t_max starts at
+// infinity.
+inline void
+prepare_ray_packet(Ray_Packet& packet, int count)
+{
+	packet.count = count;
+	packet.coherent = true;
+	packet.origin_range = empty_bounds();
+	packet.inverse_range = empty_bounds();
+
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		Ray& r = packet.rays[lane < count ? lane : 0];
+		v3f inverse = inverse_direction(r.direction);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			packet.origin[axis][lane] = r.origin.e[axis];
+			packet.inverse[axis][lane] = inverse.e[axis];
+		}
+		packet.t_max[lane] = infinity;
+
+		packet.origin_range = union_bounds(packet.origin_range, r.origin);
+		packet.inverse_range = union_bounds(packet.inverse_range, inverse);
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (packet.inverse_range.min.e[axis] < .0f && packet.inverse_range.max.e[axis] > .0f)
+		{
+			packet.coherent = false;
+		}
+	}
+}
+
+// Smallest and largest of the products of two ranges. Comparisons instead of fmin and fmax, which
+// can end up as library calls, this runs for every node a packet visits.
+inline void
+multiply_ranges(float a_min, float a_max, float b_min, float b_max, float& low, float& high)
+{
+	float p0 = a_min * b_min;
+	float p1 = a_min * b_max;
+	float p2 = a_max * b_min;
+	float p3 = a_max * b_max;
+	float low01 = p0 < p1 ? p0 : p1;
+	float low23 = p2 < p3 ? p2 : p3;
+	float high01 = p0 > p1 ? p0 : p1;
+	float high23 = p2 > p3 ? p2 : p3;
+	low = low01 < low23 ? low01 : low23;
+	high = high01 > high23 ? high01 : high23;
+}
+
+// True when none of the rays of a coherent packet can reach the bounds: the earliest any of them
+// could enter is after the latest any of them could leave.
+inline bool
+packet_misses_bounds(Ray_Packet& packet, Bounds& bounds)
+{
+	float entry = .0f;
+	float exit = packet.t_max[0];
+	for (int lane = 1; lane < packet.count; lane++)
+	{
+		exit = packet.t_max[lane] > exit ? packet.t_max[lane] : exit;
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		// all rays go the same way along the axis, so they share the near and far planes
+		bool positive = packet.inverse_range.min.e[axis] > .0f;
+		float near_plane = positive ? bounds.min.e[axis] : bounds.max.e[axis];
+		float far_plane = positive ? bounds.max.e[axis] : bounds.min.e[axis];
+		float inverse_min = packet.inverse_range.min.e[axis];
+		float inverse_max = packet.inverse_range.max.e[axis];
+
+		float low, high;
+		multiply_ranges(near_plane - packet.origin_range.max.e[axis], near_plane - packet.origin_range.min.e[axis], inverse_min, inverse_max, low, high);
+		entry = low > entry ? low : entry;
+		multiply_ranges(far_plane - packet.origin_range.max.e[axis], far_plane - packet.origin_range.min.e[axis], inverse_min, inverse_max, low, high);
+		exit = high < exit ? high : exit;
+	}
+	return entry > exit;
+}
+
+// One bit for every ray of the packet that goes through the bounds before its t_max.
+inline int
+packet_bounds_mask(Ray_Packet& packet, Bounds& bounds)
+{
+	int mask = 0;
+#if HAS_SSE2
+	for (int quad = 0; quad < RAY_PACKET_SIZE; quad += 4)
+	{
+		__m128 entry = _mm_setzero_ps();
+		__m128 exit = _mm_load_ps(packet.t_max + quad);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			__m128 origin = _mm_load_ps(packet.origin[axis] + quad);
+			__m128 inverse = _mm_load_ps(packet.inverse[axis] + quad);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.min.e[axis]), origin), inverse);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.max.e[axis]), origin), inverse);
+			entry = _mm_max_ps(entry, _mm_min_ps(t0, t1));
+			exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+		}
+		mask |= _mm_movemask_ps(_mm_cmple_ps(entry, exit)) << quad;
+	}
+#else
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		// the same comparisons as minps and maxps, so NaNs come out the same way
+		float entry = .0f;
+		float exit = packet.t_max[lane];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float t0 = (bounds.min.e[axis] - packet.origin[axis][lane]) * packet.inverse[axis][lane];
+			float t1 = (bounds.max.e[axis] - packet.origin[axis][lane]) * packet.inverse[axis][lane];
+			float near_t = t0 < t1 ? t0 : t1;
+			float far_t = t0 > t1 ? t0 : t1;
+			entry = entry > near_t ? entry : near_t;
+			exit = exit < far_t ? exit : far_t;
+		}
+		mask |= (entry <= exit ? 1 : 0) << lane;
+	}
+#endif
+	return mask & ((1 << packet.count) - 1);
+}
+
+inline int
+lowest_bit(int mask)
+{
+	int bit = 0;
+	while (!(mask & (1 << bit)))
+	{
+		bit++;
+	}
+	return bit;
+}
+
+// Closest hits of the rays of a prepared packet, returns a bit for every ray that hit something
+// with its record in recs.
+inline int
+bvh_closest_hit(Bvh& bvh, Ray_Packet& packet, float t_min, Hit_Record* recs)
+{
+	int hits = 0;
+	for (Hittable* object : bvh.unbounded)
+	{
+		for (int lane = 0; lane < packet.count; lane++)
+		{
+			if (object->hit(packet.rays[lane], t_min, packet.t_max[lane], recs[lane]))
+			{
+				packet.t_max[lane] = recs[lane].t;
+				recs[lane].object = object;
+				hits |= 1 << lane;
+			}
+		}
+	}
+	if (bvh.nodes.empty())
+	{
+		return hits;
+	}
+
+	int stack[BVH_MAX_DEPTH + 1];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		int node_index = stack[--stack_size];
+		Bvh_Node& node = bvh.nodes[node_index];
+		RENDER_COUNT(packet_nodes_visited);
+		if (packet.coherent && packet_misses_bounds(packet, node.bounds))
+		{
+			continue;
+		}
+		int mask = packet_bounds_mask(packet, node.bounds);
+		if (!mask)
+		{
+			continue;
+		}
+
+		if (node.count > 0)
+		{
+			for (int i = node.index; i < node.index + node.count; i++)
+			{
+				Hittable* object = bvh.objects[i];
+				for (int lane = 0; lane < packet.count; lane++)
+				{
+					if ((mask & (1 << lane)) && object->hit(packet.rays[lane], t_min, packet.t_max[lane], recs[lane]))
+					{
+						packet.t_max[lane] = recs[lane].t;
+						recs[lane].object = object;
+						hits |= 1 << lane;
+					}
+				}
+			}
+			continue;
+		}
+
+		// visit first the child that is nearer along the direction of one of the rays
+		int first = node_index + 1;
+		int second = node.index;
+		v3f direction = packet.rays[lowest_bit(mask)].direction;
+		if (dot(bounds_center(bvh.nodes[second].bounds) - bounds_center(bvh.nodes[first].bounds), direction) < .0f)
+		{
+			std::swap(first, second);
+		}
+		stack[stack_size++] = second;
+		stack[stack_size++] = first;
+	}
+	return hits;
+}
+
+// A mesh with its own bvh, shared by all the instances that place it in the world.
+struct Instanced_Mesh
+{
+	std::vector<shared_ptr<Hittable>> triangles;
+	shared_ptr<Bvh> bvh;
+	Bounds bounds;
+};
+
+inline shared_ptr<Instanced_Mesh>
+make_instanced_mesh(std::vector<shared_ptr<Hittable>>& triangles)
+{
+	auto mesh = make_shared<Instanced_Mesh>();
+	World mesh_world = {};
+	mesh_world.objects.swap(triangles);
+	mesh->bvh = build_bvh(mesh_world);
+	mesh->triangles.swap(mesh_world.objects);
+	mesh->bounds = mesh->bvh->nodes.empty() ? empty_bounds() : mesh->bvh->nodes[0].bounds;
+	return mesh;
+}
+
+inline shared_ptr<Bvh>
+copy_bvh(Bvh& bvh, World_Copy& world_copy)
+{
+	auto copy = make_shared<Bvh>();
+	copy->nodes = bvh.nodes;
+	copy->objects.reserve(bvh.objects.size());
+	for (Hittable* object : bvh.objects)
+	{
+		copy->objects.push_back(world_copy.objects[object]);
+	}
+	for (Hittable* object : bvh.unbounded)
+	{
+		copy->unbounded.push_back(world_copy.objects[object]);
+	}
+	return copy;
+}
+
+inline shared_ptr<Instanced_Mesh>
+copy_instanced_mesh(Instanced_Mesh& mesh, World_Copy& world_copy)
+{
+	shared_ptr<Instanced_Mesh>& copy = world_copy.meshes[&mesh];
+	if (copy)
+	{
+		return copy;
+	}
+	copy = make_shared<Instanced_Mesh>();
+	copy->triangles.reserve(mesh.triangles.size());
+	for (shared_ptr<Hittable>& triangle : mesh.triangles)
+	{
+		copy->triangles.push_back(triangle->copy(world_copy));
+		world_copy.objects[triangle.get()] = copy->triangles.back().get();
+	}
+	copy->bvh = copy_bvh(*mesh.bvh, world_copy);
+	copy->bounds = mesh.bounds;
+	return copy;
+}
+
+// A mesh scaled and moved into place. The ray goes into the space of the mesh instead, with a
+// uniform scale the distance along it stays the same. Instances can't be lights.
+struct Instance : public Hittable
+{
+	shared_ptr<Instanced_Mesh> mesh;
+	v3f offset;
+	float scale;
+
+	Instance(shared_ptr<Instanced_Mesh> m, v3f o, float s) : mesh(m), offset(o), scale(s) {}
+
+	Material* material() override { return nullptr; }
+
+	shared_ptr<Hittable> copy(World_Copy& world_copy) override
+	{
+		return make_shared<Instance>(copy_instanced_mesh(*mesh, world_copy), offset, scale);
+	}
+
+	bool hit(Ray r, float t_min, float t_max, Hit_Record& rec) override
+	{
+		RENDER_COUNT(primitive_tests[PRIMITIVE_INSTANCE]);
+		float inverse_scale = 1.0f / scale;
+		Ray local(inverse_scale * (r.origin - offset), inverse_scale * r.direction);
+		if (!bvh_closest_hit(*mesh->bvh, local, t_min, t_max, rec))
+		{
+			return false;
+		}
+
+		rec.p = scale * rec.p + offset;
+		rec.dpdu = scale * rec.dpdu;
+		rec.dpdv = scale * rec.dpdv;
+		return true;
+	}
+
+	Bounds bounds() override
+	{
+		return Bounds{ scale * mesh->bounds.min + offset, scale * mesh->bounds.max + offset };
+	}
+};
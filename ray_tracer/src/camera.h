@@ -41,4 +41,18 @@ struct Camera
 
 		return r;
 	}
+
+	// film_dx and film_dy are the size of the pixel footprint on the film
+	Ray get_ray(float film_x, float film_y, float film_dx, float film_dy, Ray_Differential& differential)
+	{
+		Ray r = get_ray(film_x, film_y);
+
+		differential.valid = true;
+		differential.rx_origin = r.origin;
+		differential.ry_origin = r.origin;
+		differential.rx_direction = r.direction + film_dx*horizontal;
+		differential.ry_direction = r.direction + film_dy*vertical;
+
+		return r;
+	}
 };
\ No newline at end of file
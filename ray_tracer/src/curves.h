@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+
+// Space filling curves, used to walk tiles and pixels in an order where consecutive items
+// stay close to each other on screen and therefore touch the same geometry and texels.
+
+inline uint32_t
+next_power_of_two(uint32_t x)
+{
+	uint32_t result = 1;
+	while (result < x)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+// Spreads the lower 16 bits of x so that there is a zero bit between every two bits.
+inline uint32_t
+part_by_1(uint32_t x)
+{
+	x &= 0x0000FFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+inline uint32_t
+compact_by_1(uint32_t x)
+{
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0F0F0F0F;
+	x = (x | (x >> 4)) & 0x00FF00FF;
+	x = (x | (x >> 8)) & 0x0000FFFF;
+	return x;
+}
+
+inline uint32_t
+morton_encode(uint32_t x, uint32_t y)
+{
+	return part_by_1(x) | (part_by_1(y) << 1);
+}
+
+inline void
+morton_decode(uint32_t code, uint32_t& x, uint32_t& y)
+{
+	x = compact_by_1(code);
+	y = compact_by_1(code >> 1);
+}
+
+// Spreads the lower 10 bits of x so that there are two zero bits between every two bits.
+inline uint32_t
+part_by_2(uint32_t x)
+{
+	x &= 0x000003FF;
+	x = (x | (x << 16)) & 0xFF0000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// 30 bit code of a cell of a 1024^3 grid.
+inline uint32_t
+morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return part_by_2(x) | (part_by_2(y) << 1) | (part_by_2(z) << 2);
+}
+
+// n is the side of the square covered by the curve and must be a power of two.
+inline uint32_t
+hilbert_encode(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// rotate the quadrant so the curve stays continuous
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
+
+inline void
+hilbert_decode(uint32_t n, uint32_t d, uint32_t& x, uint32_t& y)
+{
+	x = 0;
+	y = 0;
+	for (uint32_t s = 1; s < n; s *= 2)
+	{
+		uint32_t rx = 1 & (d / 2);
+		uint32_t ry = 1 & (d ^ rx);
+
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <vector>
+
+#include "sampling.h"
+
+// Environment map lighting the scene from infinitely far away. It is kept as a lat-long image,
+// cube maps get resampled to one when they are loaded. Column 0 and the left edge of the image is
+// +x, the image goes around towards +z, row 0 looks straight up.
+//
+// Next to the texels there is a distribution proportional to their brightness, so bounces can
+// send rays towards the sun and other bright spots instead of finding them by chance.
+
+struct Environment_Map
+{
+	int width, height;
+	std::vector<v3f> texels;
+	Distribution_2D distribution;
+};
+
+inline float
+luminance(v3f color)
+{
+	return .2126f*color.r + .7152f*color.g + .0722f*color.b;
+}
+
+inline v3f
+lat_long_direction(float u, float v)
+{
+	float sin_phi, cos_phi, sin_theta, cos_theta;
+	fast_sincos(u * 2.0f * PI, sin_phi, cos_phi);
+	fast_sincos(v * PI, sin_theta, cos_theta);
+	return v3f{ sin_theta * cos_phi, cos_theta, sin_theta * sin_phi };
+}
+
+// direction must be normalized
+inline void
+lat_long_coordinates(v3f direction, float& u, float& v)
+{
+	float phi = fast_atan2(direction.z, direction.x);
+	if (phi < .0f)
+	{
+		phi += 2.0f * PI;
+	}
+	u = phi / (2.0f * PI);
+	v = fast_acos(direction.y) / PI;
+}
+
+// Any image stb_image can read, .hdr files keep their range and the rest is read as is, the same
+// way textures are.
+inline bool
+load_float_image(const char* file_name, int& width, int& height, std::vector<v3f>& pixels)
+{
+	int components = 0;
+	if (stbi_is_hdr(file_name))
+	{
+		float* data = stbi_loadf(file_name, &width, &height, &components, 3);
+		if (!data)
+		{
+			return false;
+		}
+		pixels.resize(size_t(width) * height);
+		for (size_t i = 0; i < pixels.size(); i++)
+		{
+			pixels[i] = v3f{ data[i * 3], data[i * 3 + 1], data[i * 3 + 2] };
+		}
+		stbi_image_free(data);
+		return true;
+	}
+
+	unsigned char* data = stbi_load(file_name, &width, &height, &components, 3);
+	if (!data)
+	{
+		return false;
+	}
+	const float color_scale = 1.0f / 255.0f;
+	pixels.resize(size_t(width) * height);
+	for (size_t i = 0; i < pixels.size(); i++)
+	{
+		pixels[i] = v3f{ color_scale*data[i * 3], color_scale*data[i * 3 + 1], color_scale*data[i * 3 + 2] };
+	}
+	stbi_image_free(data);
+	return true;
+}
+
+inline void
+build_environment_distribution(Environment_Map& environment)
+{
+	// rows near the poles cover less solid angle
+	std::vector<float> function(environment.texels.size());
+	for (int y = 0; y < environment.height; y++)
+	{
+		float sin_theta = (float)sin(PI * (float(y) + .5f) / float(environment.height));
+		for (int x = 0; x < environment.width; x++)
+		{
+			int index = y * environment.width + x;
+			function[index] = luminance(environment.texels[index]) * sin_theta;
+		}
+	}
+	build_distribution(environment.distribution, function.data(), environment.width, environment.height);
+}
+
+inline bool
+load_environment_map(Environment_Map& environment, const char* file_name)
+{
+	if (!load_float_image(file_name, environment.width, environment.height, environment.texels))
+	{
+		fprintf(stderr, "ERROR: Could not load environment map '%s'.\n", file_name);
+		return false;
+	}
+	build_environment_distribution(environment);
+	return true;
+}
+
+// Face of a cube map a direction points at, in the usual cube map order: +x, -x, +y, -y, +z, -z
+// (right, left, top, bottom, front, back) with the faces oriented like OpenGL expects them.
+// face_u and face_v are in [0, 1], v goes down the image.
+inline int
+cube_face_coordinates(v3f d, float& face_u, float& face_v)
+{
+	int face;
+	float major, s, t;
+	float ax = (float)fabs(d.x);
+	float ay = (float)fabs(d.y);
+	float az = (float)fabs(d.z);
+	if (ax >= ay && ax >= az)
+	{
+		face = d.x > .0f ? 0 : 1;
+		major = ax;
+		s = d.x > .0f ? -d.z : d.z;
+		t = -d.y;
+	}
+	else if (ay >= az)
+	{
+		face = d.y > .0f ? 2 : 3;
+		major = ay;
+		s = d.x;
+		t = d.y > .0f ? d.z : -d.z;
+	}
+	else
+	{
+		face = d.z > .0f ? 4 : 5;
+		major = az;
+		s = d.z > .0f ? d.x : -d.x;
+		t = -d.y;
+	}
+
+	face_u = .5f * (s / major + 1.0f);
+	face_v = .5f * (t / major + 1.0f);
+	return face;
+}
+
+// Resamples the six faces, in cube_face_coordinates order, to a lat-long map width texels wide.
+// Faces are loaded one at a time to keep only one of them in memory.
+inline bool
+load_cube_environment_map(Environment_Map& environment, const char* face_files[6], int width)
+{
+	environment.width = width;
+	environment.height = width / 2;
+	environment.texels.resize(size_t(environment.width) * environment.height);
+
+	std::vector<unsigned char> texel_faces(environment.texels.size());
+	for (int y = 0; y < environment.height; y++)
+	{
+		for (int x = 0; x < environment.width; x++)
+		{
+			float face_u, face_v;
+			v3f d = lat_long_direction((float(x) + .5f) / float(environment.width), (float(y) + .5f) / float(environment.height));
+			texel_faces[y * environment.width + x] = (unsigned char)cube_face_coordinates(d, face_u, face_v);
+		}
+	}
+
+	std::vector<v3f> pixels;
+	for (int face = 0; face < 6; face++)
+	{
+		int face_width = 0;
+		int face_height = 0;
+		if (!load_float_image(face_files[face], face_width, face_height, pixels))
+		{
+			fprintf(stderr, "ERROR: Could not load environment map face '%s'.\n", face_files[face]);
+			return false;
+		}
+
+		for (int y = 0; y < environment.height; y++)
+		{
+			for (int x = 0; x < environment.width; x++)
+			{
+				int index = y * environment.width + x;
+				if (texel_faces[index] != face)
+				{
+					continue;
+				}
+
+				float face_u, face_v;
+				v3f d = lat_long_direction((float(x) + .5f) / float(environment.width), (float(y) + .5f) / float(environment.height));
+				cube_face_coordinates(d, face_u, face_v);
+				int i = clamp_index(int(face_u * face_width), face_width);
+				int j = clamp_index(int(face_v * face_height), face_height);
+				environment.texels[index] = pixels[j * face_width + i];
+			}
+		}
+	}
+
+	build_environment_distribution(environment);
+	return true;
+}
+
+inline v3f
+environment_radiance(Environment_Map& environment, v3f direction)
+{
+	float u, v;
+	lat_long_coordinates(normalize(direction), u, v);
+	int x = clamp_index(int(u * environment.width), environment.width);
+	int y = clamp_index(int(v * environment.height), environment.height);
+	return environment.texels[y * environment.width + x];
+}
+
+// Density, with respect to solid angle, of sample_environment picking the direction.
+inline float
+environment_pdf(Environment_Map& environment, v3f direction)
+{
+	float u, v;
+	lat_long_coordinates(normalize(direction), u, v);
+	float sin_theta = fast_sin(v * PI);
+	if (sin_theta <= .0f)
+	{
+		return .0f;
+	}
+	return distribution_pdf(environment.distribution, u, v) / (2.0f * PI * PI * sin_theta);
+}
+
+// Picks a direction towards the environment in proportion to its brightness, returns the
+// radiance coming from it. pdf is with respect to solid angle and is 0 for unusable samples.
+inline v3f
+sample_environment(Environment_Map& environment, float u1, float u2, v3f& direction, float& pdf)
+{
+	float u, v, uv_pdf;
+	sample_distribution(environment.distribution, u1, u2, u, v, uv_pdf);
+
+	direction = lat_long_direction(u, v);
+	float sin_theta = fast_sin(v * PI);
+	pdf = sin_theta > .0f ? uv_pdf / (2.0f * PI * PI * sin_theta) : .0f;
+
+	int x = clamp_index(int(u * environment.width), environment.width);
+	int y = clamp_index(int(v * environment.height), environment.height);
+	return environment.texels[y * environment.width + x];
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+// Float approximations of the libm functions used while shading: sphere texture coordinates,
+// sampling directions, procedural textures and mip levels. They work on four floats at a time with
+// SSE2, the scalar versions use one lane, and they are within a few ulp of the float libm results
+// (the polynomials are the ones of the Cephes float library). Sine and cosine reduce the argument
+// exactly up to a few thousand, after that they slowly lose precision.
+//
+// Build with USE_FAST_MATH=0 to use the C library instead, for instance to compare images. Builds
+// without SSE2 always use the C library.
+
+#ifndef USE_FAST_MATH
+#define USE_FAST_MATH 1
+#endif
+
+#if HAS_SSE2
+
+// mask ? a : b for masks from the comparisons
+inline __m128
+select4(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128
+abs4(__m128 x)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-.0f), x);
+}
+
+inline __m128
+sign_bit4(__m128 x)
+{
+	return _mm_and_ps(_mm_set1_ps(-.0f), x);
+}
+
+// a*b + c
+inline __m128
+madd4(__m128 a, __m128 b, __m128 c)
+{
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+
+inline void
+fast_sincos4(__m128 x, __m128& sin_x, __m128& cos_x)
+{
+	// x = k*pi/2 + r with r in [-pi/4, pi/4], pi/2 is split in three parts so that k times the
+	// first ones is exact
+	__m128i k = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(.636619772f)));
+	__m128 k_float = _mm_cvtepi32_ps(k);
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(k_float, _mm_set1_ps(1.5703125f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(k_float, _mm_set1_ps(4.837512969970703125e-4f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(k_float, _mm_set1_ps(7.54978995489e-8f)));
+	__m128 z = _mm_mul_ps(r, r);
+
+	__m128 sin_r = madd4(_mm_set1_ps(-1.9515295891e-4f), z, _mm_set1_ps(8.3321608736e-3f));
+	sin_r = madd4(sin_r, z, _mm_set1_ps(-1.6666654611e-1f));
+	sin_r = madd4(_mm_mul_ps(sin_r, z), r, r);
+
+	__m128 cos_r = madd4(_mm_set1_ps(2.443315711809948e-5f), z, _mm_set1_ps(-1.388731625493765e-3f));
+	cos_r = madd4(cos_r, z, _mm_set1_ps(4.166664568298827e-2f));
+	cos_r = madd4(_mm_mul_ps(cos_r, z), z, _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(.5f), z)));
+
+	// odd quadrants swap sine and cosine, bit 1 of k flips the sine and bit 1 of k + 1 the cosine
+	__m128i one = _mm_set1_epi32(1);
+	__m128i two = _mm_set1_epi32(2);
+	__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(k, one), one));
+	__m128 sin_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(k, two), 30));
+	__m128 cos_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(k, one), two), 30));
+	sin_x = _mm_xor_ps(select4(swap, cos_r, sin_r), sin_sign);
+	cos_x = _mm_xor_ps(select4(swap, sin_r, cos_r), cos_sign);
+}
+
+inline __m128
+fast_sin4(__m128 x)
+{
+	__m128 sin_x, cos_x;
+	fast_sincos4(x, sin_x, cos_x);
+	return sin_x;
+}
+
+inline __m128
+fast_cos4(__m128 x)
+{
+	__m128 sin_x, cos_x;
+	fast_sincos4(x, sin_x, cos_x);
+	return cos_x;
+}
+
+// x is clamped to [-1, 1]
+inline __m128
+fast_acos4(__m128 x)
+{
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 half_pi = _mm_set1_ps(.5f * PI);
+	__m128 a = _mm_min_ps(abs4(x), one);
+
+	// asin(a) is a polynomial for a <= .5, above that acos(a) = 2 asin(sqrt((1 - a) / 2))
+	__m128 big = _mm_cmpgt_ps(a, _mm_set1_ps(.5f));
+	__m128 z = select4(big, _mm_mul_ps(_mm_set1_ps(.5f), _mm_sub_ps(one, a)), _mm_mul_ps(a, a));
+	__m128 s = select4(big, _mm_sqrt_ps(z), a);
+
+	__m128 p = madd4(_mm_set1_ps(4.2163199048e-2f), z, _mm_set1_ps(2.4181311049e-2f));
+	p = madd4(p, z, _mm_set1_ps(4.5470025998e-2f));
+	p = madd4(p, z, _mm_set1_ps(7.4953002686e-2f));
+	p = madd4(p, z, _mm_set1_ps(1.6666752422e-1f));
+	p = madd4(_mm_mul_ps(p, z), s, s);
+
+	__m128 negative = _mm_cmplt_ps(x, _mm_setzero_ps());
+	__m128 twice_p = _mm_add_ps(p, p);
+	__m128 big_result = select4(negative, _mm_sub_ps(_mm_set1_ps(PI), twice_p), twice_p);
+	__m128 small_result = _mm_sub_ps(half_pi, _mm_xor_ps(p, sign_bit4(x)));
+	return select4(big, big_result, small_result);
+}
+
+inline __m128
+fast_atan2_4(__m128 y, __m128 x)
+{
+	__m128 ax = abs4(x);
+	__m128 ay = abs4(y);
+	__m128 largest = _mm_max_ps(ax, ay);
+	__m128 a = _mm_div_ps(_mm_min_ps(ax, ay), largest);
+	a = _mm_andnot_ps(_mm_cmpeq_ps(largest, _mm_setzero_ps()), a);
+
+	// atan(a) for a in [0, 1], above tan(pi/8) it is pi/4 + atan((a - 1) / (a + 1))
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 middle = _mm_cmpgt_ps(a, _mm_set1_ps(.414213562f));
+	__m128 t = select4(middle, _mm_div_ps(_mm_sub_ps(a, one), _mm_add_ps(a, one)), a);
+	__m128 z = _mm_mul_ps(t, t);
+	__m128 p = madd4(_mm_set1_ps(8.05374449538e-2f), z, _mm_set1_ps(-1.38776856032e-1f));
+	p = madd4(p, z, _mm_set1_ps(1.99777106478e-1f));
+	p = madd4(p, z, _mm_set1_ps(-3.33329491539e-1f));
+	p = madd4(_mm_mul_ps(p, z), t, t);
+	__m128 r = _mm_add_ps(p, _mm_and_ps(middle, _mm_set1_ps(.25f * PI)));
+
+	// back to the octant and quadrant of (x, y)
+	r = select4(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(.5f * PI), r), r);
+	r = select4(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(PI), r), r);
+	return _mm_or_ps(r, sign_bit4(y));
+}
+
+// x is clamped to [-87, 88], so the result stays a normal float
+inline __m128
+fast_exp4(__m128 x)
+{
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.0f));
+
+	// x = n ln(2) + r, exp(x) = 2^n exp(r)
+	__m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)));
+	__m128 n_float = _mm_cvtepi32_ps(n);
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(n_float, _mm_set1_ps(.693359375f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(n_float, _mm_set1_ps(-2.12194440e-4f)));
+
+	__m128 p = madd4(_mm_set1_ps(1.9875691500e-4f), r, _mm_set1_ps(1.3981999507e-3f));
+	p = madd4(p, r, _mm_set1_ps(8.3334519073e-3f));
+	p = madd4(p, r, _mm_set1_ps(4.1665795894e-2f));
+	p = madd4(p, r, _mm_set1_ps(1.6666665459e-1f));
+	p = madd4(p, r, _mm_set1_ps(5.0000001201e-1f));
+	p = madd4(p, _mm_mul_ps(r, r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(p, scale);
+}
+
+// Natural logarithm, x <= 0 gives log of the smallest normal float (about -87.3).
+inline __m128
+fast_log4(__m128 x)
+{
+	x = _mm_max_ps(x, _mm_set1_ps(1.17549435e-38f));
+
+	// x = m 2^e with m in [sqrt(1/2), sqrt(2))
+	__m128i bits = _mm_castps_si128(x);
+	__m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f000000)));
+	__m128 e = _mm_cvtepi32_ps(exponent);
+
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 small = _mm_cmplt_ps(m, _mm_set1_ps(.707106781186547524f));
+	e = _mm_sub_ps(e, _mm_and_ps(small, one));
+	m = _mm_add_ps(_mm_sub_ps(m, one), _mm_and_ps(small, m));
+	__m128 z = _mm_mul_ps(m, m);
+
+	__m128 p = madd4(_mm_set1_ps(7.0376836292e-2f), m, _mm_set1_ps(-1.1514610310e-1f));
+	p = madd4(p, m, _mm_set1_ps(1.1676998740e-1f));
+	p = madd4(p, m, _mm_set1_ps(-1.2420140846e-1f));
+	p = madd4(p, m, _mm_set1_ps(1.4249322787e-1f));
+	p = madd4(p, m, _mm_set1_ps(-1.6668057665e-1f));
+	p = madd4(p, m, _mm_set1_ps(2.0000714765e-1f));
+	p = madd4(p, m, _mm_set1_ps(-2.4999993993e-1f));
+	p = madd4(p, m, _mm_set1_ps(3.3333331174e-1f));
+	p = _mm_mul_ps(_mm_mul_ps(p, m), z);
+
+	p = madd4(e, _mm_set1_ps(-2.12194440e-4f), p);
+	p = madd4(z, _mm_set1_ps(-.5f), p);
+	return madd4(e, _mm_set1_ps(.693359375f), _mm_add_ps(m, p));
+}
+
+// x^y for x > 0
+inline __m128
+fast_pow4(__m128 x, __m128 y)
+{
+	return fast_exp4(_mm_mul_ps(y, fast_log4(x)));
+}
+
+#endif
+
+#if USE_FAST_MATH && HAS_SSE2
+
+inline void
+fast_sincos(float x, float& sin_x, float& cos_x)
+{
+	__m128 s, c;
+	fast_sincos4(_mm_set_ss(x), s, c);
+	sin_x = _mm_cvtss_f32(s);
+	cos_x = _mm_cvtss_f32(c);
+}
+
+inline float fast_sin(float x) { return _mm_cvtss_f32(fast_sin4(_mm_set_ss(x))); }
+inline float fast_cos(float x) { return _mm_cvtss_f32(fast_cos4(_mm_set_ss(x))); }
+inline float fast_acos(float x) { return _mm_cvtss_f32(fast_acos4(_mm_set_ss(x))); }
+inline float fast_atan2(float y, float x) { return _mm_cvtss_f32(fast_atan2_4(_mm_set_ss(y), _mm_set_ss(x))); }
+inline float fast_exp(float x) { return _mm_cvtss_f32(fast_exp4(_mm_set_ss(x))); }
+inline float fast_log(float x) { return _mm_cvtss_f32(fast_log4(_mm_set_ss(x))); }
+inline float fast_log2(float x) { return 1.44269504088896341f * fast_log(x); }
+inline float fast_pow(float x, float y) { return _mm_cvtss_f32(fast_pow4(_mm_set_ss(x), _mm_set_ss(y))); }
+
+inline v3f
+fast_sin(v3f x)
+{
+#if USE_SIMD_VECTORS
+	return V3f(fast_sin4(x.m));
+#else
+	__m128 s = fast_sin4(_mm_setr_ps(x.x, x.y, x.z, .0f));
+	float result[4];
+	_mm_storeu_ps(result, s);
+	return v3f{ result[0], result[1], result[2] };
+#endif
+}
+
+#else
+
+inline void
+fast_sincos(float x, float& sin_x, float& cos_x)
+{
+	sin_x = sinf(x);
+	cos_x = cosf(x);
+}
+
+inline float fast_sin(float x) { return sinf(x); }
+inline float fast_cos(float x) { return cosf(x); }
+inline float fast_acos(float x) { return acosf(clamp(x, -1.0f, 1.0f)); }
+inline float fast_atan2(float y, float x) { return atan2f(y, x); }
+inline float fast_exp(float x) { return expf(x); }
+inline float fast_log(float x) { return logf(x); }
+inline float fast_log2(float x) { return log2f(x); }
+inline float fast_pow(float x, float y) { return powf(x, y); }
+
+inline v3f
+fast_sin(v3f x)
+{
+	return v3f{ sinf(x.x), sinf(x.y), sinf(x.z) };
+}
+
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// What every pixel of a frame cost, written as a false color image next to the render so it shows
+// which objects and materials make the frame slow. Black is cheap, through purple and orange to
+// pale yellow for the most expensive pixels. The scale ends at the 99.5th percentile so a handful
+// of outliers don't leave the rest of the image black.
+
+enum Heatmap_Mode
+{
+	HEATMAP_NONE,
+	// time stamp counter cycles spent on the pixel
+	HEATMAP_TIME,
+	// camera, bounce and shadow rays traced for the pixel
+	HEATMAP_RAYS,
+	// bvh nodes visited and primitives tested for the pixel, needs USE_RENDER_COUNTERS=1
+	HEATMAP_TESTS,
+};
+
+static const char* heatmap_mode_names[] =
+{
+	"none",
+	"time",
+	"rays",
+	"tests",
+};
+
+static const char* heatmap_units[] =
+{
+	"",
+	"cycles",
+	"rays",
+	"nodes and tests",
+};
+
+struct Heatmap
+{
+	Heatmap_Mode mode;
+	int width;
+	int height;
+	// bottom to top like the image
+	std::vector<float> costs;
+};
+
+inline v3f
+heatmap_color(float t)
+{
+	// inferno at 0, .25, .5, .75 and 1
+	static const v3f keys[5] =
+	{
+		v3f{ .0f, .0f, .016f },
+		v3f{ .341f, .063f, .431f },
+		v3f{ .737f, .216f, .329f },
+		v3f{ .976f, .557f, .035f },
+		v3f{ .988f, 1.0f, .643f },
+	};
+
+	t = clamp(t, .0f, 1.0f) * 4.0f;
+	int key = MIN(int(t), 3);
+	float f = t - float(key);
+	return (1.0f - f) * keys[key] + f * keys[key + 1];
+}
+
+inline bool
+write_heatmap(const char* file_name, Heatmap& heatmap)
+{
+	std::vector<float> sorted = heatmap.costs;
+	size_t percentile = MIN(sorted.size() - 1, sorted.size() * 995 / 1000);
+	std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+	float scale = sorted[percentile];
+	double total = .0;
+	for (float cost : heatmap.costs)
+	{
+		total += cost;
+	}
+
+	Image image = {};
+	image.width = heatmap.width;
+	image.height = heatmap.height;
+	std::vector<uint32_t> pixels(heatmap.costs.size());
+	image.pixels = pixels.data();
+	for (size_t i = 0; i < heatmap.costs.size(); i++)
+	{
+		pixels[i] = unpack_rgba(heatmap_color(scale > .0f ? heatmap.costs[i] / scale : .0f));
+	}
+	if (!write_ppm(file_name, image))
+	{
+		return false;
+	}
+
+	printf("Heatmap written to %s: %.0f %s per pixel on average, brightest at %.0f\n", file_name,
+		total / double(heatmap.costs.size()), heatmap_units[heatmap.mode], scale);
+	return true;
+}
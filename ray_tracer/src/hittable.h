@@ -1,6 +1,10 @@
 #pragma once
 
+#include <unordered_map>
+
 struct Material;
+struct Hittable;
+struct Instanced_Mesh;
 
 struct Hit_Record
 {
@@ -8,22 +12,199 @@ struct Hit_Record
 	v3f n;
 	bool from_outside;
 	shared_ptr<Material> mat;
+	Hittable* object; // set by closest_hit
 	float t;
 	v3f color;
 
 	float u;
 	float v;
+
+	// derivatives of the hit point with respect to the texture coordinates, zero for surfaces
+	// without texture coordinates
+	v3f dpdu;
+	v3f dpdv;
+
+	// pixel footprint on the surface, filled in by compute_hit_differentials
+	v3f dpdx;
+	v3f dpdy;
+	float dudx, dvdx;
+	float dudy, dvdy;
+};
+
+// Intersects the differential rays with the tangent plane at the hit point and projects the
+// offsets on dpdu and dpdv to get how much the texture coordinates change from pixel to pixel.
+inline void
+compute_hit_differentials(Hit_Record& rec, Ray_Differential& differential)
+{
+	rec.dpdx = rec.dpdy = v3f{ .0f, .0f, .0f };
+	rec.dudx = rec.dvdx = rec.dudy = rec.dvdy = .0f;
+	if (!differential.valid)
+	{
+		return;
+	}
+
+	float d = dot(rec.n, rec.p);
+	float denom_x = dot(rec.n, differential.rx_direction);
+	float denom_y = dot(rec.n, differential.ry_direction);
+	if (denom_x == .0f || denom_y == .0f)
+	{
+		differential.valid = false;
+		return;
+	}
+
+	float tx = (d - dot(rec.n, differential.rx_origin)) / denom_x;
+	float ty = (d - dot(rec.n, differential.ry_origin)) / denom_y;
+	rec.dpdx = differential.rx_origin + tx*differential.rx_direction - rec.p;
+	rec.dpdy = differential.ry_origin + ty*differential.ry_direction - rec.p;
+
+	// least squares solution of dpdx = dpdu*dudx + dpdv*dvdx using the two axes where the
+	// surface is the least foreshortened
+	int dim0, dim1;
+	if (fabs(rec.n.x) > fabs(rec.n.y) && fabs(rec.n.x) > fabs(rec.n.z))
+	{
+		dim0 = 1;
+		dim1 = 2;
+	}
+	else if (fabs(rec.n.y) > fabs(rec.n.z))
+	{
+		dim0 = 0;
+		dim1 = 2;
+	}
+	else
+	{
+		dim0 = 0;
+		dim1 = 1;
+	}
+
+	float a00 = rec.dpdu.e[dim0], a01 = rec.dpdv.e[dim0];
+	float a10 = rec.dpdu.e[dim1], a11 = rec.dpdv.e[dim1];
+	float determinant = a00*a11 - a01*a10;
+	if (fabs(determinant) < 1e-12f)
+	{
+		return;
+	}
+
+	float inv_determinant = 1.0f / determinant;
+	rec.dudx = (a11*rec.dpdx.e[dim0] - a01*rec.dpdx.e[dim1]) * inv_determinant;
+	rec.dvdx = (a00*rec.dpdx.e[dim1] - a10*rec.dpdx.e[dim0]) * inv_determinant;
+	rec.dudy = (a11*rec.dpdy.e[dim0] - a01*rec.dpdy.e[dim1]) * inv_determinant;
+	rec.dvdy = (a00*rec.dpdy.e[dim1] - a10*rec.dpdy.e[dim0]) * inv_determinant;
+}
+
+struct Bounds
+{
+	v3f min;
+	v3f max;
+};
+
+inline Bounds
+empty_bounds()
+{
+	return Bounds{ v3f{ infinity, infinity, infinity }, v3f{ -infinity, -infinity, -infinity } };
+}
+
+inline v3f
+min_v3f(v3f a, v3f b)
+{
+	return V3f(a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z);
+}
+
+inline v3f
+max_v3f(v3f a, v3f b)
+{
+	return V3f(a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z);
+}
+
+inline Bounds
+union_bounds(Bounds a, Bounds b)
+{
+	return Bounds{ min_v3f(a.min, b.min), max_v3f(a.max, b.max) };
+}
+
+inline Bounds
+union_bounds(Bounds a, v3f p)
+{
+	return union_bounds(a, Bounds{ p, p });
+}
+
+inline v3f
+bounds_center(Bounds b)
+{
+	return .5f * (b.min + b.max);
+}
+
+inline int
+largest_axis(Bounds b)
+{
+	v3f extent = b.max - b.min;
+	if (extent.x > extent.y && extent.x > extent.z) return 0;
+	if (extent.y > extent.z) return 1;
+	return 2;
+}
+
+// Orthonormal vectors perpendicular to the unit vector w.
+inline void
+make_basis(v3f w, v3f& u, v3f& v)
+{
+	v3f helper = fabs(w.x) > .9f ? v3f{ .0f, 1.0f, .0f } : v3f{ 1.0f, .0f, .0f };
+	u = normalize(cross(helper, w));
+	v = cross(w, u);
+}
+
+// The copies made so far while a world is copied, see copy_world. Meshes shared by several
+// instances are copied once.
+struct World_Copy
+{
+	std::unordered_map<Hittable*, Hittable*> objects;
+	std::unordered_map<Instanced_Mesh*, shared_ptr<Instanced_Mesh>> meshes;
 };
 
 struct Hittable
 {
+	// index in the light sampler of the world, for objects with an emissive material
+	int light_index = -1;
+
 	virtual bool hit(Ray r, float t_min, float t_max, Hit_Record& rec) = 0;
+	virtual Material* material() = 0;
+	// For a replica of the world, the material is shared.
+	virtual shared_ptr<Hittable> copy(World_Copy& world_copy) = 0;
+
+	virtual Bounds bounds()
+	{
+		return Bounds{ v3f{ -infinity, -infinity, -infinity }, v3f{ infinity, infinity, infinity } };
+	}
+
+	// The rest is only needed by shapes that can be lights.
+	virtual float area() { return .0f; }
+
+	// Normals of the surface fit in the cone around axis with cos_theta, both sides can face out.
+	virtual void normal_cone(v3f& axis, float& cos_theta)
+	{
+		axis = v3f{ .0f, .0f, 1.0f };
+		cos_theta = -1.0f;
+	}
+
+	// Picks a direction from a point towards the shape, pdf is with respect to solid angle.
+	virtual bool sample_direction(v3f from, float u1, float u2, v3f& direction, float& pdf) { return false; }
+
+	// Density of sample_direction picking the direction that hit the shape at rec.
+	virtual float direction_pdf(v3f from, Hit_Record& rec) { return .0f; }
 };
 
+struct Environment_Map;
+struct Light_Sampler;
+struct Bvh;
+
 struct World
 {
 	v3f background;
+	// lights the scene instead of background when there is one
+	shared_ptr<Environment_Map> environment;
+	// objects with an emissive material, built once the world is complete
+	shared_ptr<Light_Sampler> lights;
 	vector<shared_ptr<Hittable>> objects;
+	// over objects, built once the world is complete, without it every object is tested
+	shared_ptr<Bvh> bvh;
 
 	void add_object(shared_ptr<Hittable> o) { objects.push_back(o); }
 };
@@ -36,8 +217,12 @@ struct Plane : public Hittable
 
 	Plane(v3f n, float d, shared_ptr<Material> m) : n(n), d(d), mat(m) {}
 
+	Material* material() override { return mat.get(); }
+	shared_ptr<Hittable> copy(World_Copy& world_copy) override { return make_shared<Plane>(*this); }
+
 	bool hit(Ray r, float t_min, float t_max, Hit_Record& rec) override
 	{
+		RENDER_COUNT(primitive_tests[PRIMITIVE_PLANE]);
 		float denom = dot(n, r.direction);
 		if (denom != 0)
 		{
@@ -49,6 +234,8 @@ struct Plane : public Hittable
 				rec.from_outside = true;
 				rec.t = t;
 				rec.mat = mat;
+				rec.u = rec.v = .0f;
+				rec.dpdu = rec.dpdv = v3f{ .0f, .0f, .0f };
 				return true;
 			}
 		}
@@ -65,8 +252,12 @@ struct Sphere : public Hittable
 
 	Sphere(v3f o, float r, shared_ptr<Material> m) : origin(o), radius(r), mat(m) {}
 
+	Material* material() override { return mat.get(); }
+	shared_ptr<Hittable> copy(World_Copy& world_copy) override { return make_shared<Sphere>(*this); }
+
 	bool hit(Ray r, float t_min, float t_max, Hit_Record& rec) override
 	{
+		RENDER_COUNT(primitive_tests[PRIMITIVE_SPHERE]);
 		v3f relative_sphere_origin = r.origin - origin;
 		float a = dot(r.direction, r.direction);
 		float b = 2 * dot(relative_sphere_origin, r.direction);
@@ -90,6 +281,7 @@ struct Sphere : public Hittable
 				rec.t = t1;
 				rec.mat = mat;
 				get_sphere_uv(rec.n, rec.u, rec.v);
+				get_sphere_derivatives(rec);
 				return true;
 			}
 
@@ -108,6 +300,7 @@ struct Sphere : public Hittable
 				rec.t = t2;
 				rec.mat = mat;
 				get_sphere_uv(rec.n, rec.u, rec.v);
+				get_sphere_derivatives(rec);
 				return true;
 			}
 		}
@@ -115,15 +308,85 @@ struct Sphere : public Hittable
 		return false;
 	}
 
+	Bounds bounds() override
+	{
+		v3f extent = v3f{ radius, radius, radius };
+		return Bounds{ origin - extent, origin + extent };
+	}
+
+	float area() override
+	{
+		return 4.0f * PI * radius * radius;
+	}
+
+	// Uniform over the cone of directions the sphere covers, or over all directions from inside.
+	bool sample_direction(v3f from, float u1, float u2, v3f& direction, float& pdf) override
+	{
+		v3f to_center = origin - from;
+		float distance_squared = length_squared(to_center);
+		float sin_squared_max = radius * radius / distance_squared;
+		if (sin_squared_max >= 1.0f)
+		{
+			float z = 1.0f - 2.0f * u1;
+			float r = (float)sqrt(fmax(.0f, 1.0f - z*z));
+			float phi = 2.0f * PI * u2;
+			direction = v3f{ r * fast_cos(phi), r * fast_sin(phi), z };
+			pdf = 1.0f / (4.0f * PI);
+			return true;
+		}
+
+		float cos_max = (float)sqrt(1.0f - sin_squared_max);
+		float one_minus_cos_max = sin_squared_max / (1.0f + cos_max);
+		float cos_theta = 1.0f - u1 * one_minus_cos_max;
+		float sin_theta = (float)sqrt(fmax(.0f, 1.0f - cos_theta*cos_theta));
+		float phi = 2.0f * PI * u2;
+
+		v3f w = to_center / (float)sqrt(distance_squared);
+		v3f u, v;
+		make_basis(w, u, v);
+		direction = (sin_theta * fast_cos(phi)) * u + (sin_theta * fast_sin(phi)) * v + cos_theta * w;
+		pdf = 1.0f / (2.0f * PI * one_minus_cos_max);
+		return true;
+	}
+
+	float direction_pdf(v3f from, Hit_Record& rec) override
+	{
+		float sin_squared_max = radius * radius / length_squared(origin - from);
+		if (sin_squared_max >= 1.0f)
+		{
+			return 1.0f / (4.0f * PI);
+		}
+		float cos_max = (float)sqrt(1.0f - sin_squared_max);
+		return 1.0f / (2.0f * PI * sin_squared_max / (1.0f + cos_max));
+	}
 
 private:
 	void get_sphere_uv(v3f& p, float& u, float& v)
 	{
-		double theta = acos(-p.y);
-		double phi = atan2(-p.z, p.x) + PI;
+		float theta = fast_acos(-p.y);
+		float phi = fast_atan2(-p.z, p.x) + PI;
 
-		u = float(phi) / (2.0f * PI);
-		v = float(theta) / PI;
+		u = phi / (2.0f * PI);
+		v = theta / PI;
+	}
+
+	// derivatives of the lat-long mapping above, the texture coordinates come from the normal
+	// that faces the ray so hits from inside are mirrored
+	void get_sphere_derivatives(Hit_Record& rec)
+	{
+		v3f n = rec.n;
+		float side = rec.from_outside ? radius : -radius;
+		float ring_radius = (float)sqrt(n.x*n.x + n.z*n.z);
+
+		rec.dpdu = (2.0f * PI * side) * v3f{ n.z, .0f, -n.x };
+		if (ring_radius > .0f)
+		{
+			rec.dpdv = (PI * side) * v3f{ -n.x*n.y / ring_radius, ring_radius, -n.y*n.z / ring_radius };
+		}
+		else
+		{
+			rec.dpdv = v3f{ .0f, .0f, .0f };
+		}
 	}
 };
 
@@ -134,8 +397,12 @@ struct Triangle : public Hittable
 
 	Triangle(v3f v0, v3f v1, v3f v2, shared_ptr<Material> m) : a(v0), b(v1), c(v2), mat(m) {}
 
+	Material* material() override { return mat.get(); }
+	shared_ptr<Hittable> copy(World_Copy& world_copy) override { return make_shared<Triangle>(*this); }
+
 	bool hit(Ray r, float t_min, float t_max, Hit_Record& rec) override
 	{
+		RENDER_COUNT(primitive_tests[PRIMITIVE_TRIANGLE]);
 		v3f triangle_normal = normalize(cross(b - a, c - a));
 
 		// determine if ray intersects triangle's plane
@@ -158,6 +425,8 @@ struct Triangle : public Hittable
 					rec.from_outside = true;
 					rec.t = t;
 					rec.mat = mat;
+					rec.u = rec.v = .0f;
+					rec.dpdu = rec.dpdv = v3f{ .0f, .0f, .0f };
 
 					return true;
 				}
@@ -166,4 +435,51 @@ struct Triangle : public Hittable
 
 		return false;
 	}
+
+	Bounds bounds() override
+	{
+		return union_bounds(union_bounds(Bounds{ a, a }, b), c);
+	}
+
+	float area() override
+	{
+		return .5f * length(cross(b - a, c - a));
+	}
+
+	void normal_cone(v3f& axis, float& cos_theta) override
+	{
+		axis = normalize(cross(b - a, c - a));
+		cos_theta = 1.0f;
+	}
+
+	// Uniform over the area of the triangle.
+	bool sample_direction(v3f from, float u1, float u2, v3f& direction, float& pdf) override
+	{
+		float su = (float)sqrt(u1);
+		float b0 = 1.0f - su;
+		float b1 = u2 * su;
+		v3f point = b0 * a + b1 * b + (1.0f - b0 - b1) * c;
+
+		direction = point - from;
+		float distance_squared = length_squared(direction);
+		float cosine = (float)fabs(dot(normalize(cross(b - a, c - a)), direction)) / (float)sqrt(distance_squared);
+		if (cosine < 1e-6f)
+		{
+			return false;
+		}
+		pdf = distance_squared / (cosine * area());
+		return true;
+	}
+
+	float direction_pdf(v3f from, Hit_Record& rec) override
+	{
+		v3f direction = rec.p - from;
+		float distance_squared = length_squared(direction);
+		float cosine = (float)fabs(dot(rec.n, direction)) / (float)sqrt(distance_squared);
+		if (cosine < 1e-6f)
+		{
+			return .0f;
+		}
+		return distance_squared / (cosine * area());
+	}
 };
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "sampling.h"
+#include "environment.h"
+
+// Picks which emissive object a shading point samples for direct lighting. The power table picks
+// lights by how much light they give off in total, the light BVH walks a tree over the lights
+// choosing the child that probably contributes more at the shading point (from distance,
+// power and which way the lights face), so the cost is O(log n) and far or facing away lights
+// barely get picked. Based on "Importance Sampling of Many Lights with Adaptive Tree Splitting"
+// (Conty and Kulla) as done in pbrt-v4.
+
+enum Light_Selection
+{
+	LIGHT_SELECTION_POWER,
+	LIGHT_SELECTION_BVH,
+
+	LIGHT_SELECTION_COUNT,
+};
+
+// What a group of lights looks like from far away: where they are, how much they emit, the cone
+// the normals fit in (theta_o) and how far around the normals they emit (theta_e).
+struct Light_Bounds
+{
+	Bounds bounds;
+	v3f axis;
+	float cos_theta_o;
+	float cos_theta_e;
+	float power;
+	bool two_sided;
+};
+
+struct Light_Node
+{
+	Light_Bounds light_bounds;
+	// first child, the second one comes right after it, or the light for leaves
+	int index;
+	bool leaf;
+};
+
+struct Light_Sampler
+{
+	Light_Selection selection;
+	std::vector<Hittable*> lights;
+
+	Alias_Table power_table;
+
+	std::vector<Light_Node> nodes;
+	// path from the root to the leaf of each light, one bit per level, set for the second child
+	std::vector<uint64_t> trails;
+};
+
+inline float
+safe_sqrt(float x)
+{
+	return (float)sqrt(fmax(.0f, x));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of the angles
+inline float
+cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	if (cos_a > cos_b) return 1.0f;
+	return cos_a*cos_b + sin_a*sin_b;
+}
+
+inline float
+sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	if (cos_a > cos_b) return .0f;
+	return sin_a*cos_b - cos_a*sin_b;
+}
+
+// Rotates v around the unit axis (Rodrigues).
+inline v3f
+rotate(v3f v, v3f axis, float angle)
+{
+	float c = (float)cos(angle);
+	float s = (float)sin(angle);
+	return c * v + s * cross(axis, v) + ((1.0f - c) * dot(axis, v)) * axis;
+}
+
+// Smallest cone holding both cones.
+inline void
+union_cones(v3f axis_a, float cos_a, v3f axis_b, float cos_b, v3f& axis, float& cos_theta)
+{
+	float theta_a = (float)acos(clamp(cos_a, -1.0f, 1.0f));
+	float theta_b = (float)acos(clamp(cos_b, -1.0f, 1.0f));
+	float theta_d = (float)acos(clamp(dot(axis_a, axis_b), -1.0f, 1.0f));
+
+	if (fmin(theta_d + theta_b, PI) <= theta_a)
+	{
+		axis = axis_a;
+		cos_theta = cos_a;
+		return;
+	}
+	if (fmin(theta_d + theta_a, PI) <= theta_b)
+	{
+		axis = axis_b;
+		cos_theta = cos_b;
+		return;
+	}
+
+	float theta_o = (theta_a + theta_d + theta_b) / 2.0f;
+	v3f rotation_axis = cross(axis_a, axis_b);
+	if (theta_o >= PI || length_squared(rotation_axis) == .0f)
+	{
+		axis = axis_a;
+		cos_theta = -1.0f;
+		return;
+	}
+
+	axis = rotate(axis_a, normalize(rotation_axis), theta_o - theta_a);
+	cos_theta = (float)cos(theta_o);
+}
+
+inline Light_Bounds
+union_light_bounds(Light_Bounds& a, Light_Bounds& b)
+{
+	if (a.power == .0f) return b;
+	if (b.power == .0f) return a;
+
+	Light_Bounds result;
+	result.bounds = union_bounds(a.bounds, b.bounds);
+	union_cones(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, result.axis, result.cos_theta_o);
+	result.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+	result.power = a.power + b.power;
+	result.two_sided = a.two_sided || b.two_sided;
+	return result;
+}
+
+// Rough guess of how much light the group sends to a point with normal n, only the ratios
+// between groups matter.
+inline float
+light_importance(Light_Bounds& light_bounds, v3f p, v3f n)
+{
+	Bounds& bounds = light_bounds.bounds;
+	v3f center = bounds_center(bounds);
+	float distance_squared = length_squared(p - center);
+	float half_diagonal = .5f * length(bounds.max - bounds.min);
+	distance_squared = fmax(distance_squared, half_diagonal);
+
+	// angle the bounds cover from p, through its bounding sphere
+	float radius_squared = length_squared(bounds.max - center);
+	float center_distance_squared = length_squared(p - center);
+	float cos_theta_b = -1.0f;
+	if (center_distance_squared > radius_squared)
+	{
+		cos_theta_b = safe_sqrt(1.0f - radius_squared / center_distance_squared);
+	}
+	float sin_theta_b = safe_sqrt(1.0f - cos_theta_b*cos_theta_b);
+
+	// angle between the cone axis and p, minus the spread of the normals and of the bounds
+	v3f wi = normalize(p - center);
+	float cos_theta_w = dot(light_bounds.axis, wi);
+	if (light_bounds.two_sided)
+	{
+		cos_theta_w = (float)fabs(cos_theta_w);
+	}
+	float sin_theta_w = safe_sqrt(1.0f - cos_theta_w*cos_theta_w);
+	float sin_theta_o = safe_sqrt(1.0f - light_bounds.cos_theta_o*light_bounds.cos_theta_o);
+
+	float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, light_bounds.cos_theta_o);
+	float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, light_bounds.cos_theta_o);
+	float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if (cos_theta_p <= light_bounds.cos_theta_e)
+	{
+		return .0f;
+	}
+
+	float importance = light_bounds.power * cos_theta_p / distance_squared;
+
+	// and the angle at the receiver
+	float cos_theta_i = (float)fabs(dot(wi, n));
+	float sin_theta_i = safe_sqrt(1.0f - cos_theta_i*cos_theta_i);
+	importance *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+
+	return fmax(importance, .0f);
+}
+
+inline Light_Bounds
+get_light_bounds(Hittable* light)
+{
+	Light_Bounds result;
+	result.bounds = light->bounds();
+	light->normal_cone(result.axis, result.cos_theta_o);
+	result.cos_theta_e = .0f; // diffuse emitters, out to 90 degrees from the normal
+	result.two_sided = true;
+
+	// Diffuse_Light emits on both sides, the color at the center stands for textured ones
+	v3f center = bounds_center(result.bounds);
+	v3f radiance = light->material()->emitted(.5f, .5f, center);
+	result.power = PI * 2.0f * light->area() * luminance(radiance);
+	return result;
+}
+
+// Fills in node_index with the lights in [first, end), the two children of a node are always
+// next to each other.
+inline void
+build_light_nodes(Light_Sampler& sampler, std::vector<Light_Bounds>& light_bounds, std::vector<int>& lights, int first, int end, uint64_t trail, int depth, int node_index)
+{
+	if (end - first == 1)
+	{
+		int light = lights[first];
+		sampler.nodes[node_index] = Light_Node{ light_bounds[light], light, true };
+		sampler.trails[light] = trail;
+		return;
+	}
+
+	// split at the median along the longest axis of the centers
+	Bounds centers = empty_bounds();
+	for (int i = first; i < end; i++)
+	{
+		centers = union_bounds(centers, bounds_center(light_bounds[lights[i]].bounds));
+	}
+	int axis = largest_axis(centers);
+	int middle = (first + end) / 2;
+	std::nth_element(lights.begin() + first, lights.begin() + middle, lights.begin() + end, [&light_bounds, axis](int a, int b)
+	{
+		return bounds_center(light_bounds[a].bounds).e[axis] < bounds_center(light_bounds[b].bounds).e[axis];
+	});
+
+	int child = int(sampler.nodes.size());
+	sampler.nodes.resize(sampler.nodes.size() + 2);
+	build_light_nodes(sampler, light_bounds, lights, first, middle, trail, depth + 1, child);
+	build_light_nodes(sampler, light_bounds, lights, middle, end, trail | (uint64_t(1) << depth), depth + 1, child + 1);
+
+	Light_Node node;
+	node.light_bounds = union_light_bounds(sampler.nodes[child].light_bounds, sampler.nodes[child + 1].light_bounds);
+	node.index = child;
+	node.leaf = false;
+	sampler.nodes[node_index] = node;
+}
+
+// Collects the objects with emissive materials of the world.
+inline shared_ptr<Light_Sampler>
+build_light_sampler(World& world, Light_Selection selection)
+{
+	auto sampler = make_shared<Light_Sampler>();
+	sampler->selection = selection;
+
+	std::vector<Light_Bounds> light_bounds;
+	std::vector<float> powers;
+	for (shared_ptr<Hittable>& object : world.objects)
+	{
+		object->light_index = -1;
+		Material* material = object->material();
+		if (material && material->is_emissive() && object->area() > .0f)
+		{
+			object->light_index = int(sampler->lights.size());
+			sampler->lights.push_back(object.get());
+			light_bounds.push_back(get_light_bounds(object.get()));
+			powers.push_back(light_bounds.back().power);
+		}
+	}
+
+	if (sampler->lights.empty())
+	{
+		return nullptr;
+	}
+
+	build_alias_table(sampler->power_table, powers.data(), int(powers.size()));
+
+	std::vector<int> lights(sampler->lights.size());
+	for (int i = 0; i < int(lights.size()); i++)
+	{
+		lights[i] = i;
+	}
+	sampler->trails.resize(lights.size());
+	sampler->nodes.resize(1);
+	build_light_nodes(*sampler, light_bounds, lights, 0, int(lights.size()), 0, 0, 0);
+
+	return sampler;
+}
+
+// Returns the light to sample from p, or -1 when none of them can reach it.
+inline int
+pick_light(Light_Sampler& sampler, v3f p, v3f n, float u, float& pmf)
+{
+	if (sampler.selection == LIGHT_SELECTION_POWER)
+	{
+		return sample_alias_table(sampler.power_table, u, pmf);
+	}
+
+	pmf = 1.0f;
+	int node_index = 0;
+	while (!sampler.nodes[node_index].leaf)
+	{
+		int child = sampler.nodes[node_index].index;
+		float left = light_importance(sampler.nodes[child].light_bounds, p, n);
+		float right = light_importance(sampler.nodes[child + 1].light_bounds, p, n);
+		if (left + right <= .0f)
+		{
+			return -1;
+		}
+
+		float left_probability = left / (left + right);
+		if (u < left_probability)
+		{
+			u = fmin(u / left_probability, .99999994f);
+			pmf *= left_probability;
+			node_index = child;
+		}
+		else
+		{
+			u = fmin((u - left_probability) / (1.0f - left_probability), .99999994f);
+			pmf *= 1.0f - left_probability;
+			node_index = child + 1;
+		}
+	}
+	return sampler.nodes[node_index].index;
+}
+
+// Probability of pick_light choosing the light from p.
+inline float
+light_pmf(Light_Sampler& sampler, v3f p, v3f n, int light)
+{
+	if (sampler.selection == LIGHT_SELECTION_POWER)
+	{
+		return sampler.power_table.pmf[light];
+	}
+
+	float pmf = 1.0f;
+	uint64_t trail = sampler.trails[light];
+	int node_index = 0;
+	while (!sampler.nodes[node_index].leaf)
+	{
+		int child = sampler.nodes[node_index].index;
+		float left = light_importance(sampler.nodes[child].light_bounds, p, n);
+		float right = light_importance(sampler.nodes[child + 1].light_bounds, p, n);
+		if (left + right <= .0f)
+		{
+			return .0f;
+		}
+
+		int side = int(trail & 1);
+		pmf *= (side ? right : left) / (left + right);
+		node_index = child + side;
+		trail >>= 1;
+	}
+	return pmf;
+}
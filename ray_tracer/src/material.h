@@ -9,6 +9,33 @@ struct Material
 	{
 		return v3f{ .0f, .0f, .0f };
 	}
+
+	// Objects with an emissive material get sampled as lights.
+	virtual bool is_emissive()
+	{
+		return false;
+	}
+
+	// Moves the ray differential to follow the scattered ray. Called before scatter, while r is
+	// still the incoming ray. Rough surfaces spread the footprint so the differential is dropped.
+	virtual void scatter_differential(Hit_Record& rec, Ray& r, Ray_Differential& differential)
+	{
+		differential.valid = false;
+	}
+
+	// Density, with respect to solid angle, of scatter() turning incoming into scattered. Zero when
+	// scatter() picks a single direction, lights can't be sampled for those materials.
+	virtual float scatter_pdf(Hit_Record& rec, v3f incoming, v3f scattered)
+	{
+		return .0f;
+	}
+
+	// Light carried from scattered to incoming, the bsdf times the cosine. Matches scatter(), which
+	// returns evaluate_scatter / scatter_pdf as the attenuation.
+	virtual v3f evaluate_scatter(Hit_Record& rec, v3f incoming, v3f scattered)
+	{
+		return v3f{ .0f, .0f, .0f };
+	}
 };
 
 struct Diffuse_Light : public Material
@@ -27,6 +54,11 @@ struct Diffuse_Light : public Material
 	{
 		return emit->value(u, v, p);
 	}
+
+	virtual bool is_emissive() override
+	{
+		return true;
+	}
 };
 
 struct Lambertian : Material
@@ -41,9 +73,21 @@ struct Lambertian : Material
 		v3f scattered_dir = rec.n + random_in_unit_vector();
 		r.direction = scattered_dir;
 		r.origin = rec.p;
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		attenuation = albedo->sample(rec);
 		return true;
 	}
+
+	// scatter() is cosine weighted
+	float scatter_pdf(Hit_Record& rec, v3f incoming, v3f scattered) override
+	{
+		float cosine = dot(rec.n, normalize(scattered));
+		return cosine > .0f ? cosine / PI : .0f;
+	}
+
+	v3f evaluate_scatter(Hit_Record& rec, v3f incoming, v3f scattered) override
+	{
+		return albedo->sample(rec) * scatter_pdf(rec, incoming, scattered);
+	}
 };
 
 struct Metal : Material
@@ -61,6 +105,49 @@ struct Metal : Material
 		attenuation = albedo;
 		return true;
 	}
+
+	void scatter_differential(Hit_Record& rec, Ray& r, Ray_Differential& differential) override
+	{
+		differential.rx_origin = rec.p + rec.dpdx;
+		differential.ry_origin = rec.p + rec.dpdy;
+		differential.rx_direction = reflect(differential.rx_direction, rec.n);
+		differential.ry_direction = reflect(differential.ry_direction, rec.n);
+	}
+
+	// scatter() picks a point on a sphere around the mirror direction, the density comes from
+	// where the scattered direction crosses that sphere. The sphere is relative to the length of
+	// the incoming direction since that isn't normalized.
+	float scatter_pdf(Hit_Record& rec, v3f incoming, v3f scattered) override
+	{
+		float incoming_length = length(incoming);
+		float radius = fuzz / incoming_length;
+		if (radius <= .0f)
+		{
+			return .0f;
+		}
+
+		v3f center = reflect(incoming / incoming_length, rec.n);
+		v3f direction = normalize(scattered);
+		float b = dot(direction, center);
+		float discriminant = b*b - 1.0f + radius*radius;
+		if (discriminant <= 1e-12f)
+		{
+			return .0f;
+		}
+
+		// area density 1 / (4 pi r^2) times t^2 / cos at every crossing, cos = root / radius
+		float root = (float)sqrt(discriminant);
+		float near_t = b - root;
+		float far_t = b + root;
+		float t_squared = far_t > .0f ? far_t*far_t : .0f;
+		t_squared += near_t > .0f ? near_t*near_t : .0f;
+		return t_squared / (4.0f * PI * radius * root);
+	}
+
+	v3f evaluate_scatter(Hit_Record& rec, v3f incoming, v3f scattered) override
+	{
+		return albedo * scatter_pdf(rec, incoming, scattered);
+	}
 };
 
 struct Dielectric : Material
@@ -72,30 +159,38 @@ struct Dielectric : Material
 	bool scatter(Hit_Record& rec, Ray& r, v3f& attenuation) override
 	{
 		attenuation = V3f(1.0f, 1.0f, 1.0f);
+
+		r.origin = rec.p;
+		r.direction = scatter_direction(rec, r.direction);
+		return true;
+	}
+
+	void scatter_differential(Hit_Record& rec, Ray& r, Ray_Differential& differential) override
+	{
+		differential.rx_origin = rec.p + rec.dpdx;
+		differential.ry_origin = rec.p + rec.dpdy;
+		differential.rx_direction = scatter_direction(rec, differential.rx_direction);
+		differential.ry_direction = scatter_direction(rec, differential.ry_direction);
+	}
+
+private:
+	v3f scatter_direction(Hit_Record& rec, v3f incoming)
+	{
 		float refraction_ratio = rec.from_outside ? 1.0f / index_of_refraction : index_of_refraction;
 
-		v3f unit_direction = normalize(r.direction);
+		v3f unit_direction = normalize(incoming);
 		float cos_theta = fmin(dot(-unit_direction, rec.n), 1.0f);
 		float sin_theta = sqrt(1.0f - cos_theta * cos_theta);
 
 		bool cannot_refract = refraction_ratio * sin_theta > 1.0f;
-		v3f direction;
 		// if(cannot_refract || (reflectance(cos_theta, refraction_ratio) > random_float()))
 		if (cannot_refract)
 		{
-			direction = reflect(unit_direction, rec.n);
+			return reflect(unit_direction, rec.n);
 		}
-		else
-		{
-			direction = refract(unit_direction, rec.n, refraction_ratio);
-		}
-
-		r.origin = rec.p;
-		r.direction = direction;
-		return true;
+		return refract(unit_direction, rec.n, refraction_ratio);
 	}
 
-private:
 	v3f refract(v3f uv, v3f n, float etai_over_etat)
 	{
 		float cos_theta = fmin(dot(-uv, n), 1.0f);
@@ -108,6 +203,7 @@ private:
 	{
 		float r0 = (1 - ref_idx) / (1 + ref_idx);
 		r0 = r0 * r0;
-		return r0 + (1 - r0)*(float)pow((1 - cosine), 5);
+		float x = 1 - cosine;
+		return r0 + (1 - r0)*x*x*x*x*x;
 	}
 };
\ No newline at end of file
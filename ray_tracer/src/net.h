@@ -0,0 +1,412 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// TCP for rendering a frame on several machines: a coordinator hands out the tiles of the frame
+// to worker processes and collects their pixels. Every message is a Net_Message_Header and the
+// struct of its type, followed by the strings or pixels of the message. Structs go over the wire
+// as they are in memory, so both ends have to agree on byte order, which every platform the
+// renderer builds on does. There is no authentication, workers and coordinator are meant for a
+// trusted network.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET Net_Socket;
+#define INVALID_NET_SOCKET INVALID_SOCKET
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int Net_Socket;
+#define INVALID_NET_SOCKET -1
+#endif
+
+// A worker that went away mid write must not kill the coordinator with SIGPIPE.
+#ifdef MSG_NOSIGNAL
+#define NET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define NET_SEND_FLAGS 0
+#endif
+
+#define NET_MAGIC 0x544E5452 // "RTNT"
+#define NET_VERSION 2
+#define NET_DEFAULT_PORT 7878
+// larger messages are taken for a broken connection
+#define NET_MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+
+// Needs to be called once before any of the other functions.
+inline bool
+start_net()
+{
+#ifdef _WIN32
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+	{
+		fprintf(stderr, "ERROR: Could not start Winsock.\n");
+		return false;
+	}
+#endif
+	return true;
+}
+
+inline void
+stop_net()
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+inline void
+close_net_socket(Net_Socket socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+// Tiles are small messages that should go out right away instead of waiting for more to send.
+inline void
+set_net_no_delay(Net_Socket socket)
+{
+	int on = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+
+// Receives and sends fail after this many seconds without progress, 0 waits forever.
+inline void
+set_net_timeout(Net_Socket socket, int seconds)
+{
+#ifdef _WIN32
+	DWORD timeout = DWORD(seconds) * 1000;
+#else
+	timeval timeout = {};
+	timeout.tv_sec = seconds;
+#endif
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+// Listens on port on every interface.
+inline Net_Socket
+listen_net(int port)
+{
+	Net_Socket server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server == INVALID_NET_SOCKET)
+	{
+		fprintf(stderr, "ERROR: Could not create a socket.\n");
+		return INVALID_NET_SOCKET;
+	}
+	int on = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(uint16_t(port));
+	if (bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0)
+	{
+		fprintf(stderr, "ERROR: Could not listen on port %d.\n", port);
+		close_net_socket(server);
+		return INVALID_NET_SOCKET;
+	}
+	return server;
+}
+
+// name gets the address and port of the other end, "127.0.0.1:51234".
+inline Net_Socket
+accept_net(Net_Socket server, std::string& name)
+{
+	sockaddr_in address = {};
+	socklen_t length = sizeof(address);
+	Net_Socket client = accept(server, (sockaddr*)&address, &length);
+	if (client == INVALID_NET_SOCKET)
+	{
+		return INVALID_NET_SOCKET;
+	}
+	char text[64];
+	inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+	name = std::string(text) + ":" + std::to_string(ntohs(address.sin_port));
+	set_net_no_delay(client);
+	return client;
+}
+
+// Connects to "host:port", trying again every quarter of a second for retry_seconds so workers
+// can be started before the coordinator.
+inline Net_Socket
+connect_net(const char* host_and_port, int retry_seconds)
+{
+	std::string host = host_and_port;
+	std::string port = std::to_string(NET_DEFAULT_PORT);
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos)
+	{
+		port = host.substr(colon + 1);
+		host.resize(colon);
+	}
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (int attempt = 0; attempt <= retry_seconds * 4; attempt++)
+	{
+		addrinfo* addresses = nullptr;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+		{
+			fprintf(stderr, "ERROR: Could not resolve '%s'.\n", host_and_port);
+			return INVALID_NET_SOCKET;
+		}
+		for (addrinfo* address = addresses; address; address = address->ai_next)
+		{
+			Net_Socket client = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (client == INVALID_NET_SOCKET)
+			{
+				continue;
+			}
+			if (connect(client, address->ai_addr, (int)address->ai_addrlen) == 0)
+			{
+				freeaddrinfo(addresses);
+				set_net_no_delay(client);
+				return client;
+			}
+			close_net_socket(client);
+		}
+		freeaddrinfo(addresses);
+#ifdef _WIN32
+		Sleep(250);
+#else
+		usleep(250 * 1000);
+#endif
+	}
+	fprintf(stderr, "ERROR: Could not connect to '%s'.\n", host_and_port);
+	return INVALID_NET_SOCKET;
+}
+
+inline bool
+send_net_bytes(Net_Socket socket, const void* data, size_t size)
+{
+	const char* at = (const char*)data;
+	while (size > 0)
+	{
+		int sent = send(socket, at, int(size > (1 << 30) ? (1 << 30) : size), NET_SEND_FLAGS);
+		if (sent <= 0)
+		{
+			return false;
+		}
+		at += sent;
+		size -= size_t(sent);
+	}
+	return true;
+}
+
+inline bool
+receive_net_bytes(Net_Socket socket, void* data, size_t size)
+{
+	char* at = (char*)data;
+	while (size > 0)
+	{
+		int received = recv(socket, at, int(size > (1 << 30) ? (1 << 30) : size), 0);
+		if (received <= 0)
+		{
+			return false;
+		}
+		at += received;
+		size -= size_t(received);
+	}
+	return true;
+}
+
+// Which of sockets have something to read, waiting up to timeout_ms for one to. False when none
+// does.
+inline bool
+wait_net_readable(std::vector<Net_Socket>& sockets, int timeout_ms, std::vector<bool>& readable)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	Net_Socket highest = 0;
+	for (Net_Socket socket : sockets)
+	{
+		FD_SET(socket, &set);
+		highest = socket > highest ? socket : highest;
+	}
+	timeval timeout = {};
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	int ready = select(int(highest + 1), &set, nullptr, nullptr, &timeout);
+
+	readable.assign(sockets.size(), false);
+	for (size_t i = 0; ready > 0 && i < sockets.size(); i++)
+	{
+		readable[i] = FD_ISSET(sockets[i], &set) != 0;
+	}
+	return ready > 0;
+}
+
+//
+// Messages
+//
+
+enum Net_Message_Type
+{
+	// worker to coordinator once connected, Net_Hello
+	NET_HELLO,
+	// coordinator to worker, Net_Setup and its strings
+	NET_SETUP,
+	// worker to coordinator with the scene loaded, Net_Ready
+	NET_READY,
+	// worker to coordinator when the scene couldn't be loaded, nothing
+	NET_FAILED,
+	// coordinator to worker, Net_Tile
+	NET_TILE,
+	// worker to coordinator, Net_Tile_Result and the pixels of the tile
+	NET_TILE_RESULT,
+	// coordinator to worker when the frame is finished, nothing
+	NET_DONE,
+};
+
+struct Net_Message_Header
+{
+	uint32_t type;
+	// of what follows the header
+	uint32_t size;
+};
+
+struct Net_Hello
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t threads;
+};
+
+// The render settings as given to the coordinator, the worker resolves them against the scene
+// like a local render would.
+struct Net_Setup
+{
+	// 0 leaves them to the scene
+	int32_t width;
+	int32_t height;
+	int32_t samples_per_pixel;
+	int32_t ray_depth;
+	uint64_t seed;
+	int32_t pixel_order;
+	int32_t camera_ray_packets;
+	int32_t sort_secondary_rays;
+	int32_t light_selection;
+	int32_t texture_cache_mb;
+	// lengths of the strings that follow in this order, the scene as given to --scene, the --mesh
+	// file and the --camera settings, empty when not given
+	uint32_t scene_length;
+	uint32_t mesh_length;
+	uint32_t camera_length;
+};
+
+// What the worker renders, has to be the same for every worker.
+struct Net_Ready
+{
+	int32_t width;
+	int32_t height;
+	int32_t samples_per_pixel;
+	int32_t ray_depth;
+};
+
+struct Net_Tile
+{
+	int32_t job;
+	int32_t x_min;
+	int32_t x_max;
+	int32_t y_min;
+	int32_t y_max;
+	int32_t tile_x;
+	int32_t tile_y;
+};
+
+// Followed by three floats a pixel in rows of the tile, linear and averaged over the samples.
+struct Net_Tile_Result
+{
+	int32_t job;
+	float render_ms;
+	uint64_t rays;
+	uint64_t bounces;
+};
+
+// Bytes of a NET_TILE_RESULT message for a tile of width x height pixels.
+inline uint64_t
+net_tile_result_size(int width, int height)
+{
+	return sizeof(Net_Tile_Result) + uint64_t(width) * uint64_t(height) * 3 * sizeof(float);
+}
+
+// Largest square tile whose result still fits in a message.
+inline int
+max_net_tile_size()
+{
+	int size = 1;
+	while (net_tile_result_size(size + 1, size + 1) <= NET_MAX_MESSAGE_SIZE)
+	{
+		size++;
+	}
+	return size;
+}
+
+// The message in one send, the struct of the type and then extra.
+inline bool
+send_net_message(Net_Socket socket, Net_Message_Type type, const void* data, size_t size, const void* extra = nullptr, size_t extra_size = 0)
+{
+	Net_Message_Header header = { uint32_t(type), uint32_t(size + extra_size) };
+	std::vector<char> buffer;
+	buffer.reserve(sizeof(header) + size + extra_size);
+	buffer.insert(buffer.end(), (const char*)&header, (const char*)&header + sizeof(header));
+	if (size)
+	{
+		buffer.insert(buffer.end(), (const char*)data, (const char*)data + size);
+	}
+	if (extra_size)
+	{
+		buffer.insert(buffer.end(), (const char*)extra, (const char*)extra + extra_size);
+	}
+	return send_net_bytes(socket, buffer.data(), buffer.size());
+}
+
+// Blocks until a whole message is in, false when the connection broke or timed out.
+inline bool
+receive_net_message(Net_Socket socket, Net_Message_Header& header, std::vector<char>& payload)
+{
+	if (!receive_net_bytes(socket, &header, sizeof(header)) || header.size > NET_MAX_MESSAGE_SIZE)
+	{
+		return false;
+	}
+	payload.resize(header.size);
+	return header.size == 0 || receive_net_bytes(socket, payload.data(), header.size);
+}
+
+// The struct at the start of a payload, false when the payload is too short for it.
+template <typename T>
+inline bool
+read_net_struct(std::vector<char>& payload, T& value)
+{
+	if (payload.size() < sizeof(T))
+	{
+		return false;
+	}
+	memcpy(&value, payload.data(), sizeof(T));
+	return true;
+}
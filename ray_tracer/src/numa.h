@@ -0,0 +1,201 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <functional>
+#include <utility>
+
+// NUMA topology and thread placement. On Linux the nodes are read from sysfs and threads are
+// pinned with pthread_setaffinity_np, on Windows pinning goes through SetThreadAffinityMask and
+// the whole machine is treated as a single node. Memory placement relies on the OS first touch
+// policy: pages end up on the node of the thread that writes them first, so data that should be
+// local to a node is allocated and initialized by a thread pinned to that node.
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#define MAX_NUMA_NODES 8
+
+struct Numa_Topology
+{
+	// cpus that belong to each node
+	std::vector<std::vector<int>> node_cpus;
+};
+
+// Node of the calling thread, set when a thread gets pinned. Unpinned threads report node 0.
+static thread_local int current_numa_node = 0;
+
+// Parses sysfs cpu lists like "0-7,16-23".
+inline std::vector<int>
+parse_cpu_list(const char* list)
+{
+	std::vector<int> cpus;
+	const char* at = list;
+	while (*at)
+	{
+		char* end = nullptr;
+		long first = strtol(at, &end, 10);
+		if (end == at)
+		{
+			break;
+		}
+		long last = first;
+		at = end;
+		if (*at == '-')
+		{
+			at++;
+			last = strtol(at, &end, 10);
+			at = end;
+		}
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back(int(cpu));
+		}
+		while (*at == ',' || *at == '\n' || *at == ' ')
+		{
+			at++;
+		}
+	}
+	return cpus;
+}
+
+// Reads a sysfs list like "0-7,16-23", empty when the file isn't there.
+inline std::vector<int>
+read_sysfs_list(const std::string& path)
+{
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+	{
+		return std::vector<int>();
+	}
+
+	char list[4096] = {};
+	size_t read_size = fread(list, 1, sizeof(list) - 1, f);
+	list[read_size] = 0;
+	fclose(f);
+	return parse_cpu_list(list);
+}
+
+inline Numa_Topology
+query_numa_topology()
+{
+	Numa_Topology topology = {};
+
+#ifdef __linux__
+	// node ids can have gaps, only the online list says which exist
+	std::vector<int> nodes = read_sysfs_list("/sys/devices/system/node/online");
+	for (int node : nodes)
+	{
+		if (int(topology.node_cpus.size()) == MAX_NUMA_NODES)
+		{
+			break;
+		}
+		std::vector<int> cpus = read_sysfs_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		if (!cpus.empty())
+		{
+			topology.node_cpus.push_back(cpus);
+		}
+	}
+#endif
+
+	if (topology.node_cpus.empty())
+	{
+		std::vector<int> cpus;
+		int cpu_count = int(std::thread::hardware_concurrency());
+		if (cpu_count <= 0)
+		{
+			cpu_count = 1;
+		}
+		for (int cpu = 0; cpu < cpu_count; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+		topology.node_cpus.push_back(cpus);
+	}
+
+	return topology;
+}
+
+inline int
+node_count(Numa_Topology& topology)
+{
+	return int(topology.node_cpus.size());
+}
+
+inline bool
+pin_current_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+	{
+		CPU_SET(cpu, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (int cpu : cpus)
+	{
+		if (cpu < int(sizeof(DWORD_PTR) * 8))
+		{
+			mask |= DWORD_PTR(1) << cpu;
+		}
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return false;
+#endif
+}
+
+// Pins thread thread_index of a pool to a single cpu. Threads go to the nodes in turn, thread i
+// to the next free cpu of node i % nodes, so a pool smaller than the machine still spreads over
+// every node. Nodes that ran out of cpus are skipped, and threads wrap around when there are more
+// of them than cpus.
+inline void
+pin_pool_thread(Numa_Topology& topology, int thread_index)
+{
+	// node and cpu of every slot in the order the threads take them
+	std::vector<std::pair<int, int>> slots;
+	for (size_t round = 0; ; round++)
+	{
+		size_t slot_count = slots.size();
+		for (int node = 0; node < node_count(topology); node++)
+		{
+			std::vector<int>& cpus = topology.node_cpus[node];
+			if (round < cpus.size())
+			{
+				slots.push_back(std::make_pair(node, cpus[round]));
+			}
+		}
+		if (slots.size() == slot_count)
+		{
+			break;
+		}
+	}
+
+	std::pair<int, int>& slot = slots[thread_index % slots.size()];
+	pin_current_thread(std::vector<int>{ slot.second });
+	current_numa_node = slot.first;
+}
+
+// Runs work on a temporary thread pinned to the node and waits for it. Anything work allocates
+// and initializes gets first touched, and therefore placed, on that node.
+inline void
+run_on_node(Numa_Topology& topology, int node, std::function<void()> work)
+{
+	std::thread worker([&topology, node, &work]
+	{
+		pin_current_thread(topology.node_cpus[node]);
+		current_numa_node = node;
+		work();
+	});
+	worker.join();
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+// Hardware cache counters for the render loop. Only implemented on Linux through perf_event_open,
+// everywhere else (or when the kernel doesn't allow it) the counters report as unavailable.
+// Counters are inherited by threads created after they are opened, so open them before
+// spawning the render threads.
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#endif
+
+enum Perf_Counter_Type
+{
+	PERF_COUNTER_L1D_MISSES, // every one of these is a request to L2
+	PERF_COUNTER_LLC_REFERENCES,
+	PERF_COUNTER_LLC_MISSES,
+
+	PERF_COUNTER_COUNT,
+};
+
+static const char* perf_counter_names[PERF_COUNTER_COUNT] =
+{
+	"L1D read misses (L2 requests)",
+	"LLC read references",
+	"LLC read misses",
+};
+
+struct Perf_Counters
+{
+	int fds[PERF_COUNTER_COUNT];
+	uint64_t values[PERF_COUNTER_COUNT];
+	bool available[PERF_COUNTER_COUNT];
+};
+
+#ifdef __linux__
+inline int
+open_perf_event(uint64_t config)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+inline void
+open_perf_counters(Perf_Counters& counters)
+{
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		counters.fds[i] = -1;
+		counters.values[i] = 0;
+		counters.available[i] = false;
+	}
+
+#ifdef __linux__
+	const uint64_t read_access = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+	const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	counters.fds[PERF_COUNTER_L1D_MISSES] = open_perf_event(PERF_COUNT_HW_CACHE_L1D | read_miss);
+	counters.fds[PERF_COUNTER_LLC_REFERENCES] = open_perf_event(PERF_COUNT_HW_CACHE_LL | read_access);
+	counters.fds[PERF_COUNTER_LLC_MISSES] = open_perf_event(PERF_COUNT_HW_CACHE_LL | read_miss);
+
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		counters.available[i] = counters.fds[i] >= 0;
+	}
+#endif
+}
+
+inline void
+start_perf_counters(Perf_Counters& counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (counters.available[i])
+		{
+			ioctl(counters.fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+inline void
+stop_perf_counters(Perf_Counters& counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (counters.available[i])
+		{
+			ioctl(counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			uint64_t value = 0;
+			if (read(counters.fds[i], &value, sizeof(value)) == sizeof(value))
+			{
+				counters.values[i] = value;
+			}
+		}
+	}
+#endif
+}
+
+inline void
+close_perf_counters(Perf_Counters& counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (counters.available[i])
+		{
+			close(counters.fds[i]);
+		}
+	}
+#endif
+}
+
+inline void
+print_perf_counters(Perf_Counters& counters, uint64_t total_bounces)
+{
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+	{
+		if (counters.available[i])
+		{
+			printf("%s: %llu (%.3f per bounce)\n", perf_counter_names[i], (unsigned long long)counters.values[i],
+				   double(counters.values[i]) / double(total_bounces));
+		}
+		else
+		{
+			printf("%s: not available\n", perf_counter_names[i]);
+		}
+	}
+}
@@ -4,12 +4,36 @@
 
 #define PI 3.14159265359f
 
+// v3f and v4f are plain structs of floats unless built with USE_SIMD_VECTORS=1, which makes them
+// SSE registers (see ray_math_simd.h).
+#ifndef USE_SIMD_VECTORS
+#define USE_SIMD_VECTORS 0
+#endif
+
+// SSE2 comes with every x86-64 build, code written with its intrinsics has a scalar version for
+// the builds without it.
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAS_SSE2 1
+#include <emmintrin.h>
+#else
+#define HAS_SSE2 0
+#if USE_SIMD_VECTORS
+#error "USE_SIMD_VECTORS=1 needs SSE2"
+#endif
+#endif
+
+#if USE_SIMD_VECTORS
+#include "ray_math_simd.h"
+#endif
+
 inline float
 degrees_to_radians(float degrees)
 {
 	return PI * degrees / 180.0f;
 }
 
+#if !USE_SIMD_VECTORS
+
 // V4 declartions, functions
 
 union v4f {
@@ -127,6 +151,8 @@ dot(v4f a, v4f b)
 	return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
 }
 
+#endif
+
 union v4d {
 	struct {
 		double x, y, z, w;
@@ -242,6 +268,8 @@ dot(v4d a, v4d b)
 	return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
 }
 
+#if !USE_SIMD_VECTORS
+
 // V3 declartions, functions
 
 union v3f {
@@ -394,6 +422,8 @@ reflect(v3f v, v3f n)
 	return v - 2 * n*dot(v, n);
 }
 
+#endif
+
 inline v3f
 random_v3f(float min, float max)
 {
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <emmintrin.h>
+#if defined(__FMA__) || defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_VECTORS_FMA 1
+#endif
+
+// SSE versions of v4f and v3f, ray_math.h uses them instead of the scalar ones when built with
+// USE_SIMD_VECTORS=1. A v3f fills a whole register, the fourth lane is padding that is zero for
+// vectors made with V3f() or braces and that nothing reads. Built with FMA (-mfma or /arch:AVX2)
+// the products in dot, cross, normalize and lerp are fused.
+
+union v4f {
+	struct {
+		float x, y, z, w;
+	};
+	struct {
+		float r, g, b, a;
+	};
+	float e[4];
+	__m128 m;
+};
+
+union v3f {
+	struct {
+		float x, y, z, padding;
+	};
+	struct {
+		float r, g, b;
+	};
+	float e[3];
+	__m128 m;
+};
+
+// a*b + c
+inline __m128
+fused_multiply_add(__m128 a, __m128 b, __m128 c)
+{
+#if SIMD_VECTORS_FMA
+	return _mm_fmadd_ps(a, b, c);
+#else
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+// c - a*b
+inline __m128
+fused_negative_multiply_add(__m128 a, __m128 b, __m128 c)
+{
+#if SIMD_VECTORS_FMA
+	return _mm_fnmadd_ps(a, b, c);
+#else
+	return _mm_sub_ps(c, _mm_mul_ps(a, b));
+#endif
+}
+
+// a*b - c
+inline __m128
+fused_multiply_subtract(__m128 a, __m128 b, __m128 c)
+{
+#if SIMD_VECTORS_FMA
+	return _mm_fmsub_ps(a, b, c);
+#else
+	return _mm_sub_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+// 1 / sqrt(x) in every lane, the estimate is good to 12 bits and one Newton step takes it to
+// about 22
+inline __m128
+reciprocal_sqrt(__m128 x)
+{
+	__m128 r = _mm_rsqrt_ps(x);
+	__m128 half_x_r = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(.5f), x), r);
+	return _mm_mul_ps(r, fused_negative_multiply_add(half_x_r, r, _mm_set1_ps(1.5f)));
+}
+
+// V4 declartions, functions
+
+inline v4f
+V4f(__m128 m)
+{
+	v4f result;
+	result.m = m;
+	return result;
+}
+
+inline v4f
+V4f(float a, float b, float c, float d)
+{
+	return V4f(_mm_setr_ps(a, b, c, d));
+}
+
+inline v4f
+operator*(float a, v4f b)
+{
+	return V4f(_mm_mul_ps(_mm_set1_ps(a), b.m));
+}
+
+inline v4f
+operator*(v4f b, float a)
+{
+	return V4f(_mm_mul_ps(b.m, _mm_set1_ps(a)));
+}
+
+inline v4f &
+operator*=(v4f &b, float a)
+{
+	b = a * b;
+	return b;
+}
+
+inline v4f
+operator-(v4f a)
+{
+	return V4f(_mm_xor_ps(a.m, _mm_set1_ps(-.0f)));
+}
+
+inline v4f
+operator+(v4f a, v4f b)
+{
+	return V4f(_mm_add_ps(a.m, b.m));
+}
+
+inline v4f &
+operator+=(v4f &a, v4f b)
+{
+	a = a + b;
+	return a;
+}
+
+inline v4f
+operator-(v4f a, v4f b)
+{
+	return V4f(_mm_sub_ps(a.m, b.m));
+}
+
+// the sum of the products in every lane
+inline __m128
+dot4(v4f a, v4f b)
+{
+	__m128 p = _mm_mul_ps(a.m, b.m);
+	p = _mm_add_ps(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_add_ps(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+inline float
+dot(v4f a, v4f b)
+{
+	return _mm_cvtss_f32(dot4(a, b));
+}
+
+inline float
+length(v4f a)
+{
+	return _mm_cvtss_f32(_mm_sqrt_ss(dot4(a, a)));
+}
+
+inline v4f
+normalize(v4f a)
+{
+	return V4f(_mm_mul_ps(a.m, reciprocal_sqrt(dot4(a, a))));
+}
+
+inline v4f
+lerp(v4f a, float t, v4f b)
+{
+	return V4f(fused_multiply_add(_mm_set1_ps(t), _mm_sub_ps(b.m, a.m), a.m));
+}
+
+// V3 declartions, functions
+
+inline v3f
+V3f(__m128 m)
+{
+	v3f result;
+	result.m = m;
+	return result;
+}
+
+inline v3f
+V3f(float a, float b, float c)
+{
+	return V3f(_mm_setr_ps(a, b, c, .0f));
+}
+
+inline v3f
+operator*(float a, v3f b)
+{
+	return V3f(_mm_mul_ps(_mm_set1_ps(a), b.m));
+}
+
+inline v3f
+operator*(v3f b, float a)
+{
+	return V3f(_mm_mul_ps(b.m, _mm_set1_ps(a)));
+}
+
+inline v3f
+operator*(v3f b, v3f a)
+{
+	return V3f(_mm_mul_ps(b.m, a.m));
+}
+
+inline v3f
+operator/(v3f b, float a)
+{
+	return V3f(_mm_div_ps(b.m, _mm_set1_ps(a)));
+}
+
+inline v3f &
+operator*=(v3f &b, float a)
+{
+	b = a * b;
+	return b;
+}
+
+inline v3f
+operator-(v3f a)
+{
+	return V3f(_mm_xor_ps(a.m, _mm_set1_ps(-.0f)));
+}
+
+inline v3f
+operator+(v3f a, v3f b)
+{
+	return V3f(_mm_add_ps(a.m, b.m));
+}
+
+inline v3f &
+operator+=(v3f &a, v3f b)
+{
+	a = a + b;
+	return a;
+}
+
+inline v3f
+operator-(v3f a, v3f b)
+{
+	return V3f(_mm_sub_ps(a.m, b.m));
+}
+
+// x*x + y*y + z*z in the lowest lane, the padding lane is left out
+inline __m128
+dot3(v3f a, v3f b)
+{
+	__m128 ay = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 by = _mm_shuffle_ps(b.m, b.m, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 az = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(2, 2, 2, 2));
+	__m128 bz = _mm_shuffle_ps(b.m, b.m, _MM_SHUFFLE(2, 2, 2, 2));
+#if SIMD_VECTORS_FMA
+	return _mm_fmadd_ss(az, bz, _mm_fmadd_ss(ay, by, _mm_mul_ss(a.m, b.m)));
+#else
+	return _mm_add_ss(_mm_add_ss(_mm_mul_ss(a.m, b.m), _mm_mul_ss(ay, by)), _mm_mul_ss(az, bz));
+#endif
+}
+
+inline float
+dot(v3f a, v3f b)
+{
+	return _mm_cvtss_f32(dot3(a, b));
+}
+
+inline v3f
+cross(v3f a, v3f b)
+{
+	// (a * b.yzx - a.yzx * b).yzx
+	__m128 a_yzx = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 b_yzx = _mm_shuffle_ps(b.m, b.m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = fused_multiply_subtract(a.m, b_yzx, _mm_mul_ps(a_yzx, b.m));
+	return V3f(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline float
+length(v3f a)
+{
+	return _mm_cvtss_f32(_mm_sqrt_ss(dot3(a, a)));
+}
+
+inline float
+length_squared(v3f a)
+{
+	return dot(a, a);
+}
+
+inline v3f
+normalize(v3f a)
+{
+	__m128 d = dot3(a, a);
+	d = _mm_shuffle_ps(d, d, _MM_SHUFFLE(0, 0, 0, 0));
+	return V3f(_mm_mul_ps(a.m, reciprocal_sqrt(d)));
+}
+
+inline v3f
+lerp(v3f a, float t, v3f b)
+{
+	return V3f(fused_multiply_add(_mm_set1_ps(t), _mm_sub_ps(b.m, a.m), a.m));
+}
+
+inline v3f
+reflect(v3f v, v3f n)
+{
+	__m128 d = dot3(v, n);
+	d = _mm_shuffle_ps(d, d, _MM_SHUFFLE(0, 0, 0, 0));
+	return V3f(fused_negative_multiply_add(_mm_add_ps(n.m, n.m), d, v.m));
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "curves.h"
+#include "bvh.h"
+
+// Keys for tracing the bounces of many paths in an order where consecutive rays start close to
+// each other and go roughly the same way, so they walk the same bvh nodes and triangles while
+// those are still in the cache. The key is the Morton code of the origin in a 1024^3 grid over the
+// scene followed by the octant of the direction. With the octant on top every octant swept the
+// whole scene again and tracing got slower than without sorting.
+
+// paths a thread keeps in flight, several samples of a tile when the tile is small
+#define RAY_SORT_BUFFER_SIZE 16384
+// the path index is packed under the key, so sorting the keys sorts the paths
+#define RAY_SORT_INDEX_BITS 20
+
+// Box the origins are quantized in, the planes don't have one and their hits get clamped to it.
+inline Bounds
+ray_sort_bounds(World& world)
+{
+	if (world.bvh && !world.bvh->nodes.empty())
+	{
+		return world.bvh->nodes[0].bounds;
+	}
+
+	Bounds result = empty_bounds();
+	for (auto& object : world.objects)
+	{
+		Bounds bounds = object->bounds();
+		if (!is_unbounded(bounds))
+		{
+			result = union_bounds(result, bounds);
+		}
+	}
+	return result;
+}
+
+inline uint32_t
+quantize_ray_origin(float x, float min, float max)
+{
+	float extent = max - min;
+	float t = extent > .0f ? (x - min) / extent : .0f;
+	return uint32_t(clamp(t, .0f, 1.0f) * 1023.0f);
+}
+
+inline uint64_t
+ray_sort_key(Bounds& bounds, Ray& r)
+{
+	uint32_t x = quantize_ray_origin(r.origin.x, bounds.min.x, bounds.max.x);
+	uint32_t y = quantize_ray_origin(r.origin.y, bounds.min.y, bounds.max.y);
+	uint32_t z = quantize_ray_origin(r.origin.z, bounds.min.z, bounds.max.z);
+	uint32_t octant = (r.direction.x < .0f ? 1 : 0) | (r.direction.y < .0f ? 2 : 0) | (r.direction.z < .0f ? 4 : 0);
+	return (uint64_t(morton_encode(x, y, z)) << 3) | octant;
+}
@@ -4,22 +4,46 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <memory>
 #include <ctime>
 #include <cassert>
 #include <thread>
 #include <atomic>
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <mutex>
 
 using namespace std;
 
 #include "ray_tracer.h"
+#include "fast_math.h"
+#include "render_counters.h"
 #include "hittable.h"
 #include "texture.h"
+#include "texture_cache.h"
 #include "material.h"
+#include "environment.h"
+#include "lights.h"
+#include "bvh.h"
+#include "ray_sort.h"
 #include "camera.h"
+#include "curves.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "heatmap.h"
+#include "thread_pool.h"
+#include "numa.h"
+#include "net.h"
 
 #define FAST_OBJ_IMPLEMENTATION
 #include "fast_obj.h"
 
+#include "asset_loader.h"
+#include "stress_scenes.h"
+#include "scene_file.h"
+#include "scene_benchmark.h"
+
 struct Job
 {
 	Image* image;
@@ -29,6 +53,49 @@ struct Job
 	int x_max;
 	int y_min;
 	int y_max;
+	int tile_x;
+	int tile_y;
+	// when set the tile goes here instead of into the image, three floats a pixel in rows of the
+	// tile, linear and averaged over the samples
+	float* colors;
+
+	// estimated cost from the pre-pass, replaced by the measured time once the tile is rendered
+	double cost;
+};
+
+enum Tile_Order
+{
+	TILE_ORDER_SCANLINE,
+	TILE_ORDER_COST,
+	TILE_ORDER_HILBERT,
+	TILE_ORDER_MORTON,
+
+	TILE_ORDER_COUNT,
+};
+
+static const char* tile_order_names[TILE_ORDER_COUNT] = { "scanline", "cost", "hilbert", "morton" };
+
+enum Pixel_Order
+{
+	PIXEL_ORDER_SCANLINE,
+	PIXEL_ORDER_HILBERT,
+	PIXEL_ORDER_MORTON,
+
+	PIXEL_ORDER_COUNT,
+};
+
+static const char* pixel_order_names[PIXEL_ORDER_COUNT] = { "scanline", "hilbert", "morton" };
+
+static const char* light_selection_names[LIGHT_SELECTION_COUNT] = { "power", "bvh" };
+
+// Contiguous slice of the jobs array. With NUMA placement every node gets its own range, covering
+// the band of the image that was first touched by that node, and threads take work from their
+// own node's range before helping the others.
+struct Job_Range
+{
+	int first_job;
+	int end_job;
+	atomic<int> next_job;
 };
 
 struct Job_Queue
@@ -38,334 +105,2720 @@ struct Job_Queue
 
 	int samples_per_pixel;
 	int ray_depth;
+	Pixel_Order pixel_order;
+	// trace the camera rays of neighbouring pixels together through the bvh
+	bool camera_ray_packets;
+	// trace the paths of a tile a bounce at a time, sorting the rays of every bounce after the first
+	bool sort_secondary_rays;
 
-	atomic<int> next_job;
+	Job_Range ranges[MAX_NUMA_NODES];
+	int range_count;
+
+	// per node replicas of the scene, null when every thread reads the job's world
+	World* node_worlds[MAX_NUMA_NODES];
+
+	// frame seed, every tile reseeds the random numbers from it and its position
+	uint64_t seed;
+
+	// what every pixel cost, null when not wanted
+	Heatmap* heatmap;
+
+	// the segments of the paths, and every ray traced including the shadow rays
 	atomic<uint64_t> total_bounces;
+	atomic<uint64_t> total_rays;
 	atomic<uint64_t> finished_jobs;
 };
 
-v3f ray_cast(World& world, v3f background, Ray r, int depth)
+// Rays this thread traced, render_tile adds what it traced for a tile to the queue's totals.
+struct Ray_Counts
 {
-	if (depth <= 0)
+	uint64_t rays;
+	uint64_t bounces;
+};
+
+static thread_local Ray_Counts ray_counts;
+
+// The cost of some work for the heatmap is how much this moves over it.
+inline uint64_t
+heatmap_counter(Heatmap_Mode mode)
+{
+	switch (mode)
 	{
-		return v3f{ .0f, .0f, .0f };
+		case HEATMAP_TIME: return read_cycle_counter();
+		case HEATMAP_RAYS: return ray_counts.rays;
+#if USE_RENDER_COUNTERS
+		case HEATMAP_TESTS: return traversal_steps();
+#endif
+		default: return 0;
 	}
+}
 
-	bool hit = false;
+// hit() only writes the record when it finds a closer hit, so every object can write to the same
+// record instead of copying the whole thing on every hit
+bool closest_hit(World& world, Ray& r, Hit_Record& rec)
+{
+	ray_counts.rays++;
 	float t_max = infinity;
-	Hit_Record rec = {};
-	for (auto object : world.objects)
+	bool hit = false;
+	if (world.bvh)
 	{
-		Hit_Record temp_rec = {};
-		if (object->hit(r, 0.0001f, t_max, temp_rec))
+		hit = bvh_closest_hit(*world.bvh, r, 0.0001f, t_max, rec);
+	}
+	else
+	{
+		for (auto& object : world.objects)
 		{
-			rec = temp_rec;
-			t_max = temp_rec.t;
-			hit = true;
+			if (object->hit(r, 0.0001f, t_max, rec))
+			{
+				t_max = rec.t;
+				rec.object = object.get();
+				hit = true;
+			}
 		}
 	}
+	RENDER_COUNT_ADD(hits, hit ? 1 : 0);
+	return hit;
+}
 
-	if (hit)
+// returns a bit for every ray of the prepared packet that hit something
+int closest_hit(World& world, Ray_Packet& packet, Hit_Record* recs)
+{
+	if (world.bvh)
 	{
-		v3f attenuation = {};
-		v3f emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
-		if (!rec.mat->scatter(rec, r, attenuation))
-		{
-			return emitted;
-		}
-		else
-		{
-			return emitted + attenuation * ray_cast(world, background, r, depth - 1);
-		}
+		ray_counts.rays += packet.count;
+		int hits = bvh_closest_hit(*world.bvh, packet, 0.0001f, recs);
+		RENDER_COUNT_ADD(hits, count_bits(uint32_t(hits)));
+		return hits;
+	}
+
+	int hits = 0;
+	for (int lane = 0; lane < packet.count; lane++)
+	{
+		hits |= closest_hit(world, packet.rays[lane], recs[lane]) ? 1 << lane : 0;
+	}
+	return hits;
+}
+
+bool any_hit(World& world, Ray& r)
+{
+	ray_counts.rays++;
+	bool hit = false;
+	if (world.bvh)
+	{
+		hit = bvh_any_hit(*world.bvh, r, 0.0001f, infinity);
 	}
 	else
 	{
-		return background;
+		Hit_Record rec = {};
+		for (auto& object : world.objects)
+		{
+			if (object->hit(r, 0.0001f, infinity, rec))
+			{
+				hit = true;
+				break;
+			}
+		}
 	}
+	RENDER_COUNT_ADD(hits, hit ? 1 : 0);
+	return hit;
 }
 
-bool render_tile(Job_Queue& queue)
+v3f background_radiance(World& world, v3f direction)
 {
-	printf("\rRaycasting %.2f%%", 100.0f * (float(queue.finished_jobs.load()) / float(queue.jobs_count)));
-	fflush(stdout);
+	if (world.environment)
+	{
+		return environment_radiance(*world.environment, direction);
+	}
+	return world.background;
+}
 
-	int job_index = queue.next_job.fetch_add(1);
-	if (job_index >= queue.jobs_count)
+// Light from the environment map reaching the hit point straight away, through a direction picked
+// by the brightness of the map.
+v3f sample_environment_light(World& world, Hit_Record& rec, v3f incoming)
+{
+	v3f direction = {};
+	float light_pdf = .0f;
+	v3f radiance = sample_environment(*world.environment, random_float(), random_float(), direction, light_pdf);
+	if (light_pdf <= .0f)
 	{
-		return false;
+		return v3f{ .0f, .0f, .0f };
 	}
 
-	Job& job = *(queue.jobs + job_index);
-	Image& image = *job.image;
-	World& world = *job.world;
-	Camera& camera = *job.camera;
-	int x_min = job.x_min;
-	int x_max = job.x_max;
-	int y_min = job.y_min;
-	int y_max = job.y_max;
+	float scatter_pdf = rec.mat->scatter_pdf(rec, incoming, direction);
+	if (scatter_pdf <= .0f)
+	{
+		return v3f{ .0f, .0f, .0f };
+	}
 
-	int depth = queue.ray_depth;
-	int samples_per_pixel = queue.samples_per_pixel;
-	for (int y = y_min; y < y_max; y++)
+	Ray shadow_ray = Ray(rec.p, direction);
+	RENDER_COUNT(rays[RAY_SHADOW]);
+	if (any_hit(world, shadow_ray))
 	{
-		uint32_t* buf = image.get_image_ptr(x_min, y);
+		return v3f{ .0f, .0f, .0f };
+	}
 
-		for (int x = x_min; x < x_max; x++)
-		{
-			v3f color = {};
-			for (int sample = 0; sample < samples_per_pixel; sample++)
-			{
-				float film_x = (float(x) + random_float()) / float(image.width);
-				float film_y = (float(y) + random_float()) / float(image.height);
+	float weight = power_heuristic(light_pdf, scatter_pdf) / light_pdf;
+	return weight * rec.mat->evaluate_scatter(rec, incoming, direction) * radiance;
+}
 
-				Ray r = camera.get_ray(film_x, film_y);
+// Light from one of the emissive objects, picked by the world's light sampler, reaching the hit
+// point straight away.
+v3f sample_emitter_light(World& world, Hit_Record& rec, v3f incoming)
+{
+	float pmf = .0f;
+	int light_index = pick_light(*world.lights, rec.p, rec.n, random_float(), pmf);
+	if (light_index < 0)
+	{
+		return v3f{ .0f, .0f, .0f };
+	}
 
-				color += ray_cast(world, world.background, r, depth);
+	Hittable* light = world.lights->lights[light_index];
+	v3f direction = {};
+	float direction_pdf = .0f;
+	if (!light->sample_direction(rec.p, random_float(), random_float(), direction, direction_pdf) || direction_pdf <= .0f)
+	{
+		return v3f{ .0f, .0f, .0f };
+	}
 
-				queue.total_bounces++;
-			}
+	float scatter_pdf = rec.mat->scatter_pdf(rec, incoming, direction);
+	if (scatter_pdf <= .0f)
+	{
+		return v3f{ .0f, .0f, .0f };
+	}
 
-			color = color / float(samples_per_pixel);
-			color = correct_gamma(color);
-			*buf = unpack_rgba(color);
-			buf++;
-		}
+	// the light only counts if it is the first thing the shadow ray hits
+	Ray shadow_ray = Ray(rec.p, direction);
+	RENDER_COUNT(rays[RAY_SHADOW]);
+	Hit_Record light_rec = {};
+	if (!closest_hit(world, shadow_ray, light_rec) || light_rec.object != light)
+	{
+		return v3f{ .0f, .0f, .0f };
 	}
 
-	queue.finished_jobs++;
-	
-	return true;
+	v3f radiance = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+	float light_pdf = pmf * direction_pdf;
+	float weight = power_heuristic(light_pdf, scatter_pdf) / light_pdf;
+	return weight * rec.mat->evaluate_scatter(rec, incoming, direction) * radiance;
 }
 
-void do_work(Job_Queue& queue)
+// A path from the camera between two of its bounces: the ray to trace next and what it carries.
+struct Path
 {
-	while(render_tile(queue)) {}
+	Ray r;
+	Ray_Differential differential;
+	v3f color;
+	v3f throughput;
+	// density r was scattered with, zero for camera rays and materials with a single direction
+	float scatter_pdf;
+	// where r was scattered from, for the density of sampling the light it hits from there
+	v3f scatter_p;
+	v3f scatter_n;
+	int bounce;
+	// pixel of the tile the path adds its color to, when paths are traced in batches
+	int pixel;
+};
+
+Path start_path(Ray r, Ray_Differential differential)
+{
+	Path path = {};
+	path.r = r;
+	path.differential = differential;
+	path.throughput = v3f{ 1.0f, 1.0f, 1.0f };
+	return path;
 }
 
-bool aabb(Ray& r, v3f p0, v3f p1)
+// Adds the light of the path's ray hitting rec (or nothing, by found) and scatters it into the
+// next ray. Every bounce off a material that has a scatter pdf also samples the environment map
+// and one of the emissive objects directly, and both ways of reaching a light are weighted with
+// multiple importance sampling. Returns false when the path is done.
+bool continue_path(World& world, Path& path, Hit_Record& rec, bool found, int depth)
 {
-	float t0x = MIN((p0.x - r.origin.x) / r.direction.x, (p1.x - r.origin.x) / r.direction.x);
-	float t1x = MAX((p0.x - r.origin.x) / r.direction.x, (p1.x - r.origin.x) / r.direction.x);
+	ray_counts.bounces++;
+	RENDER_COUNT(rays[path.bounce == 0 ? RAY_CAMERA : RAY_BOUNCE]);
+	Ray& r = path.r;
+	if (!found)
+	{
+		RENDER_COUNT(path_ends[PATH_END_ESCAPED]);
+		v3f background = background_radiance(world, r.direction);
+		if (world.environment && path.scatter_pdf > .0f)
+		{
+			background = power_heuristic(path.scatter_pdf, environment_pdf(*world.environment, r.direction)) * background;
+		}
+		path.color += path.throughput * background;
+		return false;
+	}
 
-	float t0y = MIN((p0.y - r.origin.y) / r.direction.y, (p1.y - r.origin.y) / r.direction.y);
-	float t1y = MAX((p0.y - r.origin.y) / r.direction.y, (p1.y - r.origin.y) / r.direction.y);
+	compute_hit_differentials(rec, path.differential);
+	if (path.differential.valid)
+	{
+		rec.mat->scatter_differential(rec, r, path.differential);
+	}
 
-	float t_min = MAX(t0x, t0y);
-	float t_max = MIN(t1x, t1y);
+	v3f emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
+	if (world.lights && path.scatter_pdf > .0f && rec.object->light_index >= 0)
+	{
+		float light_pdf = light_pmf(*world.lights, path.scatter_p, path.scatter_n, rec.object->light_index) * rec.object->direction_pdf(path.scatter_p, rec);
+		emitted = power_heuristic(path.scatter_pdf, light_pdf) * emitted;
+	}
+	path.color += path.throughput * emitted;
 
-	if (t_min >= t_max) { return false; }
+	// on the last hit the scattered ray doesn't get traced, so the light sample would have
+	// nothing to be weighted against
+	if (world.environment && path.bounce + 1 < depth)
+	{
+		path.color += path.throughput * sample_environment_light(world, rec, r.direction);
+	}
+	if (world.lights && path.bounce + 1 < depth)
+	{
+		path.color += path.throughput * sample_emitter_light(world, rec, r.direction);
+	}
 
-	float t0z = MIN((p0.z - r.origin.z) / r.direction.z, (p1.z - r.origin.z) / r.direction.z);
-	float t1z = MIN((p0.z - r.origin.z) / r.direction.z, (p1.z - r.origin.z) / r.direction.z);
+	v3f incoming = r.direction;
+	v3f attenuation = {};
+	if (!rec.mat->scatter(rec, r, attenuation))
+	{
+		RENDER_COUNT(path_ends[PATH_END_ABSORBED]);
+		return false;
+	}
+	path.scatter_pdf = world.environment || world.lights ? rec.mat->scatter_pdf(rec, incoming, r.direction) : .0f;
+	path.scatter_p = rec.p;
+	path.scatter_n = rec.n;
+	path.throughput = path.throughput * attenuation;
+	path.bounce++;
+	RENDER_COUNT_ADD(path_ends[PATH_END_DEPTH], path.bounce < depth ? 0 : 1);
+	return path.bounce < depth;
+}
 
-	t_min = MIN(t0z, t_min);
-	t_max = MAX(t1z, t_max);
+// Follows a path from the camera for up to depth hits.
+//
+// first_hit, when there is one, is where r was already found to hit (or not, by found_first_hit).
+v3f ray_cast(World& world, Ray r, Ray_Differential differential, int depth, Hit_Record* first_hit, bool found_first_hit)
+{
+	Path path = start_path(r, differential);
+	if (depth <= 0)
+	{
+		return path.color;
+	}
 
-	if (t_min >= t_max) { return false; }
+	for (;;)
+	{
+		Hit_Record rec = {};
+		bool found = false;
+		if (path.bounce == 0 && first_hit)
+		{
+			rec = *first_hit;
+			found = found_first_hit;
+		}
+		else
+		{
+			found = closest_hit(world, path.r, rec);
+		}
+		if (!continue_path(world, path, rec, found, depth))
+		{
+			break;
+		}
+	}
 
-	return true;
+	return path.color;
 }
 
-enum World_Types
+v3f ray_cast(World& world, Ray r, Ray_Differential differential, int depth)
 {
-	DEFAULT_WORLD,
-	LIGHTED_WORLD,
-	MONKEY_WORLD,
-};
+	return ray_cast(world, r, differential, depth, nullptr, false);
+}
 
-World generate_world(World_Types type = DEFAULT_WORLD)
+v3f ray_cast(World& world, Ray r, int depth)
 {
-	World world = {};
+	Ray_Differential differential = {};
+	return ray_cast(world, r, differential, depth);
+}
 
-	switch (type)
-	{
-		case DEFAULT_WORLD:
-		{
-			auto earth_texture = make_shared<Image_Texture>("../resources/earthmap.jpg");
-			auto earth_surface = make_shared<Lambertian>(earth_texture);
-			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
-			auto material_ground = make_shared<Lambertian>(checker_texture);
-			auto material_big_metal = make_shared<Metal>(V3f(0.2f, 0.25f, 0.7f), .0f);
-			auto material_big_dielectric = make_shared<Dielectric>(1.7f);
-			auto material_from_behind = make_shared<Lambertian>(V3f(1.0f, .0f, .0f));
+// Every thread accumulates its tile in a private buffer and writes the finished pixels to the
+// shared framebuffer in one go. Neighbouring tiles rendered by different threads would
+// otherwise keep writing into the same cache lines for the whole duration of the tile.
+struct Tile_Buffer
+{
+	v3f* colors;
+	// for the heatmap
+	float* costs;
+	int capacity;
 
-			auto big_sphere_dielectric = make_shared<Sphere>(V3f(2.5f, 2.0f, -3.0f), 2.0f, material_big_dielectric);
-			auto behind1 = make_shared<Sphere>(V3f(3.0f, .5f, -12.0f), .5f, material_from_behind);
-			auto behind2 = make_shared<Sphere>(V3f(7.0f, .5f, -20.0f), .5f, material_from_behind);
-			auto behind3 = make_shared<Sphere>(V3f(9.0f, .5f, -13.0f), .5f, material_from_behind);
-			auto big_sphere_metal = make_shared<Sphere>(V3f(-3.5f, 2.0f, -3.0f), 2.0f, material_big_metal);
-			auto center = make_shared<Sphere>(V3f(.0f, .5f, -1.0f), .5f, earth_surface);
-			auto left = make_shared<Sphere>(V3f(-2.0f, .5f, .0f), .5f, make_shared<Metal>(V3f(.8f, .6f, .2f), .7f));
-			auto right = make_shared<Sphere>(V3f(2.0f, .5f, 0.7f), .5f, make_shared<Metal>(V3f(.8f, .6f, .2f), .3f));
-			auto ground = make_shared<Sphere>(V3f(.0f, -1000.0f, .0f), 1000.0f, material_ground);
+	~Tile_Buffer()
+	{
+		free_aligned(colors);
+		free_aligned(costs);
+	}
+};
 
-			world.add_object(center);
-			world.add_object(left);
-			world.add_object(right);
-			world.add_object(ground);
-			world.add_object(big_sphere_dielectric);
-			world.add_object(behind1);
-			world.add_object(behind2);
-			world.add_object(behind3);
-			world.add_object(big_sphere_metal);
+static thread_local Tile_Buffer tile_buffer = {};
 
-			world.background = v3f{.7f, .8f, 1.0f};
+v3f* get_tile_buffer(int pixel_count)
+{
+	if (tile_buffer.capacity < pixel_count)
+	{
+		free_aligned(tile_buffer.colors);
+		free_aligned(tile_buffer.costs);
+		tile_buffer.colors = (v3f*)allocate_aligned(pixel_count * sizeof(v3f), CACHE_LINE_SIZE);
+		tile_buffer.costs = (float*)allocate_aligned(pixel_count * sizeof(float), CACHE_LINE_SIZE);
+		tile_buffer.capacity = pixel_count;
+	}
+	return tile_buffer.colors;
+}
 
-		} break;
+// Paths of the tile a thread is tracing a bounce at a time, kept between tiles like the tile
+// buffer so they are only allocated once.
+struct Path_Buffer
+{
+	std::vector<int> pixels;
+	std::vector<Path> paths;
+	std::vector<int> active;
+	std::vector<int> next;
+	std::vector<uint64_t> keys;
+};
 
-		case LIGHTED_WORLD:
-		{
-			auto light = make_shared<Diffuse_Light>(v3f{ 1.0f, 1.0f, 1.0f });
-			auto material_center = make_shared<Lambertian>(V3f(.7f, .3f, .3f));
-			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
-			auto material_ground = make_shared<Lambertian>(checker_texture);
+static thread_local Path_Buffer path_buffer;
 
-			auto sphere_light = make_shared<Sphere>(v3f{ .0f, 3.0f, .0f }, 1.5f, light);
-			auto ground = make_shared<Sphere>(v3f{ .0f, -1000.0f, .0f }, 1000.0f, material_ground);
-			auto center_sphere = make_shared<Sphere>(v3f{.0f, .5f, .0f}, .5f, material_center);
+// Renders the pixels of the path buffer, indices into the tile, as many samples of them at a time
+// as fit in the buffer, and a part of them at a time when not even one sample fits. Camera rays are traced in pixel order, as packets when those are on, and
+// the rays of every later bounce sorted by ray_sort_key so that rays leaving from the same part of
+// the scene in the same direction are traced one after the other. Costs are only filled in with a
+// heatmap.
+void render_pixels_sorted(Job_Queue& queue, World& world, Camera& camera, Job& job, float film_dx, float film_dy, v3f* colors, float* costs)
+{
+	Path_Buffer& buffer = path_buffer;
+	Image& image = *job.image;
+	int tile_width = job.x_max - job.x_min;
+	int total_pixels = int(buffer.pixels.size());
+	int samples_per_pixel = queue.samples_per_pixel;
+	int depth = queue.ray_depth;
+	Bounds bounds = ray_sort_bounds(world);
+	Heatmap_Mode heatmap_mode = queue.heatmap ? queue.heatmap->mode : HEATMAP_NONE;
 
-			world.add_object(sphere_light);
-			world.add_object(ground);
-			world.add_object(center_sphere);
-			
-			world.background = v3f{ .0f, .0f, .0f };
+	for (int pixel : buffer.pixels)
+	{
+		colors[pixel] = v3f{ .0f, .0f, .0f };
+		costs[pixel] = .0f;
+	}
+	if (depth <= 0)
+	{
+		return;
+	}
 
-		} break;
+	// A tile with more pixels than fit in the buffer goes a part at a time, so path indices always
+	// fit under the sort key
+	static_assert(RAY_SORT_BUFFER_SIZE <= (1 << RAY_SORT_INDEX_BITS), "path indices don't fit under the sort key");
+	for (int first_pixel = 0; first_pixel < total_pixels; first_pixel += RAY_SORT_BUFFER_SIZE)
+	{
+		const int* pixels = buffer.pixels.data() + first_pixel;
+		int pixel_count = MIN(RAY_SORT_BUFFER_SIZE, total_pixels - first_pixel);
+		int batch_samples = MIN(samples_per_pixel, RAY_SORT_BUFFER_SIZE / pixel_count);
 
-		case MONKEY_WORLD:
+		for (int first_sample = 0; first_sample < samples_per_pixel; first_sample += batch_samples)
 		{
-			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
-			auto material_ground = make_shared<Lambertian>(checker_texture);
-			auto ground = make_shared<Sphere>(v3f{ .0f, -1000.0f, .0f }, 1000.0f, material_ground);
-
-			world.add_object(ground);
+			int samples = MIN(batch_samples, samples_per_pixel - first_sample);
+			buffer.paths.resize(samples * pixel_count);
+			buffer.active.clear();
+			for (int sample = 0; sample < samples; sample++)
+			{
+				for (int i = 0; i < pixel_count; i++)
+				{
+					int pixel = pixels[i];
+					float film_x = (float(job.x_min + pixel % tile_width) + random_float()) / float(image.width);
+					float film_y = (float(job.y_min + pixel / tile_width) + random_float()) / float(image.height);
 
-			auto redish = make_shared<Lambertian>(V3f(.7f, .3f, .3f));
-			fastObjMesh* mesh = fast_obj_read("../resources/suzanne.obj");
+					Ray_Differential differential = {};
+					Ray r = camera.get_ray(film_x, film_y, film_dx, film_dy, differential);
 
-			v3f monkey_offset = { .0f, 1.0f, .0f };
+					int index = sample * pixel_count + i;
+					buffer.paths[index] = start_path(r, differential);
+					buffer.paths[index].pixel = pixel;
+					buffer.active.push_back(index);
+				}
+			}
 
-			for (unsigned int i = 0; i < mesh->face_count; i++)
+			for (int bounce = 0; !buffer.active.empty(); bounce++)
 			{
-				unsigned int v0_index = mesh->indices[i * 3].p;
-				unsigned int v1_index = mesh->indices[i * 3 + 1].p;
-				unsigned int v2_index = mesh->indices[i * 3 + 2].p;
+				int active_count = int(buffer.active.size());
+				if (bounce > 0)
+				{
+					buffer.keys.clear();
+					for (int index : buffer.active)
+					{
+						buffer.keys.push_back((ray_sort_key(bounds, buffer.paths[index].r) << RAY_SORT_INDEX_BITS) | uint64_t(index));
+					}
+					std::sort(buffer.keys.begin(), buffer.keys.end());
+					for (int i = 0; i < active_count; i++)
+					{
+						buffer.active[i] = int(buffer.keys[i] & ((uint64_t(1) << RAY_SORT_INDEX_BITS) - 1));
+					}
+				}
 
-				v3f a = v3f{ mesh->positions[v0_index * 3], mesh->positions[v0_index * 3 + 1], mesh->positions[v0_index * 3 + 2] } +monkey_offset;
-				v3f b = v3f{ mesh->positions[v1_index * 3], mesh->positions[v1_index * 3 + 1], mesh->positions[v1_index * 3 + 2] } +monkey_offset;
-				v3f c = v3f{ mesh->positions[v2_index * 3], mesh->positions[v2_index * 3 + 1], mesh->positions[v2_index * 3 + 2] } +monkey_offset;
-				auto triangle = make_shared<Triangle>(a, b, c, redish);
-				world.add_object(triangle);
-			}
+				buffer.next.clear();
+				for (int first = 0; first < active_count; first += RAY_PACKET_SIZE)
+				{
+					int count = MIN(RAY_PACKET_SIZE, active_count - first);
+					int* indices = buffer.active.data() + first;
+					Hit_Record recs[RAY_PACKET_SIZE] = {};
+					int hits = 0;
+					if (bounce == 0 && queue.camera_ray_packets)
+					{
+						Ray_Packet packet;
+						for (int lane = 0; lane < count; lane++)
+						{
+							packet.rays[lane] = buffer.paths[indices[lane]].r;
+						}
+						prepare_ray_packet(packet, count);
+						uint64_t cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+						hits = closest_hit(world, packet, recs);
+						if (heatmap_mode)
+						{
+							float lane_cost = float(heatmap_counter(heatmap_mode) - cost_start) / float(count);
+							for (int lane = 0; lane < count; lane++)
+							{
+								costs[buffer.paths[indices[lane]].pixel] += lane_cost;
+							}
+						}
+					}
+					else
+					{
+						for (int lane = 0; lane < count; lane++)
+						{
+							uint64_t cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+							hits |= closest_hit(world, buffer.paths[indices[lane]].r, recs[lane]) ? 1 << lane : 0;
+							if (heatmap_mode)
+							{
+								costs[buffer.paths[indices[lane]].pixel] += float(heatmap_counter(heatmap_mode) - cost_start);
+							}
+						}
+					}
 
-			world.background = v3f{ .7f, .8f, 1.0f };
-		} break;
+					for (int lane = 0; lane < count; lane++)
+					{
+						Path& path = buffer.paths[indices[lane]];
+						uint64_t cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+						bool more = continue_path(world, path, recs[lane], (hits & (1 << lane)) != 0, depth);
+						if (heatmap_mode)
+						{
+							costs[path.pixel] += float(heatmap_counter(heatmap_mode) - cost_start);
+						}
+						if (more)
+						{
+							buffer.next.push_back(indices[lane]);
+						}
+					}
+				}
+				buffer.active.swap(buffer.next);
+			}
 
-		default:
-			printf("Couldn't generate such type of world!\n");
-			break;
+			for (Path& path : buffer.paths)
+			{
+				colors[path.pixel] += path.color;
+			}
+		}
 	}
-
-	return world;
 }
 
-int main()
+int acquire_job(Job_Queue& queue)
 {
-	// Image
-	const float aspect_ratio = 16.0f / 9.0f;
-	Image image = {};
-	image.width = 1024;
-	image.height = int(float(image.width) / aspect_ratio);
-	image.pixels = (uint32_t*)malloc(image.width * image.height * sizeof(uint32_t));
-
-	// World generation
-	v3f look_from = v3f{ .0f, 1.0f, 5.0f };
-	v3f look_at = v3f{ .0f, .0f, .0f };
-	v3f vup = v3f{ .0f, 1.0f, .0f };
-	float dist_to_focus = 10.0f;
-	float aperture = .2f;
-	Camera camera = Camera{ look_from, look_at, vup, aspect_ratio, 60.0f, aperture, dist_to_focus };
-	World world = generate_world();
-	
-	// tile division
-	int core_count = 4; // this should be an OS query
-	int tile_width = image.width / 8;
-	int tile_height = tile_width;
-	
-	int tile_count_x = (image.width + tile_width - 1) / tile_width;
-	int tile_count_y = (image.height + tile_height - 1) / tile_height;
-	const int total_tiles = tile_count_x * tile_count_y;
-
-	Job_Queue queue = {};
-	queue.ray_depth = 8;
-	queue.samples_per_pixel = 32;
-	queue.jobs = new Job[total_tiles];
-
-	for (int tile_y = 0; tile_y < tile_count_y; tile_y++)
+	int home_range = current_numa_node % queue.range_count;
+	for (int i = 0; i < queue.range_count; i++)
 	{
-		int y_min = tile_y*tile_height;
-		int y_max = y_min + tile_height;
-		if (y_max > image.height)
+		Job_Range& range = queue.ranges[(home_range + i) % queue.range_count];
+		if (range.next_job.load() < range.end_job)
 		{
-			y_max = image.height;
+			int job_index = range.next_job.fetch_add(1);
+			if (job_index < range.end_job)
+			{
+				return job_index;
+			}
+		}
+	}
+
+	return -1;
+}
+
+void render_job(Job_Queue& queue, Job& job)
+{
+	TRACE_TILE_SCOPE("tile", job.tile_x, job.tile_y);
+	Image& image = *job.image;
+	World* node_world = queue.node_worlds[current_numa_node];
+	World& world = node_world ? *node_world : *job.world;
+	Camera& camera = *job.camera;
+	int x_min = job.x_min;
+	int x_max = job.x_max;
+	int y_min = job.y_min;
+	int y_max = job.y_max;
+
+	int depth = queue.ray_depth;
+	int samples_per_pixel = queue.samples_per_pixel;
+	double start = get_time_ms();
+	seed_random(queue.seed, (uint64_t(job.tile_y) << 32) | uint64_t(job.tile_x));
+	Ray_Counts counts_before = ray_counts;
+
+	// curve orders walk the smallest power of two square that covers the tile and skip the
+	// positions that fall outside of it
+	uint32_t tile_width = uint32_t(x_max - x_min);
+	uint32_t tile_height = uint32_t(y_max - y_min);
+	uint32_t curve_size = next_power_of_two(MAX(tile_width, tile_height));
+	uint32_t pixel_steps = (queue.pixel_order == PIXEL_ORDER_SCANLINE) ? tile_width * tile_height : curve_size * curve_size;
+	v3f* colors = get_tile_buffer(tile_width * tile_height);
+	float* costs = tile_buffer.costs;
+	Heatmap_Mode heatmap_mode = queue.heatmap ? queue.heatmap->mode : HEATMAP_NONE;
+
+	// with many samples per pixel every sample only has to cover a part of the pixel
+	float differential_scale = MAX(.125f, 1.0f / (float)sqrt(float(samples_per_pixel)));
+	float film_dx = differential_scale / float(image.width);
+	float film_dy = differential_scale / float(image.height);
+
+	// With packets the pixels are collected until there are enough for a packet, then for every
+	// sample their camera rays find their first hits together and the rest of the paths are traced
+	// one at a time
+	uint32_t packet_xs[RAY_PACKET_SIZE];
+	uint32_t packet_ys[RAY_PACKET_SIZE];
+	int packet_pixels = 0;
+	path_buffer.pixels.clear();
+	auto render_packet = [&]()
+	{
+		v3f packet_colors[RAY_PACKET_SIZE] = {};
+		float packet_costs[RAY_PACKET_SIZE] = {};
+		for (int sample = 0; sample < samples_per_pixel; sample++)
+		{
+			Ray_Packet packet;
+			Ray_Differential differentials[RAY_PACKET_SIZE] = {};
+			for (int lane = 0; lane < packet_pixels; lane++)
+			{
+				float film_x = (float(x_min + int(packet_xs[lane])) + random_float()) / float(image.width);
+				float film_y = (float(y_min + int(packet_ys[lane])) + random_float()) / float(image.height);
+				packet.rays[lane] = camera.get_ray(film_x, film_y, film_dx, film_dy, differentials[lane]);
+			}
+			prepare_ray_packet(packet, packet_pixels);
+
+			Hit_Record recs[RAY_PACKET_SIZE] = {};
+			uint64_t cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+			int hits = closest_hit(world, packet, recs);
+			if (heatmap_mode)
+			{
+				// the packet's share of the lanes
+				float lane_cost = float(heatmap_counter(heatmap_mode) - cost_start) / float(packet_pixels);
+				for (int lane = 0; lane < packet_pixels; lane++)
+				{
+					packet_costs[lane] += lane_cost;
+				}
+			}
+			for (int lane = 0; lane < packet_pixels; lane++)
+			{
+				cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+				packet_colors[lane] += ray_cast(world, packet.rays[lane], differentials[lane], depth, &recs[lane], (hits & (1 << lane)) != 0);
+				if (heatmap_mode)
+				{
+					packet_costs[lane] += float(heatmap_counter(heatmap_mode) - cost_start);
+				}
+			}
+		}
+
+		for (int lane = 0; lane < packet_pixels; lane++)
+		{
+			colors[packet_xs[lane] + packet_ys[lane] * tile_width] = packet_colors[lane];
+			costs[packet_xs[lane] + packet_ys[lane] * tile_width] = packet_costs[lane];
+		}
+		packet_pixels = 0;
+	};
+
+	for (uint32_t step = 0; step < pixel_steps; step++)
+	{
+		uint32_t local_x = 0;
+		uint32_t local_y = 0;
+		switch (queue.pixel_order)
+		{
+			case PIXEL_ORDER_SCANLINE:
+			{
+				local_x = step % tile_width;
+				local_y = step / tile_width;
+			} break;
+
+			case PIXEL_ORDER_HILBERT:
+			{
+				hilbert_decode(curve_size, step, local_x, local_y);
+			} break;
+
+			case PIXEL_ORDER_MORTON:
+			{
+				morton_decode(step, local_x, local_y);
+			} break;
+
+			default:
+				break;
+		}
+
+		if (local_x >= tile_width || local_y >= tile_height)
+		{
+			continue;
+		}
+
+		if (queue.sort_secondary_rays)
+		{
+			path_buffer.pixels.push_back(int(local_x + local_y * tile_width));
+			continue;
+		}
+
+		if (queue.camera_ray_packets)
+		{
+			packet_xs[packet_pixels] = local_x;
+			packet_ys[packet_pixels] = local_y;
+			packet_pixels++;
+			if (packet_pixels == RAY_PACKET_SIZE)
+			{
+				render_packet();
+			}
+			continue;
+		}
+
+		int x = x_min + int(local_x);
+		int y = y_min + int(local_y);
+
+		v3f color = {};
+		uint64_t cost_start = heatmap_mode ? heatmap_counter(heatmap_mode) : 0;
+		for (int sample = 0; sample < samples_per_pixel; sample++)
+		{
+			float film_x = (float(x) + random_float()) / float(image.width);
+			float film_y = (float(y) + random_float()) / float(image.height);
+
+			Ray_Differential differential = {};
+			Ray r = camera.get_ray(film_x, film_y, film_dx, film_dy, differential);
+
+			color += ray_cast(world, r, differential, depth);
+		}
+
+		colors[local_x + local_y * tile_width] = color;
+		if (heatmap_mode)
+		{
+			costs[local_x + local_y * tile_width] = float(heatmap_counter(heatmap_mode) - cost_start);
+		}
+	}
+	if (packet_pixels > 0)
+	{
+		render_packet();
+	}
+	if (queue.sort_secondary_rays)
+	{
+		render_pixels_sorted(queue, world, camera, job, film_dx, film_dy, colors, costs);
+	}
+
+	if (job.colors)
+	{
+		for (uint32_t i = 0; i < tile_width * tile_height; i++)
+		{
+			v3f color = colors[i] / float(samples_per_pixel);
+			job.colors[3 * i + 0] = color.r;
+			job.colors[3 * i + 1] = color.g;
+			job.colors[3 * i + 2] = color.b;
+		}
+	}
+	else
+	{
+		for (uint32_t local_y = 0; local_y < tile_height; local_y++)
+		{
+			v3f* row = colors + local_y * tile_width;
+			uint32_t* buf = image.get_image_ptr(x_min, y_min + local_y);
+			for (uint32_t local_x = 0; local_x < tile_width; local_x++)
+			{
+				v3f color = row[local_x] / float(samples_per_pixel);
+				color = correct_gamma(color);
+				*buf = unpack_rgba(color);
+				buf++;
+			}
+		}
+	}
+	if (heatmap_mode)
+	{
+		Heatmap& heatmap = *queue.heatmap;
+		for (uint32_t local_y = 0; local_y < tile_height; local_y++)
+		{
+			memcpy(&heatmap.costs[x_min + (y_min + local_y) * heatmap.width], costs + local_y * tile_width, tile_width * sizeof(float));
+		}
+	}
+	queue.total_bounces += ray_counts.bounces - counts_before.bounces;
+	queue.total_rays += ray_counts.rays - counts_before.rays;
+
+	job.cost = get_time_ms() - start;
+	queue.finished_jobs++;
+}
+
+bool render_tile(Job_Queue& queue)
+{
+	int job_index = acquire_job(queue);
+	if (job_index < 0)
+	{
+		return false;
+	}
+
+	render_job(queue, queue.jobs[job_index]);
+	return true;
+}
+
+void do_work(Job_Queue& queue)
+{
+	while(render_tile(queue)) {}
+}
+
+// Renders every job of the queue on the pool workers. The calling thread only reports progress
+// while it waits, so it can be used for I/O in between passes and frames, or during the pass by
+// while_rendering, which it runs once the workers have started.
+void render_frame(Thread_Pool& pool, Job_Queue& queue, std::function<void()> while_rendering = nullptr)
+{
+	TRACE_SCOPE("render pass");
+	for (int range_index = 0; range_index < queue.range_count; range_index++)
+	{
+		Job_Range& range = queue.ranges[range_index];
+		range.next_job = range.first_job;
+	}
+	queue.finished_jobs = 0;
+
+	Task_Group group = {};
+	for (int worker = 0; worker < thread_count(pool); worker++)
+	{
+		submit_task(pool, group, [&queue] { do_work(queue); });
+	}
+	if (while_rendering)
+	{
+		while_rendering();
+	}
+
+	do
+	{
+		printf("\rRaycasting %.2f%%", 100.0f * (float(queue.finished_jobs.load()) / float(queue.jobs_count)));
+		fflush(stdout);
+	} while (!wait_for_tasks(pool, group, 100));
+	printf("\rRaycasting %.2f%%", 100.0f);
+}
+
+// Aim for enough tiles per core that the last tiles to finish are small compared to the whole
+// frame, but keep tiles big enough that per tile overhead stays negligible. Tile sizes are a
+// multiple of a cache line worth of pixels so tile boundaries don't split framebuffer lines.
+int choose_tile_size(int width, int height, int core_count)
+{
+	const int tiles_per_core = 16;
+	const int min_tile_size = CACHE_LINE_SIZE / sizeof(uint32_t);
+	const int max_tile_size = 128;
+
+	float tile_area = float(width) * float(height) / float(core_count * tiles_per_core);
+	int tile_size = int(sqrt(tile_area));
+	tile_size = (tile_size / min_tile_size) * min_tile_size;
+
+	return int(clamp(float(tile_size), float(min_tile_size), float(max_tile_size)));
+}
+
+// Traces a sparse grid of pixels in every tile with one sample and a shallow ray depth.
+// The time it takes is a cheap estimate of how expensive the tile will be to render.
+void estimate_tile_costs(Thread_Pool& pool, Job_Queue& queue)
+{
+	const int probes_per_axis = 4;
+	const int probe_depth = MIN(queue.ray_depth, 4);
+
+	TRACE_SCOPE("cost estimation pass");
+	parallel_for(pool, queue.jobs_count, [&queue, probes_per_axis, probe_depth](int job_index)
+	{
+		Job& job = queue.jobs[job_index];
+		TRACE_TILE_SCOPE("tile estimate", job.tile_x, job.tile_y);
+		Image& image = *job.image;
+		World& world = *job.world;
+		Camera& camera = *job.camera;
+
+		// other numbers than the ones the tile is rendered with
+		seed_random(~queue.seed, (uint64_t(job.tile_y) << 32) | uint64_t(job.tile_x));
+		double start = get_time_ms();
+		for (int probe_y = 0; probe_y < probes_per_axis; probe_y++)
+		{
+			for (int probe_x = 0; probe_x < probes_per_axis; probe_x++)
+			{
+				float x = float(job.x_min) + (float(probe_x) + random_float()) * float(job.x_max - job.x_min) / float(probes_per_axis);
+				float y = float(job.y_min) + (float(probe_y) + random_float()) * float(job.y_max - job.y_min) / float(probes_per_axis);
+
+				Ray r = camera.get_ray(x / float(image.width), y / float(image.height));
+				ray_cast(world, r, probe_depth);
+			}
+		}
+		job.cost = get_time_ms() - start;
+	});
+}
+
+// Longest processing time first: issuing the expensive tiles first leaves only cheap tiles
+// for the end of the frame, which shrinks the time threads spend waiting on the last tile.
+void sort_jobs_by_cost(Job_Queue& queue)
+{
+	for (int range_index = 0; range_index < queue.range_count; range_index++)
+	{
+		Job_Range& range = queue.ranges[range_index];
+		sort(queue.jobs + range.first_job, queue.jobs + range.end_job, [](const Job& a, const Job& b) { return a.cost > b.cost; });
+	}
+}
+
+// Dispatching tiles along a space filling curve keeps the tiles that are in flight at the same
+// time next to each other, so threads share the geometry and texture working set.
+void sort_jobs_by_curve(Job_Queue& queue, Tile_Order order, int tile_count_x, int tile_count_y)
+{
+	uint32_t curve_size = next_power_of_two(MAX(tile_count_x, tile_count_y));
+	auto curve_index = [order, curve_size](const Job& job)
+	{
+		if (order == TILE_ORDER_HILBERT)
+		{
+			return hilbert_encode(curve_size, job.tile_x, job.tile_y);
+		}
+		return morton_encode(job.tile_x, job.tile_y);
+	};
+
+	for (int range_index = 0; range_index < queue.range_count; range_index++)
+	{
+		Job_Range& range = queue.ranges[range_index];
+		sort(queue.jobs + range.first_job, queue.jobs + range.end_job, [&curve_index](const Job& a, const Job& b) { return curve_index(a) < curve_index(b); });
+	}
+}
+
+// Splits the image in horizontal bands, one per range, and groups the jobs of every band together.
+void partition_jobs(Job_Queue& queue, int range_count, int tile_count_y)
+{
+	auto band = [range_count, tile_count_y](const Job& job) { return job.tile_y * range_count / tile_count_y; };
+	stable_sort(queue.jobs, queue.jobs + queue.jobs_count, [&band](const Job& a, const Job& b) { return band(a) < band(b); });
+
+	queue.range_count = range_count;
+	int job_index = 0;
+	for (int range_index = 0; range_index < range_count; range_index++)
+	{
+		Job_Range& range = queue.ranges[range_index];
+		range.first_job = job_index;
+		while (job_index < queue.jobs_count && band(queue.jobs[job_index]) == range_index)
+		{
+			job_index++;
+		}
+		range.end_job = job_index;
+		range.next_job = range.first_job;
+	}
+	assert(job_index == queue.jobs_count);
+}
+
+// Writes the framebuffer rows of every range from a thread on the range's node, so first touch
+// places those pages on the node whose threads render them.
+void first_touch_framebuffer(Numa_Topology& topology, Job_Queue& queue)
+{
+	for (int range_index = 0; range_index < queue.range_count; range_index++)
+	{
+		Job_Range& range = queue.ranges[range_index];
+		run_on_node(topology, range_index, [&queue, &range]
+		{
+			for (int job_index = range.first_job; job_index < range.end_job; job_index++)
+			{
+				Job& job = queue.jobs[job_index];
+				for (int y = job.y_min; y < job.y_max; y++)
+				{
+					memset(job.image->get_image_ptr(job.x_min, y), 0, (job.x_max - job.x_min) * sizeof(uint32_t));
+				}
+			}
+		});
+	}
+}
+
+// Square tiles of tile_size pixels covering the image, smaller along the right and top edges, as
+// jobs of the queue in scanline order.
+void divide_into_tiles(Job_Queue& queue, Image& image, World* world, Camera* camera, int tile_size, int& tile_count_x, int& tile_count_y)
+{
+	tile_count_x = (image.width + tile_size - 1) / tile_size;
+	tile_count_y = (image.height + tile_size - 1) / tile_size;
+	queue.jobs = new Job[tile_count_x * tile_count_y];
+	queue.jobs_count = 0;
+
+	for (int tile_y = 0; tile_y < tile_count_y; tile_y++)
+	{
+		int y_min = tile_y*tile_size;
+		int y_max = y_min + tile_size;
+		if (y_max > image.height)
+		{
+			y_max = image.height;
 		}
 		for (int tile_x = 0; tile_x < tile_count_x; tile_x++)
 		{
-			int x_min = tile_x*tile_width;
-			int x_max = x_min + tile_width;
+			int x_min = tile_x*tile_size;
+			int x_max = x_min + tile_size;
 			if (x_max > image.width)
 			{
 				x_max = image.width;
 			}
-			
-			Job& job = *(queue.jobs + queue.jobs_count++);
-			assert(queue.jobs_count <= total_tiles);
 
+			Job& job = queue.jobs[queue.jobs_count++];
+			job = {};
 			job.image = &image;
-			job.world = &world;
-			job.camera = &camera;
+			job.world = world;
+			job.camera = camera;
 			job.x_min = x_min;
 			job.x_max = x_max;
 			job.y_min = y_min;
 			job.y_max = y_max;
+			job.tile_x = tile_x;
+			job.tile_y = tile_y;
 		}
 	}
-	assert(queue.jobs_count == total_tiles);
+}
 
-	printf("Using %d cores, total tiles: %d, %dx%d (%dk/tile)\n", core_count, total_tiles, tile_count_x, tile_count_y, tile_width*tile_height * 4 / 1024);
-	printf("Image quality: %dx%d pixels, %d samples per pixel, %d ray depth\n", image.width, image.height, queue.samples_per_pixel, queue.ray_depth);
+bool aabb(Ray& r, v3f p0, v3f p1)
+{
+	float t0x = MIN((p0.x - r.origin.x) / r.direction.x, (p1.x - r.origin.x) / r.direction.x);
+	float t1x = MAX((p0.x - r.origin.x) / r.direction.x, (p1.x - r.origin.x) / r.direction.x);
 
-	vector<thread> threads;
-	for (int core_index = 1; core_index < core_count; core_index++)
-	{
-		threads.push_back(thread{do_work, ref(queue)});
-	}
+	float t0y = MIN((p0.y - r.origin.y) / r.direction.y, (p1.y - r.origin.y) / r.direction.y);
+	float t1y = MAX((p0.y - r.origin.y) / r.direction.y, (p1.y - r.origin.y) / r.direction.y);
 
-	// raycasting
-	clock_t start = clock();
-	while (queue.finished_jobs.load() < queue.jobs_count)
-	{
-		render_tile(queue);
-	}
-	clock_t end = clock();
+	float t_min = MAX(t0x, t0y);
+	float t_max = MIN(t1x, t1y);
+
+	if (t_min >= t_max) { return false; }
+
+	float t0z = MIN((p0.z - r.origin.z) / r.direction.z, (p1.z - r.origin.z) / r.direction.z);
+	float t1z = MIN((p0.z - r.origin.z) / r.direction.z, (p1.z - r.origin.z) / r.direction.z);
+
+	t_min = MIN(t0z, t_min);
+	t_max = MAX(t1z, t_max);
+
+	if (t_min >= t_max) { return false; }
+
+	return true;
+}
+
+enum World_Types
+{
+	DEFAULT_WORLD,
+	LIGHTED_WORLD,
+	MONKEY_WORLD,
+	OUTDOOR_WORLD,
+
+	WORLD_TYPE_COUNT,
+};
+
+static const char* world_type_names[WORLD_TYPE_COUNT] =
+{
+	"default",
+	"lighted",
+	"monkey",
+	"outdoor",
+};
+
+// Textures and meshes load on the pool while the rest of the scene is set up, pass no pool to load
+// them on the calling thread.
+World generate_world(Thread_Pool* pool, Texture_Cache& texture_cache, World_Types type = DEFAULT_WORLD)
+{
+	World world = {};
+	Asset_Loader loader = {};
+	start_loading(loader, pool, texture_cache);
 
-	for (thread& t : threads)
+	switch (type)
 	{
-		t.join();
-	}
-	
-	printf("\nRaycasting Done!\n");
+		case DEFAULT_WORLD:
+		{
+			auto earth_texture = load_texture(loader, "../resources/earthmap.jpg", "../resources/earthmap.rtex");
+			auto earth_surface = make_shared<Lambertian>(earth_texture);
+			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
+			auto material_ground = make_shared<Lambertian>(checker_texture);
+			auto material_big_metal = make_shared<Metal>(V3f(0.2f, 0.25f, 0.7f), .0f);
+			auto material_big_dielectric = make_shared<Dielectric>(1.7f);
+			auto material_from_behind = make_shared<Lambertian>(V3f(1.0f, .0f, .0f));
+
+			auto big_sphere_dielectric = make_shared<Sphere>(V3f(2.5f, 2.0f, -3.0f), 2.0f, material_big_dielectric);
+			auto behind1 = make_shared<Sphere>(V3f(3.0f, .5f, -12.0f), .5f, material_from_behind);
+			auto behind2 = make_shared<Sphere>(V3f(7.0f, .5f, -20.0f), .5f, material_from_behind);
+			auto behind3 = make_shared<Sphere>(V3f(9.0f, .5f, -13.0f), .5f, material_from_behind);
+			auto big_sphere_metal = make_shared<Sphere>(V3f(-3.5f, 2.0f, -3.0f), 2.0f, material_big_metal);
+			auto center = make_shared<Sphere>(V3f(.0f, .5f, -1.0f), .5f, earth_surface);
+			auto left = make_shared<Sphere>(V3f(-2.0f, .5f, .0f), .5f, make_shared<Metal>(V3f(.8f, .6f, .2f), .7f));
+			auto right = make_shared<Sphere>(V3f(2.0f, .5f, 0.7f), .5f, make_shared<Metal>(V3f(.8f, .6f, .2f), .3f));
+			auto ground = make_shared<Sphere>(V3f(.0f, -1000.0f, .0f), 1000.0f, material_ground);
+
+			world.add_object(center);
+			world.add_object(left);
+			world.add_object(right);
+			world.add_object(ground);
+			world.add_object(big_sphere_dielectric);
+			world.add_object(behind1);
+			world.add_object(behind2);
+			world.add_object(behind3);
+			world.add_object(big_sphere_metal);
+
+			world.background = v3f{.7f, .8f, 1.0f};
 
-	printf("Writing to file!\n");
-	write_ppm("image.ppm", image);
-	printf("Done\n");
+		} break;
 
-	uint64_t time_elapsed = end - start;
-	printf("Total time: %lld ms\n", time_elapsed);
-	printf("Total bounces: %lld\n", queue.total_bounces.load());
-	printf("Time per bounce: %f ms\n", float(time_elapsed) / float(queue.total_bounces.load()));
+		case LIGHTED_WORLD:
+		{
+			auto light = make_shared<Diffuse_Light>(v3f{ 1.0f, 1.0f, 1.0f });
+			auto material_center = make_shared<Lambertian>(V3f(.7f, .3f, .3f));
+			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
+			auto material_ground = make_shared<Lambertian>(checker_texture);
 
-	// NOTE: Don't close file handle because the OS will do that for us when the program exits.
+			auto sphere_light = make_shared<Sphere>(v3f{ .0f, 3.0f, .0f }, 1.5f, light);
+			auto ground = make_shared<Sphere>(v3f{ .0f, -1000.0f, .0f }, 1000.0f, material_ground);
+			auto center_sphere = make_shared<Sphere>(v3f{.0f, .5f, .0f}, .5f, material_center);
 
-	return 0;
-}
\ No newline at end of file
+			world.add_object(sphere_light);
+			world.add_object(ground);
+			world.add_object(center_sphere);
+			
+			world.background = v3f{ .0f, .0f, .0f };
+
+		} break;
+
+		case MONKEY_WORLD:
+		{
+			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
+			auto material_ground = make_shared<Lambertian>(checker_texture);
+			auto ground = make_shared<Sphere>(v3f{ .0f, -1000.0f, .0f }, 1000.0f, material_ground);
+
+			world.add_object(ground);
+
+			auto redish = make_shared<Lambertian>(V3f(.7f, .3f, .3f));
+			v3f monkey_offset = { .0f, 1.0f, .0f };
+			load_mesh(loader, "../resources/suzanne.obj", monkey_offset, redish);
+
+			world.background = v3f{ .7f, .8f, 1.0f };
+		} break;
+
+		case OUTDOOR_WORLD:
+		{
+			// lit only by the sky, unzip resources/skybox.zip next to it first
+			auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
+			auto material_ground = make_shared<Lambertian>(checker_texture);
+			auto material_white = make_shared<Lambertian>(V3f(.8f, .8f, .8f));
+			auto material_glossy = make_shared<Metal>(V3f(.8f, .6f, .2f), .3f);
+			auto material_glass = make_shared<Dielectric>(1.5f);
+
+			world.add_object(make_shared<Sphere>(V3f(.0f, -1000.0f, .0f), 1000.0f, material_ground));
+			world.add_object(make_shared<Sphere>(V3f(.0f, .5f, -1.0f), .5f, material_white));
+			world.add_object(make_shared<Sphere>(V3f(-2.0f, .5f, .0f), .5f, material_glossy));
+			world.add_object(make_shared<Sphere>(V3f(2.0f, .5f, .7f), .5f, material_glass));
+
+			world.background = v3f{ .7f, .8f, 1.0f };
+			world.environment = load_cube_environment(loader, "../resources/skybox", ".jpg", 2048);
+		} break;
+
+		default:
+			printf("Couldn't generate such type of world!\n");
+			break;
+	}
+
+	finish_loading(loader, world);
+	return world;
+}
+
+// The structures rays are traced through and lights are picked with, once all objects are in.
+void build_acceleration(World& world, Light_Selection light_selection)
+{
+	{
+		TRACE_SCOPE("light sampler build");
+		world.lights = build_light_sampler(world, light_selection);
+	}
+	TRACE_SCOPE("bvh build");
+	world.bvh = build_bvh(world);
+}
+
+// Copies a world with its acceleration structures built, for a replica on another NUMA node. The
+// objects, meshes, bvhs and light sampler of the copy are allocated by the calling thread, the
+// materials, textures and environment map are shared with world.
+void copy_world(World& world, World& copy)
+{
+	World_Copy world_copy;
+	copy.background = world.background;
+	copy.environment = world.environment;
+	copy.objects.reserve(world.objects.size());
+	for (shared_ptr<Hittable>& object : world.objects)
+	{
+		copy.objects.push_back(object->copy(world_copy));
+		world_copy.objects[object.get()] = copy.objects.back().get();
+	}
+	if (world.bvh)
+	{
+		copy.bvh = copy_bvh(*world.bvh, world_copy);
+	}
+	if (world.lights)
+	{
+		copy.lights = make_shared<Light_Sampler>(*world.lights);
+		for (Hittable*& light : copy.lights->lights)
+		{
+			light = world_copy.objects[light];
+		}
+	}
+}
+
+// What render_scene renders and how.
+struct Render_Settings
+{
+	World_Types world_type;
+	// generated instead of world_type when it has a type
+	Stress_Scene stress;
+	// read instead of both when set, see scene_file.h
+	const char* scene_file;
+	// as given to --scene, null for the default, for workers that load the scene themselves
+	const char* scene;
+	// camera and render statement settings replacing those of the scene, "look_from 0 2 6 fov 40"
+	const char* camera;
+	// 0 leaves them to the scene, see resolve_render_settings
+	int width;
+	int height;
+	int samples_per_pixel;
+	int ray_depth;
+	uint64_t seed;
+	// 0 picks one from the image size and the thread count
+	int tile_size;
+	Tile_Order tile_order;
+	Pixel_Order pixel_order;
+	bool camera_ray_packets;
+	bool sort_secondary_rays;
+	Light_Selection light_selection;
+	// tiled textures are paged in on demand and share this budget
+	int texture_cache_mb;
+	// the finished image is written here, nothing is written when null
+	const char* output;
+	// written next to output, as image_heatmap.ppm for image.ppm
+	Heatmap_Mode heatmap;
+};
+
+// How long the parts of a frame took and how much work it was.
+struct Render_Stats
+{
+	int width;
+	int height;
+	double load_ms;
+	double build_ms;
+	double estimate_ms;
+	double render_ms;
+	double write_ms;
+	uint64_t samples;
+	uint64_t bounces;
+	uint64_t rays;
+	uint64_t image_hash;
+	// in the world, an instance counts as one
+	uint64_t objects;
+	// read cache events of the render, 0 when the counter isn't available
+	uint64_t l2_requests;
+	uint64_t llc_references;
+	uint64_t llc_misses;
+};
+
+Render_Settings default_render_settings()
+{
+	Render_Settings settings = {};
+	settings.world_type = DEFAULT_WORLD;
+	settings.seed = 1;
+	settings.tile_order = TILE_ORDER_COST;
+	settings.pixel_order = PIXEL_ORDER_HILBERT;
+	settings.camera_ray_packets = true;
+	settings.sort_secondary_rays = false;
+	settings.light_selection = LIGHT_SELECTION_BVH;
+	settings.texture_cache_mb = 256;
+	settings.output = "image.ppm";
+	return settings;
+}
+
+// The scene file, the stress scene or the hand built scene of settings.world_type. options gets
+// the camera and settings of the scene, only scene files have their own.
+bool load_world(Thread_Pool* pool, Texture_Cache& texture_cache, Render_Settings& settings, World& world, Scene_Options& options)
+{
+	TRACE_SCOPE("scene load");
+	seed_random(settings.seed, 0);
+	options = default_scene_options();
+	if (settings.scene_file)
+	{
+		return load_scene_file(settings.scene_file, pool, texture_cache, world, options);
+	}
+	if (settings.stress.type != STRESS_NONE)
+	{
+		world = generate_stress_world(settings.stress);
+		return true;
+	}
+	world = generate_world(pool, texture_cache, settings.world_type);
+	return true;
+}
+
+Camera make_camera(Scene_Options& view, int width, int height)
+{
+	const float aspect_ratio = float(width) / float(height);
+	return Camera{ scene_v3f(view.look_from), scene_v3f(view.look_at), scene_v3f(view.up), aspect_ratio,
+		view.y_fov_degrees, view.aperture, view.focus_distance };
+}
+
+// Fills in what settings leave to the scene with what the scene asks for, or the defaults. A
+// width without a height keeps the aspect ratio of the scene, 16:9 when it has none.
+void resolve_render_settings(Render_Settings& settings, Scene_Options& options)
+{
+	bool scene_size = options.width > 0 && options.height > 0;
+	if (settings.width <= 0 && settings.height <= 0 && scene_size)
+	{
+		settings.width = options.width;
+		settings.height = options.height;
+	}
+	if (settings.width <= 0)
+	{
+		settings.width = options.width > 0 ? options.width : 1024;
+	}
+	if (settings.height <= 0)
+	{
+		settings.height = scene_size ? int(int64_t(settings.width) * options.height / options.width) : int(float(settings.width) / (16.0f / 9.0f));
+	}
+	if (settings.samples_per_pixel <= 0)
+	{
+		settings.samples_per_pixel = options.samples_per_pixel > 0 ? options.samples_per_pixel : 32;
+	}
+	if (settings.ray_depth <= 0)
+	{
+		settings.ray_depth = options.ray_depth > 0 ? options.ray_depth : 8;
+	}
+}
+
+// The name of the scene in reports, "default", "spheres_1000" or the scene file without its
+// directory and extension.
+string scene_name(Render_Settings& settings)
+{
+	if (settings.scene_file)
+	{
+		string name = settings.scene_file;
+		size_t slash = name.find_last_of("/\\");
+		if (slash != string::npos)
+		{
+			name.erase(0, slash + 1);
+		}
+		size_t dot = name.rfind('.');
+		if (dot != string::npos && dot > 0)
+		{
+			name.resize(dot);
+		}
+		return name;
+	}
+	if (settings.stress.type != STRESS_NONE)
+	{
+		return stress_scene_name(settings.stress);
+	}
+	return world_type_names[settings.world_type];
+}
+
+// A scene loaded once with its acceleration structures built, shared by every frame rendered of it.
+struct Loaded_Scene
+{
+	World world;
+	// replicas on the other nodes with NUMA placement, node 0 renders world
+	World node_worlds[MAX_NUMA_NODES];
+	int numa_nodes;
+	// the camera and settings of the scene
+	Scene_Options options;
+	double load_ms;
+	double build_ms;
+};
+
+// False when the scene couldn't be loaded.
+bool load_scene(Thread_Pool& pool, Numa_Topology& topology, bool numa_aware, Texture_Cache& texture_cache, Render_Settings& settings, Loaded_Scene& scene)
+{
+	scene.numa_nodes = numa_aware ? node_count(topology) : 1;
+
+	double load_start = get_time_ms();
+	if (!load_world(&pool, texture_cache, settings, scene.world, scene.options))
+	{
+		return false;
+	}
+	scene.load_ms = get_time_ms() - load_start;
+
+	double build_start = get_time_ms();
+	build_acceleration(scene.world, settings.light_selection);
+	scene.build_ms = get_time_ms() - build_start;
+	printf("Scene loaded in %.1f ms, acceleration structures built in %.1f ms\n", scene.load_ms, scene.build_ms);
+
+	if (scene.numa_nodes > 1)
+	{
+		double copy_start = get_time_ms();
+		for (int node = 1; node < scene.numa_nodes; node++)
+		{
+			run_on_node(topology, node, [&scene, node] { copy_world(scene.world, scene.node_worlds[node]); });
+		}
+		printf("Scene copied to %d more NUMA nodes in %.1f ms\n", scene.numa_nodes - 1, get_time_ms() - copy_start);
+	}
+	return true;
+}
+
+// The camera and settings of one frame: the scene's, then those of settings.camera, then those of
+// the view, and what is still left open from resolve_render_settings. The sizes a view sets win
+// over those of the command line.
+Render_Settings resolve_view(Loaded_Scene& scene, Render_Settings& requested, const char* view_settings, Scene_Options& view)
+{
+	view = scene.options;
+	if (requested.camera)
+	{
+		parse_scene_options("--camera", requested.camera, view);
+	}
+	Render_Settings settings = requested;
+	if (view_settings)
+	{
+		Scene_Options given = view;
+		given.width = given.height = given.samples_per_pixel = given.ray_depth = 0;
+		parse_scene_options("view", view_settings, given);
+		if (given.width > 0 || given.height > 0)
+		{
+			settings.width = given.width;
+			settings.height = given.height;
+		}
+		if (given.samples_per_pixel > 0)
+		{
+			settings.samples_per_pixel = given.samples_per_pixel;
+		}
+		if (given.ray_depth > 0)
+		{
+			settings.ray_depth = given.ray_depth;
+		}
+		// the scene's sizes are left for what the view doesn't set
+		given.width = view.width;
+		given.height = view.height;
+		given.samples_per_pixel = view.samples_per_pixel;
+		given.ray_depth = view.ray_depth;
+		view = given;
+	}
+	resolve_render_settings(settings, view);
+	return settings;
+}
+
+// The pixels of a rendered frame and what they cost, kept until the frame is written.
+struct Frame
+{
+	Image image;
+	Heatmap heatmap;
+	string output;
+	double write_ms;
+};
+
+// image.ppm with suffix "_heatmap" is image_heatmap.ppm.
+string add_file_name_suffix(const string& file_name, const char* suffix)
+{
+	string result = file_name;
+	size_t extension = result.rfind(".ppm");
+	if (extension != string::npos && extension + 4 == result.size())
+	{
+		result.resize(extension);
+	}
+	return result + suffix + ".ppm";
+}
+
+// Writes the image to frame.output, and the heatmap next to it when there is one. False when
+// either couldn't be written.
+bool write_frame(Frame& frame)
+{
+	TRACE_SCOPE("image write");
+	double write_start = get_time_ms();
+	bool written = write_ppm(frame.output.c_str(), frame.image);
+	if (frame.heatmap.mode != HEATMAP_NONE)
+	{
+		written = write_heatmap(add_file_name_suffix(frame.output, "_heatmap").c_str(), frame.heatmap) && written;
+	}
+	frame.write_ms = get_time_ms() - write_start;
+	return written;
+}
+
+// Renders one frame of a loaded scene into frame, settings already resolved by resolve_view.
+// while_rendering runs on the calling thread during the render pass, see render_frame.
+void render_view(Thread_Pool& pool, int core_count, Numa_Topology& topology, bool numa_aware, Perf_Counters& perf_counters, Loaded_Scene& scene,
+	Scene_Options& view, Render_Settings& settings, Frame& frame, Render_Stats& stats, std::function<void()> while_rendering = nullptr)
+{
+	// Image
+	Image& image = frame.image;
+	if (image.width != settings.width || image.height != settings.height)
+	{
+		free_aligned(image.pixels);
+		image.width = settings.width;
+		image.height = settings.height;
+		image.pixels = (uint32_t*)allocate_aligned(image.width * image.height * sizeof(uint32_t), CACHE_LINE_SIZE);
+	}
+	stats.width = image.width;
+	stats.height = image.height;
+	stats.load_ms = scene.load_ms;
+	stats.build_ms = scene.build_ms;
+	stats.objects = scene.world.objects.size();
+
+	Camera camera = make_camera(view, image.width, image.height);
+
+	// tile division
+	Tile_Order tile_order = settings.tile_order;
+	int tile_width = settings.tile_size > 0 ? settings.tile_size : choose_tile_size(image.width, image.height, core_count);
+	int tile_height = tile_width;
+
+	Job_Queue queue = {};
+	queue.ray_depth = settings.ray_depth;
+	queue.samples_per_pixel = settings.samples_per_pixel;
+	queue.seed = settings.seed;
+	queue.pixel_order = settings.pixel_order;
+	queue.camera_ray_packets = settings.camera_ray_packets;
+	queue.sort_secondary_rays = settings.sort_secondary_rays;
+	int tile_count_x;
+	int tile_count_y;
+	divide_into_tiles(queue, image, &scene.world, &camera, tile_width, tile_count_x, tile_count_y);
+	const int total_tiles = queue.jobs_count;
+
+	Heatmap& heatmap = frame.heatmap;
+	heatmap.mode = settings.heatmap;
+	if (settings.heatmap != HEATMAP_NONE)
+	{
+		heatmap.width = image.width;
+		heatmap.height = image.height;
+		heatmap.costs.assign(size_t(image.width) * size_t(image.height), .0f);
+		queue.heatmap = &heatmap;
+	}
+	if (scene.numa_nodes > 1)
+	{
+		for (int node = 0; node < scene.numa_nodes; node++)
+		{
+			queue.node_worlds[node] = node == 0 ? &scene.world : &scene.node_worlds[node];
+		}
+	}
+
+	partition_jobs(queue, MIN(scene.numa_nodes, tile_count_y), tile_count_y);
+	if (scene.numa_nodes > 1)
+	{
+		first_touch_framebuffer(topology, queue);
+	}
+
+	if (tile_order == TILE_ORDER_COST)
+	{
+		double estimate_start = get_time_ms();
+		estimate_tile_costs(pool, queue);
+		sort_jobs_by_cost(queue);
+		stats.estimate_ms = get_time_ms() - estimate_start;
+		printf("Tile cost estimation: %.2f ms\n", stats.estimate_ms);
+	}
+	else if (tile_order == TILE_ORDER_HILBERT || tile_order == TILE_ORDER_MORTON)
+	{
+		sort_jobs_by_curve(queue, tile_order, tile_count_x, tile_count_y);
+	}
+
+	printf("NUMA nodes: %d%s\n", node_count(topology), numa_aware ? ", threads pinned" : "");
+	printf("Using %d cores, total tiles: %d, %dx%d (%dk/tile)\n", core_count, total_tiles, tile_count_x, tile_count_y, tile_width*tile_height * 4 / 1024);
+	printf("Image quality: %dx%d pixels, %d samples per pixel, %d ray depth\n", image.width, image.height, queue.samples_per_pixel, queue.ray_depth);
+
+	// raycasting
+#if USE_RENDER_COUNTERS
+	// without the rays of the cost estimation
+	reset_render_counters();
+#endif
+	start_perf_counters(perf_counters);
+	double start = get_time_ms();
+	render_frame(pool, queue, while_rendering);
+	double end = get_time_ms();
+	stop_perf_counters(perf_counters);
+	
+	printf("\nRaycasting Done!\n");
+
+	stats.render_ms = end - start;
+	stats.samples = uint64_t(image.width) * uint64_t(image.height) * uint64_t(queue.samples_per_pixel);
+	stats.bounces = queue.total_bounces.load();
+	stats.rays = queue.total_rays.load();
+	stats.image_hash = hash_image(image);
+	stats.l2_requests = perf_counters.available[PERF_COUNTER_L1D_MISSES] ? perf_counters.values[PERF_COUNTER_L1D_MISSES] : 0;
+	stats.llc_references = perf_counters.available[PERF_COUNTER_LLC_REFERENCES] ? perf_counters.values[PERF_COUNTER_LLC_REFERENCES] : 0;
+	stats.llc_misses = perf_counters.available[PERF_COUNTER_LLC_MISSES] ? perf_counters.values[PERF_COUNTER_LLC_MISSES] : 0;
+
+	printf("Total time: %.0f ms\n", stats.render_ms);
+	printf("Total bounces: %llu, rays: %llu (%.2f Mrays/s)\n", (unsigned long long)stats.bounces, (unsigned long long)stats.rays, double(stats.rays) / (stats.render_ms * 1000.0));
+	printf("Time per bounce: %f ms\n", float(stats.render_ms) / float(stats.bounces));
+	print_perf_counters(perf_counters, stats.bounces);
+#if USE_RENDER_COUNTERS
+	Render_Counter_Values counters = sum_render_counters();
+	print_render_counters(counters);
+#endif
+
+	delete[] queue.jobs;
+}
+
+// Loads the scene, renders one frame of it on the pool and writes it out. False when the scene
+// couldn't be loaded or the image couldn't be written.
+bool render_scene(Thread_Pool& pool, int core_count, Numa_Topology& topology, bool numa_aware, Perf_Counters& perf_counters, Render_Settings& requested, Render_Stats& stats)
+{
+	stats = {};
+	Texture_Cache texture_cache(size_t(requested.texture_cache_mb) * 1024 * 1024);
+	Loaded_Scene scene = {};
+	if (!load_scene(pool, topology, numa_aware, texture_cache, requested, scene))
+	{
+		return false;
+	}
+
+	Scene_Options view;
+	Render_Settings settings = resolve_view(scene, requested, nullptr, view);
+	Frame frame = {};
+	render_view(pool, core_count, topology, numa_aware, perf_counters, scene, view, settings, frame, stats);
+
+	bool written = true;
+	if (settings.output)
+	{
+		printf("Writing to file!\n");
+		frame.output = settings.output;
+		written = write_frame(frame);
+		stats.write_ms = frame.write_ms;
+		if (written)
+		{
+			printf("Done\n");
+		}
+	}
+	print_texture_cache_stats(texture_cache);
+
+	free_aligned(frame.image.pixels);
+	return written;
+}
+
+// Many frames of one scene: loaded and built once, then a frame per view.
+struct Batch_Settings
+{
+	// lines of an output file and its camera settings, see read_scene_views
+	const char* views_file;
+	// or this many frames around the scene, written to image_0000.ppm and on for image.ppm
+	int turntable_frames;
+};
+
+// Moves the camera around the vertical axis through look_at, turn is a fraction of a circle.
+void orbit_camera(Scene_Options& view, float turn)
+{
+	float s, c;
+	fast_sincos(2.0f * PI * turn, s, c);
+	float x = view.look_from[0] - view.look_at[0];
+	float z = view.look_from[2] - view.look_at[2];
+	view.look_from[0] = view.look_at[0] + c * x + s * z;
+	view.look_from[2] = view.look_at[2] - s * x + c * z;
+}
+
+// Loads the scene once and renders every view of the batch. Frames are double buffered: while the
+// pool renders frame n the calling thread writes frame n - 1 out, so only the last write adds to
+// the time of the batch. False when the views or the scene couldn't be loaded or a frame couldn't
+// be written.
+bool render_batch(Batch_Settings& batch, Thread_Pool& pool, int core_count, Numa_Topology& topology, bool numa_aware, Perf_Counters& perf_counters,
+	Render_Settings& requested)
+{
+	vector<Scene_View> views;
+	if (batch.views_file)
+	{
+		if (!read_scene_views(batch.views_file, views))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < batch.turntable_frames; i++)
+		{
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), "_%04d", i);
+			Scene_View view;
+			view.output = add_file_name_suffix(requested.output ? requested.output : "image.ppm", suffix);
+			views.push_back(view);
+		}
+	}
+	if (views.empty())
+	{
+		fprintf(stderr, "ERROR: No views to render.\n");
+		return false;
+	}
+
+	Texture_Cache texture_cache(size_t(requested.texture_cache_mb) * 1024 * 1024);
+	Loaded_Scene scene = {};
+	if (!load_scene(pool, topology, numa_aware, texture_cache, requested, scene))
+	{
+		return false;
+	}
+
+	int frame_count = int(views.size());
+	vector<Render_Stats> stats(frame_count);
+	Frame frames[2] = {};
+	bool written = true;
+	double start = get_time_ms();
+	for (int i = 0; i < frame_count; i++)
+	{
+		Scene_Options view;
+		Render_Settings settings = resolve_view(scene, requested, views[i].settings.c_str(), view);
+		if (!batch.views_file)
+		{
+			orbit_camera(view, float(i) / float(frame_count));
+		}
+
+		printf("\nFrame %d of %d, %s\n", i + 1, frame_count, views[i].output.c_str());
+		Frame& frame = frames[i & 1];
+		frame.output = views[i].output;
+		std::function<void()> write_previous;
+		if (i > 0)
+		{
+			Frame* previous = &frames[(i - 1) & 1];
+			write_previous = [previous, &written] { written = write_frame(*previous) && written; };
+		}
+		stats[i] = {};
+		render_view(pool, core_count, topology, numa_aware, perf_counters, scene, view, settings, frame, stats[i], write_previous);
+		if (i > 0)
+		{
+			stats[i - 1].write_ms = frames[(i - 1) & 1].write_ms;
+		}
+	}
+	Frame& last = frames[(frame_count - 1) & 1];
+	written = write_frame(last) && written;
+	stats[frame_count - 1].write_ms = last.write_ms;
+	double total_ms = get_time_ms() - start;
+
+	printf("\n%-5s %-24s %10s %10s %10s %10s\n", "frame", "output", "estimate", "render", "write", "Mrays/s");
+	for (int i = 0; i < frame_count; i++)
+	{
+		printf("%-5d %-24s %7.1f ms %7.1f ms %7.1f ms %10.2f\n", i, views[i].output.c_str(), stats[i].estimate_ms, stats[i].render_ms,
+			stats[i].write_ms, double(stats[i].rays) / (stats[i].render_ms * 1000.0));
+	}
+	printf("Scene loaded once in %.1f ms, acceleration structures built once in %.1f ms\n", scene.load_ms, scene.build_ms);
+	printf("%d frames in %.1f ms, %.1f ms per frame without the load and build\n", frame_count, total_ms, total_ms / double(frame_count));
+	print_texture_cache_stats(texture_cache);
+
+	free_aligned(frames[0].image.pixels);
+	free_aligned(frames[1].image.pixels);
+	return written;
+}
+
+// Sets the scene of settings from its name, one of world_type_names, a stress scene like
+// "spheres:100000" or a scene file ending in .scene or .rscn.
+bool parse_scene(const char* name, Render_Settings& settings)
+{
+	settings.scene = name;
+	settings.scene_file = nullptr;
+	for (int type = 0; type < WORLD_TYPE_COUNT; type++)
+	{
+		if (strcmp(name, world_type_names[type]) == 0)
+		{
+			settings.world_type = World_Types(type);
+			settings.stress.type = STRESS_NONE;
+			return true;
+		}
+	}
+
+	size_t length = strlen(name);
+	if ((length > 6 && strcmp(name + length - 6, ".scene") == 0) || (length > 5 && strcmp(name + length - 5, ".rscn") == 0))
+	{
+		settings.scene_file = name;
+		return true;
+	}
+	return parse_stress_scene(name, settings.stress);
+}
+
+// Options of ray_tracer coordinator and ray_tracer worker.
+struct Network_Settings
+{
+	// coordinator
+	int port;
+	// workers to wait for before the frame starts, more can join while it renders
+	int workers;
+	// a worker with tiles out that hasn't sent anything for this many seconds is taken for lost
+	int worker_timeout;
+	// worker, "host:port" of the coordinator
+	const char* coordinator;
+};
+
+// Renders tiles for a coordinator until it says the frame is done. Every tile is a pool task that
+// sends its pixels back itself, the coordinator keeps enough tiles out to keep the threads busy.
+// False when the coordinator couldn't be reached, the scene couldn't be loaded or the connection
+// broke before the end of the frame.
+bool run_worker(Network_Settings& network, Thread_Pool& pool, Numa_Topology& topology, bool numa_aware)
+{
+	Net_Socket socket = connect_net(network.coordinator, 30);
+	if (socket == INVALID_NET_SOCKET)
+	{
+		return false;
+	}
+	printf("Connected to %s\n", network.coordinator);
+
+	Net_Hello hello = { NET_MAGIC, NET_VERSION, thread_count(pool) };
+	Net_Message_Header header;
+	vector<char> payload;
+	Net_Setup setup;
+	if (!send_net_message(socket, NET_HELLO, &hello, sizeof(hello)) || !receive_net_message(socket, header, payload) || header.type != NET_SETUP ||
+		!read_net_struct(payload, setup) || payload.size() != sizeof(setup) + size_t(setup.scene_length) + setup.mesh_length + setup.camera_length)
+	{
+		fprintf(stderr, "ERROR: Got no render settings from the coordinator.\n");
+		close_net_socket(socket);
+		return false;
+	}
+	const char* strings = payload.data() + sizeof(setup);
+	string scene_text(strings, setup.scene_length);
+	string mesh_file(strings + setup.scene_length, setup.mesh_length);
+	string camera_text(strings + setup.scene_length + setup.mesh_length, setup.camera_length);
+
+	Render_Settings requested = default_render_settings();
+	requested.width = setup.width;
+	requested.height = setup.height;
+	requested.samples_per_pixel = setup.samples_per_pixel;
+	requested.ray_depth = setup.ray_depth;
+	requested.seed = setup.seed;
+	requested.pixel_order = Pixel_Order(setup.pixel_order);
+	requested.camera_ray_packets = setup.camera_ray_packets != 0;
+	requested.sort_secondary_rays = setup.sort_secondary_rays != 0;
+	requested.light_selection = Light_Selection(setup.light_selection);
+	requested.texture_cache_mb = setup.texture_cache_mb;
+	bool valid = uint32_t(setup.pixel_order) < PIXEL_ORDER_COUNT && uint32_t(setup.light_selection) < LIGHT_SELECTION_COUNT && setup.texture_cache_mb > 0 &&
+		(scene_text.empty() || parse_scene(scene_text.c_str(), requested));
+	if (!mesh_file.empty())
+	{
+		requested.stress.mesh_file = mesh_file.c_str();
+	}
+	if (!camera_text.empty())
+	{
+		requested.camera = camera_text.c_str();
+	}
+
+	Texture_Cache texture_cache(size_t(requested.texture_cache_mb) * 1024 * 1024);
+	Loaded_Scene scene = {};
+	if (!valid || !load_scene(pool, topology, numa_aware, texture_cache, requested, scene))
+	{
+		send_net_message(socket, NET_FAILED, nullptr, 0);
+		close_net_socket(socket);
+		return false;
+	}
+	Scene_Options view;
+	Render_Settings settings = resolve_view(scene, requested, nullptr, view);
+	Net_Ready ready = { settings.width, settings.height, settings.samples_per_pixel, settings.ray_depth };
+	if (!send_net_message(socket, NET_READY, &ready, sizeof(ready)))
+	{
+		fprintf(stderr, "ERROR: Lost the connection to the coordinator.\n");
+		close_net_socket(socket);
+		return false;
+	}
+	printf("Rendering %dx%d pixels, %d samples per pixel, %d ray depth on %d threads\n", settings.width, settings.height,
+		settings.samples_per_pixel, settings.ray_depth, thread_count(pool));
+
+	// only for its size, the tiles go back as colors
+	Image image = {};
+	image.width = settings.width;
+	image.height = settings.height;
+	Camera camera = make_camera(view, image.width, image.height);
+
+	Job_Queue queue = {};
+	queue.ray_depth = settings.ray_depth;
+	queue.samples_per_pixel = settings.samples_per_pixel;
+	queue.seed = settings.seed;
+	queue.pixel_order = settings.pixel_order;
+	queue.camera_ray_packets = settings.camera_ray_packets;
+	queue.sort_secondary_rays = settings.sort_secondary_rays;
+	if (scene.numa_nodes > 1)
+	{
+		for (int node = 0; node < scene.numa_nodes; node++)
+		{
+			queue.node_worlds[node] = node == 0 ? &scene.world : &scene.node_worlds[node];
+		}
+	}
+
+	std::mutex send_lock;
+	atomic<bool> connected(true);
+	Task_Group group = {};
+	int tiles = 0;
+	bool done = false;
+	double start = get_time_ms();
+	while (connected && receive_net_message(socket, header, payload))
+	{
+		if (header.type == NET_DONE)
+		{
+			done = true;
+			break;
+		}
+		Net_Tile tile;
+		if (header.type != NET_TILE || !read_net_struct(payload, tile) || tile.x_min < 0 || tile.x_max > image.width || tile.x_min >= tile.x_max ||
+			tile.y_min < 0 || tile.y_max > image.height || tile.y_min >= tile.y_max ||
+			net_tile_result_size(tile.x_max - tile.x_min, tile.y_max - tile.y_min) > NET_MAX_MESSAGE_SIZE)
+		{
+			fprintf(stderr, "ERROR: Unexpected message from the coordinator.\n");
+			break;
+		}
+
+		tiles++;
+		submit_task(pool, group, [&queue, &image, &scene, &camera, &send_lock, &connected, socket, tile]
+		{
+			Job job = {};
+			job.image = &image;
+			job.world = &scene.world;
+			job.camera = &camera;
+			job.x_min = tile.x_min;
+			job.x_max = tile.x_max;
+			job.y_min = tile.y_min;
+			job.y_max = tile.y_max;
+			job.tile_x = tile.tile_x;
+			job.tile_y = tile.tile_y;
+			vector<float> colors(size_t(tile.x_max - tile.x_min) * size_t(tile.y_max - tile.y_min) * 3);
+			job.colors = colors.data();
+
+			Ray_Counts counts_before = ray_counts;
+			render_job(queue, job);
+			Net_Tile_Result result = { tile.job, float(job.cost), ray_counts.rays - counts_before.rays, ray_counts.bounces - counts_before.bounces };
+
+			std::lock_guard<std::mutex> guard(send_lock);
+			if (connected && !send_net_message(socket, NET_TILE_RESULT, &result, sizeof(result), colors.data(), colors.size() * sizeof(float)))
+			{
+				connected = false;
+			}
+		});
+	}
+	wait_for_tasks(pool, group);
+	close_net_socket(socket);
+
+	double ms = get_time_ms() - start;
+	printf("%d tiles rendered in %.0f ms, %.2f Mrays/s\n", tiles, ms, double(queue.total_rays.load()) / (ms * 1000.0));
+	if (!done)
+	{
+		fprintf(stderr, "ERROR: Lost the connection to the coordinator.\n");
+	}
+	print_texture_cache_stats(texture_cache);
+	return done;
+}
+
+// A worker process as the coordinator sees it.
+struct Remote_Worker
+{
+	Net_Socket socket;
+	// address and port
+	string name;
+	int threads;
+	bool ready;
+	bool lost;
+	// jobs sent and not back yet
+	vector<int> tiles_out;
+	double last_heard_ms;
+	double first_tile_ms;
+	double last_result_ms;
+	int tiles;
+	uint64_t samples;
+	uint64_t rays;
+	// taken back when the worker was lost
+	int reissued;
+};
+
+// A connection that hasn't said hello yet. It's only read once it has sent something, so one that
+// stays silent can't hold up the workers.
+struct Pending_Connection
+{
+	Net_Socket socket;
+	string name;
+	double accepted_ms;
+};
+
+// Renders a frame on workers connecting over TCP and writes it out. Starts once network.workers
+// have loaded the scene and hands every worker twice as many tiles as it has threads. Tiles of a
+// worker that disconnects, fails or times out go back to the front of the queue for the others,
+// and workers can join at any time. The workers return linear colors that are gamma corrected
+// here, so the image is the same as a local render with the same tile size. False when the port
+// couldn't be listened on or the image couldn't be written.
+bool run_coordinator(Network_Settings& network, Render_Settings& settings)
+{
+	Net_Socket server = listen_net(network.port);
+	if (server == INVALID_NET_SOCKET)
+	{
+		return false;
+	}
+	printf("Waiting for %d worker%s on port %d\n", network.workers, network.workers == 1 ? "" : "s", network.port);
+
+	// the settings as given, the workers resolve them against the scene
+	Net_Setup setup = {};
+	setup.width = settings.width;
+	setup.height = settings.height;
+	setup.samples_per_pixel = settings.samples_per_pixel;
+	setup.ray_depth = settings.ray_depth;
+	setup.seed = settings.seed;
+	setup.pixel_order = settings.pixel_order;
+	setup.camera_ray_packets = settings.camera_ray_packets;
+	setup.sort_secondary_rays = settings.sort_secondary_rays;
+	setup.light_selection = settings.light_selection;
+	setup.texture_cache_mb = settings.texture_cache_mb;
+	string scene_text = settings.scene ? settings.scene : "";
+	string mesh_file = settings.stress.mesh_file ? settings.stress.mesh_file : "";
+	string camera_text = settings.camera ? settings.camera : "";
+	setup.scene_length = uint32_t(scene_text.size());
+	setup.mesh_length = uint32_t(mesh_file.size());
+	setup.camera_length = uint32_t(camera_text.size());
+	string strings = scene_text + mesh_file + camera_text;
+
+	vector<Pending_Connection> connections;
+	vector<Remote_Worker> workers;
+	Net_Ready frame_settings = {};
+	Frame frame = {};
+	Image& image = frame.image;
+	Job_Queue queue = {};
+	deque<int> pending;
+	vector<bool> finished;
+	int finished_count = 0;
+	bool started = false;
+	bool waiting_reported = false;
+	double start = .0;
+	Net_Message_Header header;
+	vector<char> payload;
+
+	auto lose_worker = [&](Remote_Worker& worker, const char* reason)
+	{
+		close_net_socket(worker.socket);
+		worker.lost = true;
+		for (auto job = worker.tiles_out.rbegin(); job != worker.tiles_out.rend(); job++)
+		{
+			if (!finished[*job])
+			{
+				pending.push_front(*job);
+				worker.reissued++;
+			}
+		}
+		worker.tiles_out.clear();
+		// past the progress line
+		printf("%sWorker %s lost, %s, %d tiles reissued\n", started ? "\n" : "", worker.name.c_str(), reason, worker.reissued);
+	};
+
+	while (!started || finished_count < queue.jobs_count)
+	{
+		vector<Net_Socket> sockets = { server };
+		for (Pending_Connection& connection : connections)
+		{
+			sockets.push_back(connection.socket);
+		}
+		size_t first_worker_socket = sockets.size();
+		vector<int> socket_workers;
+		for (int i = 0; i < int(workers.size()); i++)
+		{
+			if (!workers[i].lost)
+			{
+				sockets.push_back(workers[i].socket);
+				socket_workers.push_back(i);
+			}
+		}
+		vector<bool> readable;
+		wait_net_readable(sockets, 100, readable);
+		double now = get_time_ms();
+
+		vector<Pending_Connection> still_pending;
+		for (size_t i = 1; i < first_worker_socket; i++)
+		{
+			Pending_Connection& connection = connections[i - 1];
+			if (!readable[i])
+			{
+				if (now - connection.accepted_ms <= network.worker_timeout * 1000.0)
+				{
+					still_pending.push_back(connection);
+				}
+				else
+				{
+					printf("%sConnection from %s sent nothing\n", started ? "\n" : "", connection.name.c_str());
+					close_net_socket(connection.socket);
+				}
+				continue;
+			}
+
+			Remote_Worker worker = {};
+			worker.socket = connection.socket;
+			worker.name = connection.name;
+			Net_Hello hello;
+			if (receive_net_message(worker.socket, header, payload) && header.type == NET_HELLO && read_net_struct(payload, hello) &&
+				hello.magic == NET_MAGIC && hello.version == NET_VERSION &&
+				send_net_message(worker.socket, NET_SETUP, &setup, sizeof(setup), strings.data(), strings.size()))
+			{
+				set_net_timeout(worker.socket, network.worker_timeout);
+				worker.threads = MAX(1, hello.threads);
+				worker.last_heard_ms = now;
+				printf("%sWorker %s connected with %d thread%s\n", started ? "\n" : "", worker.name.c_str(), worker.threads, worker.threads == 1 ? "" : "s");
+				workers.push_back(worker);
+			}
+			else
+			{
+				printf("%sConnection from %s is not a worker\n", started ? "\n" : "", worker.name.c_str());
+				close_net_socket(worker.socket);
+			}
+		}
+		connections.swap(still_pending);
+
+		if (readable[0])
+		{
+			Pending_Connection connection = {};
+			connection.socket = accept_net(server, connection.name);
+			if (connection.socket != INVALID_NET_SOCKET)
+			{
+				// the hello is a few bytes sent right after connecting, a part of it shouldn't keep
+				// the others waiting for long
+				set_net_timeout(connection.socket, 1);
+				connection.accepted_ms = now;
+				connections.push_back(connection);
+			}
+		}
+
+		for (size_t i = first_worker_socket; i < sockets.size(); i++)
+		{
+			if (!readable[i])
+			{
+				continue;
+			}
+			Remote_Worker& worker = workers[socket_workers[i - first_worker_socket]];
+			if (!receive_net_message(worker.socket, header, payload))
+			{
+				lose_worker(worker, "connection closed");
+				continue;
+			}
+			worker.last_heard_ms = now;
+
+			if (header.type == NET_READY)
+			{
+				Net_Ready ready;
+				bool first = frame_settings.width == 0;
+				if (!read_net_struct(payload, ready) || (!first && memcmp(&ready, &frame_settings, sizeof(ready)) != 0))
+				{
+					lose_worker(worker, "renders a different frame than the others");
+					continue;
+				}
+				frame_settings = ready;
+				worker.ready = true;
+				printf("%sWorker %s ready\n", started ? "\n" : "", worker.name.c_str());
+			}
+			else if (header.type == NET_FAILED)
+			{
+				lose_worker(worker, "couldn't load the scene");
+			}
+			else if (header.type == NET_TILE_RESULT)
+			{
+				Net_Tile_Result result;
+				auto out = read_net_struct(payload, result) ? find(worker.tiles_out.begin(), worker.tiles_out.end(), result.job) : worker.tiles_out.end();
+				if (out == worker.tiles_out.end())
+				{
+					lose_worker(worker, "sent a tile it wasn't given");
+					continue;
+				}
+				Job& job = queue.jobs[result.job];
+				int tile_width = job.x_max - job.x_min;
+				int tile_height = job.y_max - job.y_min;
+				if (payload.size() != net_tile_result_size(tile_width, tile_height))
+				{
+					lose_worker(worker, "sent a tile of the wrong size");
+					continue;
+				}
+				worker.tiles_out.erase(out);
+				worker.last_result_ms = now;
+				worker.tiles++;
+				worker.samples += uint64_t(tile_width) * uint64_t(tile_height) * uint64_t(frame_settings.samples_per_pixel);
+				worker.rays += result.rays;
+				queue.total_rays += result.rays;
+				queue.total_bounces += result.bounces;
+				if (finished[result.job])
+				{
+					continue;
+				}
+
+				const float* colors = (const float*)(payload.data() + sizeof(result));
+				for (int local_y = 0; local_y < tile_height; local_y++)
+				{
+					uint32_t* buf = image.get_image_ptr(job.x_min, job.y_min + local_y);
+					for (int local_x = 0; local_x < tile_width; local_x++)
+					{
+						float color[3];
+						memcpy(color, colors + 3 * (local_x + local_y * tile_width), sizeof(color));
+						*buf = unpack_rgba(correct_gamma(v3f{ color[0], color[1], color[2] }));
+						buf++;
+					}
+				}
+				finished[result.job] = true;
+				finished_count++;
+			}
+			else
+			{
+				lose_worker(worker, "unexpected message");
+			}
+		}
+
+		int ready_workers = 0;
+		int ready_threads = 0;
+		for (Remote_Worker& worker : workers)
+		{
+			if (worker.lost || !worker.ready)
+			{
+				continue;
+			}
+			if (!worker.tiles_out.empty() && now - worker.last_heard_ms > network.worker_timeout * 1000.0)
+			{
+				lose_worker(worker, "timed out");
+				continue;
+			}
+			ready_workers++;
+			ready_threads += worker.threads;
+		}
+
+		if (!started && ready_workers >= network.workers)
+		{
+			image.width = frame_settings.width;
+			image.height = frame_settings.height;
+			image.pixels = (uint32_t*)allocate_aligned(image.width * image.height * sizeof(uint32_t), CACHE_LINE_SIZE);
+			int tile_size = settings.tile_size > 0 ? settings.tile_size : choose_tile_size(image.width, image.height, ready_threads);
+			// the pixels of a tile have to come back in one message, or no worker could ever finish it
+			if (tile_size > max_net_tile_size())
+			{
+				printf("Tile size %d doesn't fit in a message, using %d\n", tile_size, max_net_tile_size());
+				tile_size = max_net_tile_size();
+			}
+			int tile_count_x;
+			int tile_count_y;
+			divide_into_tiles(queue, image, nullptr, nullptr, tile_size, tile_count_x, tile_count_y);
+			partition_jobs(queue, 1, tile_count_y);
+			if (settings.tile_order != TILE_ORDER_SCANLINE)
+			{
+				// there is no scene here to estimate costs with
+				sort_jobs_by_curve(queue, settings.tile_order == TILE_ORDER_MORTON ? TILE_ORDER_MORTON : TILE_ORDER_HILBERT, tile_count_x, tile_count_y);
+			}
+			for (int job = 0; job < queue.jobs_count; job++)
+			{
+				pending.push_back(job);
+			}
+			finished.assign(queue.jobs_count, false);
+
+			printf("Using %d workers with %d threads, total tiles: %d, %dx%d (%dk/tile)\n", ready_workers, ready_threads, queue.jobs_count,
+				tile_count_x, tile_count_y, tile_size * tile_size * 4 / 1024);
+			printf("Image quality: %dx%d pixels, %d samples per pixel, %d ray depth\n", image.width, image.height,
+				frame_settings.samples_per_pixel, frame_settings.ray_depth);
+			started = true;
+			start = now;
+		}
+		if (!started)
+		{
+			continue;
+		}
+
+		for (Remote_Worker& worker : workers)
+		{
+			while (!worker.lost && worker.ready && !pending.empty() && int(worker.tiles_out.size()) < 2 * worker.threads)
+			{
+				int job_index = pending.front();
+				pending.pop_front();
+				Job& job = queue.jobs[job_index];
+				Net_Tile tile = { job_index, job.x_min, job.x_max, job.y_min, job.y_max, job.tile_x, job.tile_y };
+				if (worker.tiles_out.empty())
+				{
+					// only time with tiles out counts against the timeout
+					worker.last_heard_ms = now;
+				}
+				worker.tiles_out.push_back(job_index);
+				if (worker.first_tile_ms == .0)
+				{
+					worker.first_tile_ms = now;
+				}
+				if (!send_net_message(worker.socket, NET_TILE, &tile, sizeof(tile)))
+				{
+					lose_worker(worker, "connection closed");
+				}
+			}
+		}
+
+		if (ready_workers == 0 && !pending.empty())
+		{
+			if (!waiting_reported)
+			{
+				printf("\nNo workers left, waiting for more to connect\n");
+				waiting_reported = true;
+			}
+		}
+		else
+		{
+			waiting_reported = false;
+		}
+		printf("\rRaycasting %.2f%%", 100.0f * float(finished_count) / float(queue.jobs_count));
+		fflush(stdout);
+	}
+	double render_ms = get_time_ms() - start;
+	printf("\nRaycasting Done!\n");
+
+	for (Remote_Worker& worker : workers)
+	{
+		if (!worker.lost)
+		{
+			send_net_message(worker.socket, NET_DONE, nullptr, 0);
+			close_net_socket(worker.socket);
+		}
+	}
+	for (Pending_Connection& connection : connections)
+	{
+		close_net_socket(connection.socket);
+	}
+	close_net_socket(server);
+
+	printf("Total time: %.0f ms\n", render_ms);
+	printf("Total bounces: %llu, rays: %llu (%.2f Mrays/s)\n", (unsigned long long)queue.total_bounces.load(), (unsigned long long)queue.total_rays.load(),
+		double(queue.total_rays.load()) / (render_ms * 1000.0));
+	printf("\n%-24s %7s %6s %8s %10s %10s\n", "worker", "threads", "tiles", "reissued", "Mrays/s", "Msamples/s");
+	for (Remote_Worker& worker : workers)
+	{
+		// over the time from its first tile to its last
+		double active_ms = MAX(worker.last_result_ms - worker.first_tile_ms, 1.0);
+		printf("%-24s %7d %6d %8d %10.2f %10.2f%s\n", worker.name.c_str(), worker.threads, worker.tiles, worker.reissued,
+			double(worker.rays) / (active_ms * 1000.0), double(worker.samples) / (active_ms * 1000.0), worker.lost ? "  lost" : "");
+	}
+
+	bool written = true;
+	if (settings.output)
+	{
+		printf("Writing to file!\n");
+		frame.output = settings.output;
+		written = write_frame(frame);
+		if (written)
+		{
+			printf("Done\n");
+		}
+	}
+	free_aligned(image.pixels);
+	delete[] queue.jobs;
+	return written;
+}
+
+// Options of ray_tracer scene-bench.
+struct Scene_Bench_Settings
+{
+	// .json or .csv
+	const char* output;
+	// csv report of an earlier run to compare against, with the slowdown in percent that counts
+	const char* baseline_file;
+	double threshold;
+	int repetitions;
+	// comma separated scenes for parse_scene, all the hand built ones when null
+	const char* scene_list;
+};
+
+// The thread pool is started with these before anything is parsed or rendered.
+struct Pool_Settings
+{
+	// 0 for one per hardware thread
+	int threads;
+	// Pins the workers, replicates the scene on every node and places the framebuffer bands
+	// next to the threads that render them. Off to compare against the OS scheduling.
+	bool numa_aware;
+};
+
+// Renders every scene with the same fixed settings and seed and writes the timings to a report.
+// Every scene is rendered repetitions times and the run with the median render time is kept.
+int run_scene_benchmarks(Scene_Bench_Settings& bench, Render_Settings& settings, Thread_Pool& pool, int core_count, Numa_Topology& topology, bool numa_aware, Perf_Counters& perf_counters)
+{
+	vector<Render_Settings> scenes;
+	// split in place, scene files keep pointing into it
+	string list = bench.scene_list ? bench.scene_list : "";
+	if (bench.scene_list)
+	{
+		size_t start = 0;
+		while (start <= list.size())
+		{
+			size_t end = list.find(',', start);
+			if (end == string::npos)
+			{
+				end = list.size();
+			}
+			list[end] = '\0';
+			const char* name = &list[start];
+			if (*name)
+			{
+				Render_Settings scene = settings;
+				if (!parse_scene(name, scene))
+				{
+					fprintf(stderr, "Unknown scene '%s'.\n", name);
+					return 1;
+				}
+				scenes.push_back(scene);
+			}
+			start = end + 1;
+		}
+	}
+	else
+	{
+		for (int type = 0; type < WORLD_TYPE_COUNT; type++)
+		{
+			settings.world_type = World_Types(type);
+			scenes.push_back(settings);
+		}
+	}
+
+	vector<Scene_Benchmark_Result> results;
+	for (Render_Settings& scene : scenes)
+	{
+		string name = scene_name(scene);
+		string image_file = "scene_bench_" + name + ".ppm";
+		scene.output = image_file.c_str();
+
+		vector<Scene_Benchmark_Result> runs;
+		for (int repetition = 0; repetition < bench.repetitions; repetition++)
+		{
+			printf("\n=== %s (%d/%d) ===\n", name.c_str(), repetition + 1, bench.repetitions);
+			reset_peak_memory();
+			double start = get_time_ms();
+			Render_Stats stats;
+			if (!render_scene(pool, core_count, topology, numa_aware, perf_counters, scene, stats))
+			{
+				return 1;
+			}
+
+			Scene_Benchmark_Result run = {};
+			run.total_ms = get_time_ms() - start;
+			run.peak_memory = get_peak_memory();
+			run.name = name;
+			run.width = stats.width;
+			run.height = stats.height;
+			run.samples_per_pixel = scene.samples_per_pixel;
+			run.ray_depth = scene.ray_depth;
+			run.seed = scene.seed;
+			run.objects = stats.objects;
+			run.load_ms = stats.load_ms;
+			run.build_ms = stats.build_ms;
+			run.estimate_ms = stats.estimate_ms;
+			run.render_ms = stats.render_ms;
+			run.write_ms = stats.write_ms;
+			run.samples = stats.samples;
+			run.bounces = stats.bounces;
+			run.rays = stats.rays;
+			run.rays_per_second = stats.render_ms > .0 ? double(stats.rays) / (stats.render_ms / 1000.0) : .0;
+			run.image_hash = stats.image_hash;
+			run.l2_requests = stats.l2_requests;
+			run.llc_references = stats.llc_references;
+			run.llc_misses = stats.llc_misses;
+			runs.push_back(run);
+		}
+
+		sort(runs.begin(), runs.end(), [](const Scene_Benchmark_Result& a, const Scene_Benchmark_Result& b) { return a.render_ms < b.render_ms; });
+		results.push_back(runs[runs.size() / 2]);
+	}
+
+	printf("\n%-20s %10s %9s %9s %9s %9s %9s %12s %10s\n", "scene", "objects", "load ms", "build ms", "render ms", "write ms", "total ms", "Mrays/s", "peak MB");
+	for (auto& result : results)
+	{
+		printf("%-20s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %12.2f %10.1f\n", result.name.c_str(), (unsigned long long)result.objects,
+			result.load_ms, result.build_ms, result.render_ms, result.write_ms, result.total_ms, result.rays_per_second / 1e6,
+			double(result.peak_memory) / (1024.0 * 1024.0));
+	}
+
+	if (!write_scene_benchmark_report(bench.output, results))
+	{
+		return 1;
+	}
+	printf("Report written to %s\n", bench.output);
+
+	if (bench.baseline_file)
+	{
+		vector<Scene_Benchmark_Result> baseline;
+		if (!read_scene_benchmark_csv(bench.baseline_file, baseline))
+		{
+			return 1;
+		}
+		return compare_scene_benchmarks(results, baseline, bench.threshold) ? 2 : 0;
+	}
+	return 0;
+}
+
+inline bool
+parse_int_option(const char* text, int min, int& value)
+{
+	char* end = nullptr;
+	long result = strtol(text, &end, 10);
+	if (end == text || *end || result < min || result > INT_MAX)
+	{
+		return false;
+	}
+	value = int(result);
+	return true;
+}
+
+template <typename T>
+inline bool
+parse_name_option(const char* text, const char** names, int count, T& value)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(text, names[i]) == 0)
+		{
+			value = T(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool
+parse_switch_option(const char* text, bool& value)
+{
+	value = strcmp(text, "on") == 0;
+	return value || strcmp(text, "off") == 0;
+}
+
+// Reads the option at argv[i] and its value and moves i to the value. False for an unknown option,
+// a missing value or one out of range. Options of ray_tracer scene-bench go to bench, the batch ones
+// of ray_tracer to batch and those of ray_tracer coordinator to network. bench is null outside of
+// scene-bench, where --output names the report instead of the image.
+bool parse_option(int argc, char** argv, int& i, Render_Settings& settings, Pool_Settings& pool_settings, Batch_Settings* batch,
+	Scene_Bench_Settings* bench, Network_Settings* network)
+{
+	if (i + 1 >= argc)
+	{
+		return false;
+	}
+	const char* option = argv[i];
+	const char* value = argv[++i];
+
+	if (strcmp(option, "--width") == 0) return parse_int_option(value, 16, settings.width);
+	if (strcmp(option, "--height") == 0) return parse_int_option(value, 1, settings.height);
+	if (strcmp(option, "--spp") == 0) return parse_int_option(value, 1, settings.samples_per_pixel);
+	if (strcmp(option, "--depth") == 0) return parse_int_option(value, 1, settings.ray_depth);
+	if (strcmp(option, "--seed") == 0)
+	{
+		char* end = nullptr;
+		settings.seed = strtoull(value, &end, 10);
+		return end != value && !*end;
+	}
+	if (strcmp(option, "--camera") == 0)
+	{
+		Scene_Options options = default_scene_options();
+		settings.camera = value;
+		return parse_scene_options("--camera", value, options);
+	}
+	if (strcmp(option, "--mesh") == 0)
+	{
+		settings.stress.mesh_file = value;
+		return true;
+	}
+	if (strcmp(option, "--tile-size") == 0) return parse_int_option(value, 1, settings.tile_size);
+	if (strcmp(option, "--tile-order") == 0) return parse_name_option(value, tile_order_names, TILE_ORDER_COUNT, settings.tile_order);
+	if (strcmp(option, "--pixel-order") == 0) return parse_name_option(value, pixel_order_names, PIXEL_ORDER_COUNT, settings.pixel_order);
+	if (strcmp(option, "--packets") == 0) return parse_switch_option(value, settings.camera_ray_packets);
+	if (strcmp(option, "--sort-rays") == 0) return parse_switch_option(value, settings.sort_secondary_rays);
+	if (strcmp(option, "--lights") == 0) return parse_name_option(value, light_selection_names, LIGHT_SELECTION_COUNT, settings.light_selection);
+	if (strcmp(option, "--texture-cache-mb") == 0) return parse_int_option(value, 1, settings.texture_cache_mb);
+	if (strcmp(option, "--heatmap") == 0)
+	{
+		// tests needs USE_RENDER_COUNTERS=1
+		return parse_name_option(value, heatmap_mode_names, HEATMAP_TESTS + USE_RENDER_COUNTERS, settings.heatmap);
+	}
+	if (strcmp(option, "--threads") == 0) return parse_int_option(value, 0, pool_settings.threads);
+	if (strcmp(option, "--numa") == 0) return parse_switch_option(value, pool_settings.numa_aware);
+
+	if (!bench)
+	{
+		if (strcmp(option, "--scene") == 0) return parse_scene(value, settings);
+		if (strcmp(option, "--output") == 0)
+		{
+			settings.output = value;
+			return true;
+		}
+		if (batch && strcmp(option, "--views") == 0)
+		{
+			batch->views_file = value;
+			return true;
+		}
+		if (batch && strcmp(option, "--turntable") == 0) return parse_int_option(value, 1, batch->turntable_frames);
+		if (network && strcmp(option, "--port") == 0) return parse_int_option(value, 1, network->port) && network->port <= 65535;
+		if (network && strcmp(option, "--workers") == 0) return parse_int_option(value, 1, network->workers);
+		if (network && strcmp(option, "--worker-timeout") == 0) return parse_int_option(value, 1, network->worker_timeout);
+		return false;
+	}
+	if (strcmp(option, "--output") == 0) bench->output = value;
+	else if (strcmp(option, "--baseline") == 0) bench->baseline_file = value;
+	else if (strcmp(option, "--threshold") == 0)
+	{
+		char* end = nullptr;
+		bench->threshold = strtod(value, &end);
+		return end != value && !*end && isfinite(bench->threshold) && bench->threshold >= .0;
+	}
+	else if (strcmp(option, "--repetitions") == 0) return parse_int_option(value, 1, bench->repetitions);
+	else if (strcmp(option, "--scenes") == 0) bench->scene_list = value;
+	else return false;
+	return true;
+}
+
+// The render settings of a worker come from the coordinator, only the pool is its own.
+bool parse_worker_option(int argc, char** argv, int& i, Pool_Settings& pool_settings, Network_Settings& network)
+{
+	if (i + 1 >= argc)
+	{
+		return false;
+	}
+	const char* option = argv[i];
+	const char* value = argv[++i];
+
+	if (strcmp(option, "--connect") == 0)
+	{
+		network.coordinator = value;
+		return true;
+	}
+	if (strcmp(option, "--threads") == 0) return parse_int_option(value, 0, pool_settings.threads);
+	if (strcmp(option, "--numa") == 0) return parse_switch_option(value, pool_settings.numa_aware);
+	return false;
+}
+
+void print_usage()
+{
+	fprintf(stderr,
+		"Usage: ray_tracer [options]\n"
+		"       ray_tracer scene-bench [options] [--output report.json|csv] [--baseline report.csv] [--threshold percent]\n"
+		"                              [--repetitions n] [--scenes default,spheres:1e6,...]\n"
+		"       ray_tracer convert [--format rgb8|rgb16|half] <image> <output.rtex>\n"
+		"       ray_tracer compile-scene <input.scene> <output.rscn>\n"
+		"       ray_tracer coordinator [options] [--port n] [--workers n] [--worker-timeout seconds]\n"
+		"       ray_tracer worker [--connect host:port] [--threads n] [--numa on|off]\n"
+		"Options:\n"
+		"  --scene name               default, lighted, monkey, outdoor, spheres, instances, triangles or lights\n"
+		"                             with a count (spheres:1e6), or a .scene or .rscn file\n"
+		"  --mesh file.obj            what the instances stress scene is made of\n"
+		"  --output file.ppm          image.ppm by default\n"
+		"  --width n, --height n      the scene's size or 1024 wide, 16:9\n"
+		"  --spp n, --depth n         samples per pixel and ray depth, the scene's or 32 and 8\n"
+		"  --seed n\n"
+		"  --camera \"settings\"        over the scene's camera, as in a scene file: \"look_from 0 2 6 fov 40\"\n"
+		"  --tile-size n              picked from the image size and thread count by default\n"
+		"  --tile-order scanline|cost|hilbert|morton\n"
+		"  --pixel-order scanline|hilbert|morton\n"
+		"  --packets on|off           trace camera rays in packets, on by default\n"
+		"  --sort-rays on|off         trace a tile a bounce at a time sorting the rays, off by default\n"
+		"  --lights power|bvh         how lights are picked for direct lighting, bvh by default\n"
+		"  --heatmap time|rays|tests  also write image_heatmap.ppm, tests needs USE_RENDER_COUNTERS=1\n"
+		"  --texture-cache-mb n       memory for the tiles of large tiled textures, 256 by default\n"
+		"  --threads n                one per hardware thread by default\n"
+		"  --numa on|off              pin threads and replicate the scene per NUMA node, off by default\n"
+		"  --views views.txt          render a frame per line of the file, an output file and camera settings:\n"
+		"                             \"frame_0001.ppm look_from 0 2 6 fov 40\", loading the scene once\n"
+		"  --turntable n              render n frames around the scene to image_0000.ppm and on\n"
+		"scene-bench renders at 512 pixels wide with 16 samples per pixel unless told otherwise.\n"
+		"coordinator renders on the workers that connect to --port, 7878 by default, and starts once --workers\n"
+		"have loaded the scene, 1 by default. A worker that sends nothing for --worker-timeout seconds, 60 by\n"
+		"default, is taken for lost and its tiles go to the others. Workers connect to 127.0.0.1:7878 by default\n"
+		"and load the scene the coordinator names from their own working directory.\n");
+}
+
+int main(int argc, char** argv)
+{
+	// ray_tracer convert [--format rgb8|rgb16|half] <image> <output.rtex>
+	if (argc >= 4 && strcmp(argv[1], "convert") == 0)
+	{
+		int format = TEXEL_FORMAT_RGB8;
+		if (argc == 6 && strcmp(argv[2], "--format") == 0)
+		{
+			if (strcmp(argv[3], "rgb16") == 0) format = TEXEL_FORMAT_RGB16;
+			else if (strcmp(argv[3], "half") == 0) format = TEXEL_FORMAT_RGB16F;
+			else if (strcmp(argv[3], "rgb8") != 0)
+			{
+				fprintf(stderr, "Unknown texel format '%s', use rgb8, rgb16 or half.\n", argv[3]);
+				return 1;
+			}
+		}
+		else if (argc != 4)
+		{
+			fprintf(stderr, "Usage: ray_tracer convert [--format rgb8|rgb16|half] <image> <output.rtex>\n");
+			return 1;
+		}
+		return convert_texture(argv[argc - 2], argv[argc - 1], format) ? 0 : 1;
+	}
+
+	// ray_tracer compile-scene <input.scene> <output.rscn>
+	if (argc >= 2 && strcmp(argv[1], "compile-scene") == 0)
+	{
+		if (argc != 4)
+		{
+			fprintf(stderr, "Usage: ray_tracer compile-scene <input.scene> <output.rscn>\n");
+			return 1;
+		}
+		return compile_scene_file(argv[2], argv[3]) ? 0 : 1;
+	}
+
+	// ray_tracer [options], ray_tracer scene-bench [options], ray_tracer coordinator [options] or
+	// ray_tracer worker [options]
+	bool scene_bench = argc >= 2 && strcmp(argv[1], "scene-bench") == 0;
+	bool coordinator = argc >= 2 && strcmp(argv[1], "coordinator") == 0;
+	bool worker = argc >= 2 && strcmp(argv[1], "worker") == 0;
+	Render_Settings settings = default_render_settings();
+	Pool_Settings pool_settings = {};
+	Batch_Settings batch = {};
+	Network_Settings network = {};
+	network.port = NET_DEFAULT_PORT;
+	network.workers = 1;
+	network.worker_timeout = 60;
+	network.coordinator = "127.0.0.1:7878";
+	Scene_Bench_Settings bench = {};
+	bench.output = "scene_bench.json";
+	bench.threshold = 5.0;
+	bench.repetitions = 3;
+	if (scene_bench)
+	{
+		settings.width = 512;
+		settings.samples_per_pixel = 16;
+		settings.ray_depth = 8;
+	}
+	for (int i = (scene_bench || coordinator || worker) ? 2 : 1; i < argc; i++)
+	{
+		int option = i;
+		if (strcmp(argv[i], "--help") == 0)
+		{
+			print_usage();
+			return 0;
+		}
+		bool parsed = worker ? parse_worker_option(argc, argv, i, pool_settings, network) :
+			parse_option(argc, argv, i, settings, pool_settings, (scene_bench || coordinator) ? nullptr : &batch, scene_bench ? &bench : nullptr,
+				coordinator ? &network : nullptr);
+		if (!parsed)
+		{
+			fprintf(stderr, "Bad option '%s%s%s'.\n", argv[option], i > option ? " " : "", i > option ? argv[i] : "");
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (batch.views_file && batch.turntable_frames)
+	{
+		fprintf(stderr, "Use either --views or --turntable.\n");
+		return 1;
+	}
+	if (coordinator && settings.heatmap != HEATMAP_NONE)
+	{
+		fprintf(stderr, "Heatmaps are only written by local renders.\n");
+		return 1;
+	}
+	if ((coordinator || worker) && !start_net())
+	{
+		return 1;
+	}
+
+	TRACE_THREAD_NAME("main");
+
+	// Perf counters are only inherited by threads created after them, so they go before the pool
+	Perf_Counters perf_counters = {};
+	open_perf_counters(perf_counters);
+
+	int core_count = pool_settings.threads > 0 ? pool_settings.threads : int(thread::hardware_concurrency());
+	if (core_count <= 0)
+	{
+		core_count = 4;
+	}
+
+	bool numa_aware = pool_settings.numa_aware;
+	Numa_Topology topology = query_numa_topology();
+
+	Thread_Pool pool = {};
+	if (numa_aware)
+	{
+		start_thread_pool(pool, core_count, [&topology](int thread_index) { pin_pool_thread(topology, thread_index); });
+	}
+	else
+	{
+		start_thread_pool(pool, core_count);
+	}
+
+	int result = 0;
+	if (scene_bench)
+	{
+		result = run_scene_benchmarks(bench, settings, pool, core_count, topology, numa_aware, perf_counters);
+	}
+	else if (coordinator)
+	{
+		result = run_coordinator(network, settings) ? 0 : 1;
+	}
+	else if (worker)
+	{
+		result = run_worker(network, pool, topology, numa_aware) ? 0 : 1;
+	}
+	else if (batch.views_file || batch.turntable_frames)
+	{
+		result = render_batch(batch, pool, core_count, topology, numa_aware, perf_counters, settings) ? 0 : 1;
+	}
+	else
+	{
+		Render_Stats stats;
+		result = render_scene(pool, core_count, topology, numa_aware, perf_counters, settings, stats) ? 0 : 1;
+	}
+	close_perf_counters(perf_counters);
+	TRACE_WRITE("trace.json");
+
+	stop_thread_pool(pool);
+	if (coordinator || worker)
+	{
+		stop_net();
+	}
+
+	return result;
+}
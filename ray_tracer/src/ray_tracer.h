@@ -2,13 +2,46 @@
 
 // Utilities
 
-#define MIN(a, b) (a) < (b) ? (a) : (b)
-#define MAX(a, b) (a) > (b) ? (a) : (b)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Random numbers come from a PCG32 generator per thread (O'Neill, pcg-random.org). Rendering
+// reseeds it for every tile from the frame's seed and the tile, so a frame comes out the same
+// whichever thread renders which tile, and the threads don't queue up on the lock rand() takes.
+struct Random_State
+{
+	uint64_t state;
+	uint64_t increment;
+};
+
+static thread_local Random_State random_state = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+
+inline uint32_t
+random_uint32()
+{
+	uint64_t old_state = random_state.state;
+	random_state.state = old_state * 6364136223846793005ULL + random_state.increment;
+	uint32_t xorshifted = uint32_t(((old_state >> 18) ^ old_state) >> 27);
+	uint32_t rotation = uint32_t(old_state >> 59);
+	return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+// Every sequence is a different stream of numbers for the same seed.
+inline void
+seed_random(uint64_t seed, uint64_t sequence)
+{
+	random_state.state = 0;
+	random_state.increment = (sequence << 1) | 1;
+	random_uint32();
+	random_state.state += seed;
+	random_uint32();
+}
 
 inline float
 random_float()
 {
-	return (float)rand() / ((float)RAND_MAX + 1.0f);
+	// 24 bits so that the result stays below 1
+	return float(random_uint32() >> 8) * (1.0f / 16777216.0f);
 }
 
 inline float
@@ -27,9 +60,37 @@ clamp(float x, float min, float max)
 
 #include "ray_math.h"
 #include <limits>
+#include <chrono>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 const float infinity = std::numeric_limits<float>::infinity();
 
+inline double
+get_time_ms()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time stamp counter, cheap enough to read around every pixel. It ticks at a constant rate on
+// current x86 cpus, elsewhere this counts nanoseconds instead.
+inline uint64_t
+read_cycle_counter()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
 inline v3f
 correct_gamma(v3f color)
 {
@@ -42,6 +103,33 @@ correct_gamma(v3f color)
 	return result;
 }
 
+#define CACHE_LINE_SIZE 64
+
+inline void*
+allocate_aligned(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* result = nullptr;
+	if (posix_memalign(&result, alignment, size) != 0)
+	{
+		return nullptr;
+	}
+	return result;
+#endif
+}
+
+inline void
+free_aligned(void* memory)
+{
+#ifdef _WIN32
+	_aligned_free(memory);
+#else
+	free(memory);
+#endif
+}
+
 struct Image
 {
 	int width;
@@ -65,9 +153,14 @@ inline int unpack_rgba(v3f color)
 	return (r << 24) | (g << 16) | (b << 8) | (a << 0);
 }
 
-void write_ppm(const char* file_name, Image& image)
+bool write_ppm(const char* file_name, Image& image)
 {
 	FILE *f = fopen(file_name, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: Could not write to '%s'.\n", file_name);
+		return false;
+	}
 	fprintf(f, "P3\n%d %d\n255\n", image.width, image.height);
 
 	// ppm expects pixels to be top to bottom but our image is rendered bottom to top
@@ -87,6 +180,21 @@ void write_ppm(const char* file_name, Image& image)
 			image_buf++;
 		}
 	}
+	fclose(f);
+	return true;
+}
+
+// FNV-1a over the pixels, two renders with the same settings and seed should give the same hash.
+inline uint64_t
+hash_image(Image& image)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t count = size_t(image.width) * size_t(image.height);
+	for (size_t i = 0; i < count; i++)
+	{
+		hash = (hash ^ image.pixels[i]) * 0x100000001b3ULL;
+	}
+	return hash;
 }
 
 struct Ray
@@ -94,7 +202,20 @@ struct Ray
 	v3f origin;
 	v3f direction;
 
+	Ray() {}
 	Ray(v3f o, v3f d) : origin(o), direction(d) {}
 
 	v3f point_at(float t) { return origin + t * direction; }
 };
+
+// Two rays offset by one pixel in x and y that travel next to the main ray. Where they hit the
+// surface tells how big the pixel footprint is, which decides how blurry a texture lookup can be.
+// Kept next to the ray instead of inside it so intersection tests keep copying small rays.
+struct Ray_Differential
+{
+	bool valid;
+	v3f rx_origin;
+	v3f rx_direction;
+	v3f ry_origin;
+	v3f ry_direction;
+};
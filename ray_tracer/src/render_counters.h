@@ -0,0 +1,215 @@
+#pragma once
+
+// Counts of what the renderer does, for tuning the bvh and the ray depth: rays by type, bvh nodes
+// visited, primitive tests by type, hits, path lengths and why paths ended. Built with
+// USE_RENDER_COUNTERS=0, the default, the counting compiles to nothing.
+//
+// Every thread counts into its own Render_Counters, which registers itself on the thread's first
+// count, so counting needs no atomics. The totals are only added up between frames, while no
+// thread is rendering.
+
+#ifndef USE_RENDER_COUNTERS
+#define USE_RENDER_COUNTERS 0
+#endif
+
+enum Ray_Type
+{
+	RAY_CAMERA,
+	RAY_BOUNCE,
+	RAY_SHADOW,
+
+	RAY_TYPE_COUNT,
+};
+
+enum Primitive_Type
+{
+	PRIMITIVE_SPHERE,
+	PRIMITIVE_TRIANGLE,
+	PRIMITIVE_PLANE,
+	PRIMITIVE_INSTANCE,
+
+	PRIMITIVE_TYPE_COUNT,
+};
+
+// There is no russian roulette, paths end on one of these.
+enum Path_End
+{
+	// hit the ray depth
+	PATH_END_DEPTH,
+	// the material didn't scatter, lights and rays absorbed by the material
+	PATH_END_ABSORBED,
+	// left the scene into the background
+	PATH_END_ESCAPED,
+
+	PATH_END_COUNT,
+};
+
+#if USE_RENDER_COUNTERS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+static const char* ray_type_names[RAY_TYPE_COUNT] = { "camera", "bounce", "shadow" };
+static const char* primitive_type_names[PRIMITIVE_TYPE_COUNT] = { "sphere", "triangle", "plane", "instance" };
+static const char* path_end_names[PATH_END_COUNT] = { "depth limit", "absorbed", "escaped" };
+
+struct Render_Counter_Values
+{
+	uint64_t rays[RAY_TYPE_COUNT];
+	// one per node a single ray visited, and one per node a packet visited for all its rays
+	uint64_t nodes_visited;
+	uint64_t packet_nodes_visited;
+	uint64_t primitive_tests[PRIMITIVE_TYPE_COUNT];
+	// rays that hit something
+	uint64_t hits;
+	uint64_t path_ends[PATH_END_COUNT];
+};
+
+struct Render_Counters;
+
+struct Render_Counter_Registry
+{
+	std::mutex lock;
+	std::vector<Render_Counters*> threads;
+	// of threads that have exited
+	Render_Counter_Values retired;
+};
+
+inline Render_Counter_Registry&
+get_render_counter_registry()
+{
+	static Render_Counter_Registry registry;
+	return registry;
+}
+
+inline void
+add_render_counters(Render_Counter_Values& sum, Render_Counter_Values& values)
+{
+	for (int i = 0; i < RAY_TYPE_COUNT; i++) sum.rays[i] += values.rays[i];
+	sum.nodes_visited += values.nodes_visited;
+	sum.packet_nodes_visited += values.packet_nodes_visited;
+	for (int i = 0; i < PRIMITIVE_TYPE_COUNT; i++) sum.primitive_tests[i] += values.primitive_tests[i];
+	sum.hits += values.hits;
+	for (int i = 0; i < PATH_END_COUNT; i++) sum.path_ends[i] += values.path_ends[i];
+}
+
+struct Render_Counters
+{
+	Render_Counter_Values values;
+
+	Render_Counters()
+	{
+		memset(&values, 0, sizeof(values));
+		Render_Counter_Registry& registry = get_render_counter_registry();
+		std::lock_guard<std::mutex> guard(registry.lock);
+		registry.threads.push_back(this);
+	}
+
+	~Render_Counters()
+	{
+		Render_Counter_Registry& registry = get_render_counter_registry();
+		std::lock_guard<std::mutex> guard(registry.lock);
+		add_render_counters(registry.retired, values);
+		registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+	}
+};
+
+static thread_local Render_Counters render_counters;
+
+inline Render_Counter_Values
+sum_render_counters()
+{
+	Render_Counter_Registry& registry = get_render_counter_registry();
+	std::lock_guard<std::mutex> guard(registry.lock);
+	Render_Counter_Values sum = registry.retired;
+	for (Render_Counters* counters : registry.threads)
+	{
+		add_render_counters(sum, counters->values);
+	}
+	return sum;
+}
+
+inline void
+reset_render_counters()
+{
+	Render_Counter_Registry& registry = get_render_counter_registry();
+	std::lock_guard<std::mutex> guard(registry.lock);
+	memset(&registry.retired, 0, sizeof(registry.retired));
+	for (Render_Counters* counters : registry.threads)
+	{
+		memset(&counters->values, 0, sizeof(counters->values));
+	}
+}
+
+inline uint64_t
+count_bits(uint32_t bits)
+{
+	uint64_t count = 0;
+	for (; bits; bits &= bits - 1)
+	{
+		count++;
+	}
+	return count;
+}
+
+// bvh nodes and primitive tests, what the tests heatmap shows
+inline uint64_t
+traversal_steps()
+{
+	Render_Counter_Values& values = render_counters.values;
+	uint64_t steps = values.nodes_visited + values.packet_nodes_visited;
+	for (int i = 0; i < PRIMITIVE_TYPE_COUNT; i++)
+	{
+		steps += values.primitive_tests[i];
+	}
+	return steps;
+}
+
+inline void
+print_render_counters(Render_Counter_Values& values)
+{
+	uint64_t rays = 0;
+	for (int i = 0; i < RAY_TYPE_COUNT; i++)
+	{
+		rays += values.rays[i];
+	}
+	double per_ray = rays ? 1.0 / double(rays) : .0;
+
+	printf("Rays: %llu", (unsigned long long)rays);
+	for (int i = 0; i < RAY_TYPE_COUNT; i++)
+	{
+		printf(", %s %llu", ray_type_names[i], (unsigned long long)values.rays[i]);
+	}
+	printf("\nHits: %llu (%.1f%% of rays)\n", (unsigned long long)values.hits, 100.0 * double(values.hits) * per_ray);
+	printf("Bvh nodes visited: %llu by single rays, %llu by packets, %.1f per ray\n", (unsigned long long)values.nodes_visited,
+		(unsigned long long)values.packet_nodes_visited, double(values.nodes_visited + values.packet_nodes_visited) * per_ray);
+	printf("Primitive tests:");
+	for (int i = 0; i < PRIMITIVE_TYPE_COUNT; i++)
+	{
+		printf("%s %s %llu (%.2f per ray)", i ? "," : "", primitive_type_names[i], (unsigned long long)values.primitive_tests[i],
+			double(values.primitive_tests[i]) * per_ray);
+	}
+
+	uint64_t paths = values.rays[RAY_CAMERA];
+	printf("\nAverage path length: %.2f segments\n", paths ? double(values.rays[RAY_CAMERA] + values.rays[RAY_BOUNCE]) / double(paths) : .0);
+	printf("Paths ended by:");
+	for (int i = 0; i < PATH_END_COUNT; i++)
+	{
+		printf("%s %s %.1f%%", i ? "," : "", path_end_names[i], paths ? 100.0 * double(values.path_ends[i]) / double(paths) : .0);
+	}
+	printf("\n");
+}
+
+#define RENDER_COUNT(counter) (render_counters.values.counter++)
+#define RENDER_COUNT_ADD(counter, amount) (render_counters.values.counter += (amount))
+
+#else
+
+#define RENDER_COUNT(counter)
+#define RENDER_COUNT_ADD(counter, amount)
+
+#endif
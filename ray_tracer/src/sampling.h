@@ -0,0 +1,210 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// Piecewise constant distributions for importance sampling tabulated functions, like the
+// brightness of an environment map.
+
+struct Distribution_1D
+{
+	std::vector<float> function;
+	std::vector<float> cdf; // function.size() + 1 entries, from 0 to 1
+	float integral;
+};
+
+struct Distribution_2D
+{
+	// one distribution along u for every row, and one over the rows
+	std::vector<Distribution_1D> conditional;
+	Distribution_1D marginal;
+};
+
+inline int
+clamp_index(int index, int count)
+{
+	if (index < 0) return 0;
+	if (index >= count) return count - 1;
+	return index;
+}
+
+inline void
+build_distribution(Distribution_1D& distribution, const float* function, int count)
+{
+	distribution.function.assign(function, function + count);
+	distribution.cdf.resize(count + 1);
+	distribution.cdf[0] = .0f;
+	for (int i = 0; i < count; i++)
+	{
+		distribution.cdf[i + 1] = distribution.cdf[i] + distribution.function[i] / float(count);
+	}
+
+	distribution.integral = distribution.cdf[count];
+	if (distribution.integral <= .0f)
+	{
+		// nothing to go by, sample uniformly
+		for (int i = 0; i <= count; i++)
+		{
+			distribution.cdf[i] = float(i) / float(count);
+		}
+	}
+	else
+	{
+		for (int i = 0; i <= count; i++)
+		{
+			distribution.cdf[i] /= distribution.integral;
+		}
+	}
+}
+
+inline int
+distribution_size(Distribution_1D& distribution)
+{
+	return int(distribution.function.size());
+}
+
+// Density of x in [0, 1) with respect to x.
+inline float
+distribution_pdf(Distribution_1D& distribution, float x)
+{
+	int count = distribution_size(distribution);
+	int offset = clamp_index(int(x * count), count);
+	if (distribution.integral <= .0f)
+	{
+		return 1.0f;
+	}
+	return distribution.function[offset] / distribution.integral;
+}
+
+// Maps a uniform u in [0, 1) to x in [0, 1) distributed like the function.
+inline float
+sample_distribution(Distribution_1D& distribution, float u, float& pdf, int& offset)
+{
+	int count = distribution_size(distribution);
+	offset = int(std::upper_bound(distribution.cdf.begin(), distribution.cdf.end(), u) - distribution.cdf.begin()) - 1;
+	offset = clamp_index(offset, count);
+
+	float width = distribution.cdf[offset + 1] - distribution.cdf[offset];
+	float du = width > .0f ? (u - distribution.cdf[offset]) / width : .0f;
+	pdf = distribution.integral > .0f ? distribution.function[offset] / distribution.integral : 1.0f;
+
+	return (float(offset) + du) / float(count);
+}
+
+// function holds width values for each of the height rows.
+inline void
+build_distribution(Distribution_2D& distribution, const float* function, int width, int height)
+{
+	distribution.conditional.resize(height);
+	std::vector<float> row_integrals(height);
+	for (int y = 0; y < height; y++)
+	{
+		build_distribution(distribution.conditional[y], function + y * width, width);
+		row_integrals[y] = distribution.conditional[y].integral;
+	}
+	build_distribution(distribution.marginal, row_integrals.data(), height);
+}
+
+// Density of (u, v) with respect to area in the unit square.
+inline float
+distribution_pdf(Distribution_2D& distribution, float u, float v)
+{
+	int height = int(distribution.conditional.size());
+	int row = clamp_index(int(v * height), height);
+	return distribution_pdf(distribution.marginal, v) * distribution_pdf(distribution.conditional[row], u);
+}
+
+inline void
+sample_distribution(Distribution_2D& distribution, float u1, float u2, float& u, float& v, float& pdf)
+{
+	float marginal_pdf = .0f;
+	float conditional_pdf = .0f;
+	int row = 0;
+	int column = 0;
+	v = sample_distribution(distribution.marginal, u2, marginal_pdf, row);
+	u = sample_distribution(distribution.conditional[row], u1, conditional_pdf, column);
+	pdf = marginal_pdf * conditional_pdf;
+}
+
+// Picks one of n items with probability proportional to its weight in constant time (Vose's
+// alias method). Every entry keeps its own item with probability and the alias otherwise.
+struct Alias_Table
+{
+	std::vector<float> probability;
+	std::vector<int> alias;
+	std::vector<float> pmf;
+};
+
+inline void
+build_alias_table(Alias_Table& table, const float* weights, int count)
+{
+	table.probability.assign(count, 1.0f);
+	table.alias.resize(count);
+	table.pmf.resize(count);
+
+	double total = .0;
+	for (int i = 0; i < count; i++)
+	{
+		total += weights[i];
+	}
+
+	std::vector<double> scaled(count);
+	std::vector<int> small;
+	std::vector<int> large;
+	for (int i = 0; i < count; i++)
+	{
+		table.pmf[i] = total > .0 ? float(weights[i] / total) : 1.0f / float(count);
+		table.alias[i] = i;
+		scaled[i] = total > .0 ? weights[i] * count / total : 1.0;
+		if (scaled[i] < 1.0)
+		{
+			small.push_back(i);
+		}
+		else
+		{
+			large.push_back(i);
+		}
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		int under = small.back();
+		small.pop_back();
+		int over = large.back();
+
+		table.probability[under] = float(scaled[under]);
+		table.alias[under] = over;
+
+		scaled[over] -= 1.0 - scaled[under];
+		if (scaled[over] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(over);
+		}
+	}
+	// whatever is left is 1 up to rounding and keeps probability 1
+}
+
+inline int
+sample_alias_table(Alias_Table& table, float u, float& pmf)
+{
+	int count = int(table.probability.size());
+	float scaled = u * float(count);
+	int index = clamp_index(int(scaled), count);
+	if (scaled - float(index) >= table.probability[index])
+	{
+		index = table.alias[index];
+	}
+	pmf = table.pmf[index];
+	return index;
+}
+
+// Weight of a sample taken with pdf when the same direction could also have been taken with
+// other_pdf by another strategy (multiple importance sampling).
+inline float
+power_heuristic(float pdf, float other_pdf)
+{
+	float a = pdf * pdf;
+	float b = other_pdf * other_pdf;
+	return a + b > .0f ? a / (a + b) : .0f;
+}
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Reports of whole frames rendered with fixed settings and seed, so two revisions can be compared
+// scene by scene. A report is written as JSON or CSV depending on the file extension, and a CSV
+// report can be read back as the baseline of a later run, which flags every scene that got slower
+// by more than a threshold.
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+struct Scene_Benchmark_Result
+{
+	std::string name;
+	int width;
+	int height;
+	int samples_per_pixel;
+	int ray_depth;
+	uint64_t seed;
+
+	double load_ms;
+	double build_ms;
+	double estimate_ms;
+	double render_ms;
+	double write_ms;
+	double total_ms;
+
+	uint64_t samples;
+	uint64_t bounces;
+	uint64_t rays;
+	double rays_per_second;
+	uint64_t peak_memory; // bytes
+	uint64_t image_hash;
+	uint64_t objects;
+
+	// read cache events of the render, 0 where the hardware counters aren't available
+	uint64_t l2_requests;
+	uint64_t llc_references;
+	uint64_t llc_misses;
+};
+
+// Starts a new peak so the next read covers one scene only. Linux can reset the high water mark,
+// Windows can't and reports the peak of the whole process instead.
+inline void
+reset_peak_memory()
+{
+#ifdef __linux__
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd >= 0)
+	{
+		ssize_t written = write(fd, "5", 1);
+		(void)written;
+		close(fd);
+	}
+#endif
+}
+
+// Peak resident memory in bytes, 0 when unknown.
+inline uint64_t
+get_peak_memory()
+{
+	uint64_t result = 0;
+#ifdef __linux__
+	FILE* f = fopen("/proc/self/status", "rb");
+	if (f)
+	{
+		char line[256];
+		while (fgets(line, sizeof(line), f))
+		{
+			if (strncmp(line, "VmHWM:", 6) == 0)
+			{
+				result = strtoull(line + 6, nullptr, 10) * 1024;
+				break;
+			}
+		}
+		fclose(f);
+	}
+#elif defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters = {};
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		result = counters.PeakWorkingSetSize;
+	}
+#endif
+	return result;
+}
+
+// Scene names can be file names, which may have commas, quotes or worse in them.
+inline void
+write_csv_field(FILE* f, const std::string& text)
+{
+	if (text.find_first_of(",\"\r\n") == std::string::npos)
+	{
+		fputs(text.c_str(), f);
+		return;
+	}
+	fputc('"', f);
+	for (char c : text)
+	{
+		if (c == '"')
+		{
+			fputc('"', f);
+		}
+		fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+inline void
+write_json_string(FILE* f, const std::string& text)
+{
+	fputc('"', f);
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			fprintf(f, "\\%c", c);
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			fprintf(f, "\\u%04x", (unsigned char)c);
+		}
+		else
+		{
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+// Reads a field written by write_csv_field and the comma after it, null when the line ends first.
+inline const char*
+read_csv_field(const char* at, std::string& text)
+{
+	text.clear();
+	if (*at == '"')
+	{
+		for (at++; *at; at++)
+		{
+			if (*at == '"')
+			{
+				if (at[1] != '"')
+				{
+					break;
+				}
+				at++;
+			}
+			text += *at;
+		}
+		if (*at != '"')
+		{
+			return nullptr;
+		}
+		at++;
+	}
+	else
+	{
+		while (*at && *at != ',' && *at != '\r' && *at != '\n')
+		{
+			text += *at++;
+		}
+	}
+	return *at == ',' ? at + 1 : nullptr;
+}
+
+static const char* scene_benchmark_csv_header =
+	"scene,width,height,samples_per_pixel,ray_depth,seed,load_ms,build_ms,estimate_ms,render_ms,write_ms,total_ms,"
+	"samples,bounces,rays,rays_per_second,peak_memory,image_hash,objects,l2_requests,llc_references,llc_misses\n";
+
+inline void
+write_scene_benchmark_csv(FILE* f, std::vector<Scene_Benchmark_Result>& results)
+{
+	fputs(scene_benchmark_csv_header, f);
+	for (auto& result : results)
+	{
+		write_csv_field(f, result.name);
+		fprintf(f, ",%d,%d,%d,%d,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%llu,%.0f,%llu,%016llx,%llu,%llu,%llu,%llu\n",
+			result.width, result.height, result.samples_per_pixel, result.ray_depth,
+			(unsigned long long)result.seed, result.load_ms, result.build_ms, result.estimate_ms, result.render_ms,
+			result.write_ms, result.total_ms, (unsigned long long)result.samples, (unsigned long long)result.bounces,
+			(unsigned long long)result.rays, result.rays_per_second, (unsigned long long)result.peak_memory,
+			(unsigned long long)result.image_hash, (unsigned long long)result.objects, (unsigned long long)result.l2_requests,
+			(unsigned long long)result.llc_references, (unsigned long long)result.llc_misses);
+	}
+}
+
+inline void
+write_scene_benchmark_json(FILE* f, std::vector<Scene_Benchmark_Result>& results)
+{
+	fprintf(f, "{\n\t\"scenes\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		Scene_Benchmark_Result& result = results[i];
+		fprintf(f, "\t\t{\n");
+		fprintf(f, "\t\t\t\"scene\": ");
+		write_json_string(f, result.name);
+		fprintf(f, ", \"objects\": %llu,\n", (unsigned long long)result.objects);
+		fprintf(f, "\t\t\t\"width\": %d, \"height\": %d, \"samples_per_pixel\": %d, \"ray_depth\": %d, \"seed\": %llu,\n",
+			result.width, result.height, result.samples_per_pixel, result.ray_depth, (unsigned long long)result.seed);
+		fprintf(f, "\t\t\t\"phases_ms\": { \"load\": %.3f, \"build\": %.3f, \"estimate\": %.3f, \"render\": %.3f, \"write\": %.3f },\n",
+			result.load_ms, result.build_ms, result.estimate_ms, result.render_ms, result.write_ms);
+		fprintf(f, "\t\t\t\"total_ms\": %.3f,\n", result.total_ms);
+		fprintf(f, "\t\t\t\"samples\": %llu, \"bounces\": %llu, \"rays\": %llu, \"rays_per_second\": %.0f,\n",
+			(unsigned long long)result.samples, (unsigned long long)result.bounces, (unsigned long long)result.rays,
+			result.rays_per_second);
+		fprintf(f, "\t\t\t\"peak_memory\": %llu,\n", (unsigned long long)result.peak_memory);
+		fprintf(f, "\t\t\t\"cache\": { \"l2_requests\": %llu, \"llc_references\": %llu, \"llc_misses\": %llu },\n",
+			(unsigned long long)result.l2_requests, (unsigned long long)result.llc_references, (unsigned long long)result.llc_misses);
+		fprintf(f, "\t\t\t\"image_hash\": \"%016llx\"\n", (unsigned long long)result.image_hash);
+		fprintf(f, "\t\t}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+}
+
+// Writes JSON when the file name ends in .json and CSV otherwise.
+inline bool
+write_scene_benchmark_report(const char* file_name, std::vector<Scene_Benchmark_Result>& results)
+{
+	FILE* f = fopen(file_name, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Could not write the benchmark report to '%s'.\n", file_name);
+		return false;
+	}
+
+	size_t length = strlen(file_name);
+	if (length >= 5 && strcmp(file_name + length - 5, ".json") == 0)
+	{
+		write_scene_benchmark_json(f, results);
+	}
+	else
+	{
+		write_scene_benchmark_csv(f, results);
+	}
+	fclose(f);
+	return true;
+}
+
+// Reads a report written by write_scene_benchmark_csv.
+inline bool
+read_scene_benchmark_csv(const char* file_name, std::vector<Scene_Benchmark_Result>& results)
+{
+	FILE* f = fopen(file_name, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Could not read the baseline '%s'.\n", file_name);
+		return false;
+	}
+
+	char line[4096];
+	bool header = true;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (header)
+		{
+			header = false;
+			continue;
+		}
+
+		std::string name;
+		const char* fields_at = read_csv_field(line, name);
+		if (!fields_at)
+		{
+			continue;
+		}
+
+		unsigned long long seed = 0, samples = 0, bounces = 0, rays = 0, peak_memory = 0, image_hash = 0, objects = 0;
+		unsigned long long l2_requests = 0, llc_references = 0, llc_misses = 0;
+		Scene_Benchmark_Result result = {};
+		int fields = sscanf(fields_at, "%d,%d,%d,%d,%llu,%lf,%lf,%lf,%lf,%lf,%lf,%llu,%llu,%llu,%lf,%llu,%llx,%llu,%llu,%llu,%llu",
+			&result.width, &result.height, &result.samples_per_pixel, &result.ray_depth, &seed,
+			&result.load_ms, &result.build_ms, &result.estimate_ms, &result.render_ms, &result.write_ms, &result.total_ms,
+			&samples, &bounces, &rays, &result.rays_per_second, &peak_memory, &image_hash, &objects,
+			&l2_requests, &llc_references, &llc_misses);
+		// reports from before the object count have one field less, those from before the cache counters
+		// leave them at 0
+		if (fields < 17)
+		{
+			continue;
+		}
+
+		result.name = name;
+		result.seed = seed;
+		result.samples = samples;
+		result.bounces = bounces;
+		result.rays = rays;
+		result.peak_memory = peak_memory;
+		result.image_hash = image_hash;
+		result.objects = objects;
+		result.l2_requests = l2_requests;
+		result.llc_references = llc_references;
+		result.llc_misses = llc_misses;
+		results.push_back(result);
+	}
+	fclose(f);
+	return true;
+}
+
+// Relative change in percent, positive when the current value is larger.
+inline double
+percent_change(double baseline, double current)
+{
+	return baseline > .0 ? (current - baseline) / baseline * 100.0 : .0;
+}
+
+// Prints every scene next to its baseline and returns how many scenes regressed. A scene regresses
+// when its render time, load or build time or peak memory grew, or its rays per second dropped, by
+// more than threshold percent. Load and build of small scenes take a few milliseconds and are
+// mostly noise, so they also have to be 5 ms slower to count. The change in L2 requests and LLC misses
+// is shown to compare traversal orders but never counts as a regression, it depends on the machine
+// and is blank when either run had no counters.
+inline int
+compare_scene_benchmarks(std::vector<Scene_Benchmark_Result>& results, std::vector<Scene_Benchmark_Result>& baseline, double threshold)
+{
+	const double phase_noise_ms = 5.0;
+
+	int regressions = 0;
+	printf("\n%-20s %12s %12s %9s %12s %9s %9s %9s %9s %9s %9s\n", "scene", "render ms", "baseline", "change", "Mrays/s", "change", "load", "build", "memory",
+		"L2 req", "LLC miss");
+	for (auto& result : results)
+	{
+		Scene_Benchmark_Result* base = nullptr;
+		for (auto& candidate : baseline)
+		{
+			if (candidate.name == result.name)
+			{
+				base = &candidate;
+				break;
+			}
+		}
+
+		if (!base)
+		{
+			printf("%-20s %12.1f   no baseline\n", result.name.c_str(), result.render_ms);
+			continue;
+		}
+		if (base->width != result.width || base->samples_per_pixel != result.samples_per_pixel ||
+			base->ray_depth != result.ray_depth || base->seed != result.seed)
+		{
+			printf("%-20s %12.1f   baseline rendered with other settings, not compared\n", result.name.c_str(), result.render_ms);
+			continue;
+		}
+
+		double render_change = percent_change(base->render_ms, result.render_ms);
+		double rays_change = percent_change(base->rays_per_second, result.rays_per_second);
+		double load_change = percent_change(base->load_ms, result.load_ms);
+		double build_change = percent_change(base->build_ms, result.build_ms);
+		double memory_change = percent_change(double(base->peak_memory), double(result.peak_memory));
+
+		bool render_regressed = render_change > threshold;
+		bool rays_regressed = -rays_change > threshold;
+		bool load_regressed = load_change > threshold && result.load_ms - base->load_ms > phase_noise_ms;
+		bool build_regressed = build_change > threshold && result.build_ms - base->build_ms > phase_noise_ms;
+		bool memory_regressed = memory_change > threshold;
+
+		char cache_changes[32];
+		if (base->l2_requests && result.l2_requests && base->llc_misses && result.llc_misses)
+		{
+			snprintf(cache_changes, sizeof(cache_changes), " %+8.1f%% %+8.1f%%", percent_change(double(base->l2_requests), double(result.l2_requests)),
+				percent_change(double(base->llc_misses), double(result.llc_misses)));
+		}
+		else
+		{
+			snprintf(cache_changes, sizeof(cache_changes), " %9s %9s", "-", "-");
+		}
+
+		std::string flags;
+		if (render_regressed) flags += " RENDER";
+		if (rays_regressed) flags += " RAYS/S";
+		if (load_regressed) flags += " LOAD";
+		if (build_regressed) flags += " BUILD";
+		if (memory_regressed) flags += " MEMORY";
+		// not a regression, but the timings compare different work
+		if (base->image_hash != result.image_hash) flags += " (image changed)";
+
+		printf("%-20s %12.1f %12.1f %+8.1f%% %12.2f %+8.1f%% %+8.1f%% %+8.1f%% %+8.1f%%%s%s\n",
+			result.name.c_str(), result.render_ms, base->render_ms, render_change, result.rays_per_second / 1e6, rays_change,
+			load_change, build_change, memory_change, cache_changes, flags.c_str());
+
+		if (render_regressed || rays_regressed || load_regressed || build_regressed || memory_regressed)
+		{
+			regressions++;
+		}
+	}
+
+	if (regressions)
+	{
+		printf("\n%d scene(s) regressed by more than %.1f%%.\n", regressions, threshold);
+	}
+	else
+	{
+		printf("\nNo regressions beyond %.1f%%.\n", threshold);
+	}
+	return regressions;
+}
@@ -0,0 +1,1205 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "bvh.h"
+#include "asset_loader.h"
+
+// Scenes described in a file instead of in generate_world. The text form (.scene) is one statement
+// per line, read in a single pass, names have to be defined before they are used:
+//
+//   # comment
+//   render width 1280 height 720 spp 64 depth 8        any of the pairs, the rest is up to the renderer
+//   camera look_from 0 1 5 look_at 0 0 0 up 0 1 0 fov 60 aperture .2 focus 10
+//   background .7 .8 1
+//   environment sky.hdr                                lat-long map, lights the scene
+//   environment_cube skybox .jpg 2048                  or a cube map, see load_cube_environment
+//   texture <name> solid r g b
+//   texture <name> checker r g b r g b
+//   texture <name> image earth.jpg                     earth.rtex instead when there is one
+//   material <name> lambertian r g b | lambertian <texture>
+//   material <name> metal r g b fuzz
+//   material <name> dielectric index_of_refraction
+//   material <name> light r g b | light <texture>
+//   sphere x y z radius <material>
+//   plane nx ny nz d <material>
+//   triangle x y z x y z x y z <material>
+//   mesh suzanne.obj <material> [x y z]                triangles added to the world, moved by x y z
+//   instanced_mesh <name> suzanne.obj <material>       one bvh shared by all its instances
+//   instance <instanced_mesh> x y z scale
+//
+// Names start with a letter, files with spaces go in double quotes and relative files are found
+// next to the scene file.
+//
+// The binary form (.rscn, made with "ray_tracer compile-scene") holds the same records the text
+// is parsed into, so it is read with a copy per section:
+//   Scene_File_Header
+//   sections, each an array of records starting at an 8 byte aligned offset
+// The first byte of the strings section is always 0, string offset 0 is the empty string.
+// Compiling reads the OBJ files of the meshes into the mesh triangles section, so loading the
+// binary form never parses text. The mesh files are only kept for the error messages.
+
+#define SCENE_FILE_MAGIC 0x4E435352 // "RSCN"
+#define SCENE_FILE_VERSION 2
+
+enum Scene_Texture_Type
+{
+	SCENE_TEXTURE_SOLID,
+	SCENE_TEXTURE_CHECKER,
+	SCENE_TEXTURE_IMAGE,
+};
+
+enum Scene_Material_Type
+{
+	SCENE_MATERIAL_LAMBERTIAN,
+	SCENE_MATERIAL_METAL,
+	SCENE_MATERIAL_DIELECTRIC,
+	SCENE_MATERIAL_LIGHT,
+};
+
+enum Scene_Section
+{
+	SCENE_SECTION_STRINGS,
+	SCENE_SECTION_TEXTURES,
+	SCENE_SECTION_MATERIALS,
+	SCENE_SECTION_SPHERES,
+	SCENE_SECTION_PLANES,
+	SCENE_SECTION_TRIANGLES,
+	SCENE_SECTION_MESHES,
+	SCENE_SECTION_INSTANCES,
+	SCENE_SECTION_MESH_TRIANGLES,
+
+	SCENE_SECTION_COUNT,
+};
+
+// Everything in a scene besides its objects. Plain floats so the layout is the same with and
+// without USE_SIMD_VECTORS.
+struct Scene_Options
+{
+	float look_from[3];
+	float look_at[3];
+	float up[3];
+	float y_fov_degrees;
+	float aperture;
+	float focus_distance;
+	// 0 where the scene leaves them to the renderer
+	int32_t width;
+	int32_t height;
+	int32_t samples_per_pixel;
+	int32_t ray_depth;
+	float background[3];
+	// strings, a cube map when environment_width isn't 0
+	uint32_t environment_file;
+	uint32_t environment_extension;
+	int32_t environment_width;
+};
+
+struct Scene_Texture
+{
+	int32_t type;
+	// string, for images
+	uint32_t file;
+	float colors[2][3];
+};
+
+struct Scene_Material
+{
+	int32_t type;
+	// used instead of color when it isn't -1
+	int32_t texture;
+	float color[3];
+	// fuzz of metals, index of refraction of dielectrics
+	float parameter;
+};
+
+struct Scene_Sphere
+{
+	float center[3];
+	float radius;
+	int32_t material;
+};
+
+struct Scene_Plane
+{
+	float normal[3];
+	float d;
+	int32_t material;
+};
+
+struct Scene_Triangle
+{
+	float vertices[3][3];
+	int32_t material;
+};
+
+struct Scene_Mesh
+{
+	// string
+	uint32_t file;
+	int32_t material;
+	float offset[3];
+	// meshes that aren't instanced go into the world, moved by offset
+	int32_t instanced;
+	// compiled meshes are triangle_count triangles of the mesh triangles section instead of the file
+	int32_t embedded;
+	uint32_t first_triangle;
+	uint32_t triangle_count;
+};
+
+struct Scene_Mesh_Triangle
+{
+	float vertices[3][3];
+};
+
+struct Scene_Instance
+{
+	int32_t mesh;
+	float offset[3];
+	float scale;
+};
+
+struct Scene_File_Section
+{
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct Scene_File_Header
+{
+	uint32_t magic;
+	uint32_t version;
+	Scene_File_Section sections[SCENE_SECTION_COUNT];
+	Scene_Options options;
+};
+
+static const size_t scene_record_sizes[SCENE_SECTION_COUNT] =
+{
+	sizeof(char),
+	sizeof(Scene_Texture),
+	sizeof(Scene_Material),
+	sizeof(Scene_Sphere),
+	sizeof(Scene_Plane),
+	sizeof(Scene_Triangle),
+	sizeof(Scene_Mesh),
+	sizeof(Scene_Instance),
+	sizeof(Scene_Mesh_Triangle),
+};
+
+struct Scene_Description
+{
+	Scene_Options options;
+	std::vector<char> strings;
+	std::vector<Scene_Texture> textures;
+	std::vector<Scene_Material> materials;
+	std::vector<Scene_Sphere> spheres;
+	std::vector<Scene_Plane> planes;
+	std::vector<Scene_Triangle> triangles;
+	std::vector<Scene_Mesh> meshes;
+	std::vector<Scene_Instance> instances;
+	std::vector<Scene_Mesh_Triangle> mesh_triangles;
+};
+
+// The camera the hand built worlds are seen from, the rest left to the renderer.
+inline Scene_Options
+default_scene_options()
+{
+	Scene_Options options = {};
+	options.look_from[1] = 1.0f;
+	options.look_from[2] = 5.0f;
+	options.up[1] = 1.0f;
+	options.y_fov_degrees = 60.0f;
+	options.aperture = .2f;
+	options.focus_distance = 10.0f;
+	options.background[0] = .7f;
+	options.background[1] = .8f;
+	options.background[2] = 1.0f;
+	return options;
+}
+
+inline v3f
+scene_v3f(const float* f)
+{
+	return v3f{ f[0], f[1], f[2] };
+}
+
+inline uint32_t
+add_scene_string(Scene_Description& scene, const char* text, size_t length)
+{
+	if (scene.strings.empty())
+	{
+		scene.strings.push_back('\0');
+	}
+	uint32_t offset = uint32_t(scene.strings.size());
+	scene.strings.insert(scene.strings.end(), text, text + length);
+	scene.strings.push_back('\0');
+	return offset;
+}
+
+inline const char*
+get_scene_string(Scene_Description& scene, uint32_t offset)
+{
+	return scene.strings.empty() ? "" : scene.strings.data() + offset;
+}
+
+//
+// Text
+//
+
+struct Scene_Parser
+{
+	const char* file_name;
+	const char* at;
+	int line;
+	bool failed;
+	Scene_Description* scene;
+	std::unordered_map<std::string, int> textures;
+	std::unordered_map<std::string, int> materials;
+	std::unordered_map<std::string, int> instanced_meshes;
+	// objects mostly come in runs of the same material
+	std::string last_material;
+	int last_material_index;
+};
+
+inline void
+scene_error(Scene_Parser& parser, const char* message, const char* name = "")
+{
+	if (!parser.failed)
+	{
+		fprintf(stderr, "ERROR: %s:%d: %s%s\n", parser.file_name, parser.line, message, name);
+	}
+	parser.failed = true;
+}
+
+inline void
+skip_scene_spaces(Scene_Parser& parser)
+{
+	while (*parser.at == ' ' || *parser.at == '\t' || *parser.at == '\r')
+	{
+		parser.at++;
+	}
+	if (*parser.at == '#')
+	{
+		while (*parser.at && *parser.at != '\n')
+		{
+			parser.at++;
+		}
+	}
+}
+
+inline bool
+at_scene_line_end(Scene_Parser& parser)
+{
+	skip_scene_spaces(parser);
+	return *parser.at == '\n' || *parser.at == '\0';
+}
+
+// The next word of the line, or the text between double quotes, empty at the end of the line.
+inline bool
+next_scene_token(Scene_Parser& parser, const char*& token, size_t& length)
+{
+	skip_scene_spaces(parser);
+	if (*parser.at == '"')
+	{
+		token = ++parser.at;
+		while (*parser.at && *parser.at != '"' && *parser.at != '\n')
+		{
+			parser.at++;
+		}
+		length = size_t(parser.at - token);
+		if (*parser.at != '"')
+		{
+			scene_error(parser, "missing closing quote");
+			return false;
+		}
+		parser.at++;
+		return true;
+	}
+
+	token = parser.at;
+	while (*parser.at && *parser.at != ' ' && *parser.at != '\t' && *parser.at != '\r' && *parser.at != '\n')
+	{
+		parser.at++;
+	}
+	length = size_t(parser.at - token);
+	return length > 0;
+}
+
+inline bool
+scene_token_is(const char* token, size_t length, const char* word)
+{
+	return strlen(word) == length && memcmp(token, word, length) == 0;
+}
+
+inline bool
+next_scene_is_number(Scene_Parser& parser)
+{
+	skip_scene_spaces(parser);
+	char c = *parser.at;
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+}
+
+// True when a number parsed up to end fills its whole token.
+inline bool
+scene_number_ends(Scene_Parser& parser, const char* end)
+{
+	return end != parser.at && (!*end || *end == ' ' || *end == '\t' || *end == '\r' || *end == '\n');
+}
+
+// strtof also reads inf and nan, and too large numbers come back as inf, none of which a scene can use.
+inline float
+parse_scene_float(Scene_Parser& parser)
+{
+	skip_scene_spaces(parser);
+	char* end = nullptr;
+	float value = strtof(parser.at, &end);
+	if (!scene_number_ends(parser, end))
+	{
+		scene_error(parser, "expected a number");
+		return .0f;
+	}
+	parser.at = end;
+	if (!isfinite(value))
+	{
+		scene_error(parser, "number is not finite or out of range");
+		return .0f;
+	}
+	return value;
+}
+
+inline void
+parse_scene_floats(Scene_Parser& parser, float* values, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		values[i] = parse_scene_float(parser);
+	}
+}
+
+inline int32_t
+parse_scene_int(Scene_Parser& parser)
+{
+	skip_scene_spaces(parser);
+	char* end = nullptr;
+	errno = 0;
+	long long value = strtoll(parser.at, &end, 10);
+	if (!scene_number_ends(parser, end))
+	{
+		scene_error(parser, "expected a whole number");
+		return 0;
+	}
+	parser.at = end;
+	if (errno == ERANGE || value < INT32_MIN || value > INT32_MAX)
+	{
+		scene_error(parser, "number out of range");
+		return 0;
+	}
+	return int32_t(value);
+}
+
+inline std::string
+parse_scene_name(Scene_Parser& parser)
+{
+	const char* token;
+	size_t length;
+	if (!next_scene_token(parser, token, length) || !((*token >= 'a' && *token <= 'z') || (*token >= 'A' && *token <= 'Z')))
+	{
+		scene_error(parser, "expected a name starting with a letter");
+		return std::string();
+	}
+	return std::string(token, length);
+}
+
+inline int
+find_scene_name(Scene_Parser& parser, std::unordered_map<std::string, int>& names, std::string& name, const char* kind)
+{
+	auto found = names.find(name);
+	if (found == names.end())
+	{
+		if (!name.empty())
+		{
+			fprintf(stderr, "ERROR: %s:%d: unknown %s '%s'\n", parser.file_name, parser.line, kind, name.c_str());
+		}
+		parser.failed = true;
+		return -1;
+	}
+	return found->second;
+}
+
+inline int32_t
+parse_scene_material(Scene_Parser& parser)
+{
+	const char* token;
+	size_t length;
+	if (!next_scene_token(parser, token, length))
+	{
+		scene_error(parser, "expected a material");
+		return -1;
+	}
+	if (parser.last_material_index >= 0 && scene_token_is(token, length, parser.last_material.c_str()))
+	{
+		return parser.last_material_index;
+	}
+	std::string name(token, length);
+	int index = find_scene_name(parser, parser.materials, name, "material");
+	parser.last_material = name;
+	parser.last_material_index = index;
+	return index;
+}
+
+inline uint32_t
+parse_scene_file_name(Scene_Parser& parser)
+{
+	const char* token;
+	size_t length;
+	if (!next_scene_token(parser, token, length))
+	{
+		scene_error(parser, "expected a file name");
+		return 0;
+	}
+	return add_scene_string(*parser.scene, token, length);
+}
+
+inline void
+define_scene_name(Scene_Parser& parser, std::unordered_map<std::string, int>& names, std::string& name, int index)
+{
+	if (!names.emplace(name, index).second)
+	{
+		scene_error(parser, "defined twice: ", name.c_str());
+	}
+}
+
+// A color or the name of a texture, for lambertians and lights.
+inline void
+parse_scene_albedo(Scene_Parser& parser, Scene_Material& material)
+{
+	material.texture = -1;
+	if (next_scene_is_number(parser))
+	{
+		parse_scene_floats(parser, material.color, 3);
+	}
+	else
+	{
+		std::string name = parse_scene_name(parser);
+		material.texture = find_scene_name(parser, parser.textures, name, "texture");
+	}
+}
+
+// The key value pairs of the camera and render statements, which take each other's keys.
+inline void
+parse_scene_settings(Scene_Parser& parser, Scene_Options& options)
+{
+	const char* key;
+	size_t key_length;
+	while (!parser.failed && !at_scene_line_end(parser) && next_scene_token(parser, key, key_length))
+	{
+		if (scene_token_is(key, key_length, "look_from")) parse_scene_floats(parser, options.look_from, 3);
+		else if (scene_token_is(key, key_length, "look_at")) parse_scene_floats(parser, options.look_at, 3);
+		else if (scene_token_is(key, key_length, "up")) parse_scene_floats(parser, options.up, 3);
+		else if (scene_token_is(key, key_length, "fov")) options.y_fov_degrees = parse_scene_float(parser);
+		else if (scene_token_is(key, key_length, "aperture")) options.aperture = parse_scene_float(parser);
+		else if (scene_token_is(key, key_length, "focus")) options.focus_distance = parse_scene_float(parser);
+		else if (scene_token_is(key, key_length, "width")) options.width = parse_scene_int(parser);
+		else if (scene_token_is(key, key_length, "height")) options.height = parse_scene_int(parser);
+		else if (scene_token_is(key, key_length, "spp")) options.samples_per_pixel = parse_scene_int(parser);
+		else if (scene_token_is(key, key_length, "depth")) options.ray_depth = parse_scene_int(parser);
+		else scene_error(parser, "unknown setting: ", std::string(key, key_length).c_str());
+	}
+}
+
+inline void
+parse_scene_statement(Scene_Parser& parser, const char* keyword, size_t length)
+{
+	Scene_Description& scene = *parser.scene;
+	Scene_Options& options = scene.options;
+
+	if (scene_token_is(keyword, length, "sphere"))
+	{
+		Scene_Sphere sphere;
+		parse_scene_floats(parser, sphere.center, 3);
+		sphere.radius = parse_scene_float(parser);
+		sphere.material = parse_scene_material(parser);
+		scene.spheres.push_back(sphere);
+	}
+	else if (scene_token_is(keyword, length, "triangle"))
+	{
+		Scene_Triangle triangle;
+		parse_scene_floats(parser, &triangle.vertices[0][0], 9);
+		triangle.material = parse_scene_material(parser);
+		scene.triangles.push_back(triangle);
+	}
+	else if (scene_token_is(keyword, length, "instance"))
+	{
+		Scene_Instance instance;
+		std::string name = parse_scene_name(parser);
+		instance.mesh = find_scene_name(parser, parser.instanced_meshes, name, "instanced mesh");
+		parse_scene_floats(parser, instance.offset, 3);
+		instance.scale = parse_scene_float(parser);
+		scene.instances.push_back(instance);
+	}
+	else if (scene_token_is(keyword, length, "plane"))
+	{
+		Scene_Plane plane;
+		parse_scene_floats(parser, plane.normal, 3);
+		plane.d = parse_scene_float(parser);
+		plane.material = parse_scene_material(parser);
+		scene.planes.push_back(plane);
+	}
+	else if (scene_token_is(keyword, length, "mesh") || scene_token_is(keyword, length, "instanced_mesh"))
+	{
+		Scene_Mesh mesh = {};
+		mesh.instanced = scene_token_is(keyword, length, "instanced_mesh");
+		std::string name = mesh.instanced ? parse_scene_name(parser) : std::string();
+		mesh.file = parse_scene_file_name(parser);
+		mesh.material = parse_scene_material(parser);
+		if (!mesh.instanced && !at_scene_line_end(parser))
+		{
+			parse_scene_floats(parser, mesh.offset, 3);
+		}
+		if (mesh.instanced)
+		{
+			define_scene_name(parser, parser.instanced_meshes, name, int(scene.meshes.size()));
+		}
+		scene.meshes.push_back(mesh);
+	}
+	else if (scene_token_is(keyword, length, "material"))
+	{
+		std::string name = parse_scene_name(parser);
+		const char* type;
+		size_t type_length;
+		next_scene_token(parser, type, type_length);
+
+		Scene_Material material = {};
+		material.texture = -1;
+		if (scene_token_is(type, type_length, "lambertian"))
+		{
+			material.type = SCENE_MATERIAL_LAMBERTIAN;
+			parse_scene_albedo(parser, material);
+		}
+		else if (scene_token_is(type, type_length, "metal"))
+		{
+			material.type = SCENE_MATERIAL_METAL;
+			parse_scene_floats(parser, material.color, 3);
+			material.parameter = parse_scene_float(parser);
+		}
+		else if (scene_token_is(type, type_length, "dielectric"))
+		{
+			material.type = SCENE_MATERIAL_DIELECTRIC;
+			material.parameter = parse_scene_float(parser);
+		}
+		else if (scene_token_is(type, type_length, "light"))
+		{
+			material.type = SCENE_MATERIAL_LIGHT;
+			parse_scene_albedo(parser, material);
+		}
+		else
+		{
+			scene_error(parser, "unknown material type, use lambertian, metal, dielectric or light");
+		}
+		define_scene_name(parser, parser.materials, name, int(scene.materials.size()));
+		scene.materials.push_back(material);
+	}
+	else if (scene_token_is(keyword, length, "texture"))
+	{
+		std::string name = parse_scene_name(parser);
+		const char* type;
+		size_t type_length;
+		next_scene_token(parser, type, type_length);
+
+		Scene_Texture texture = {};
+		if (scene_token_is(type, type_length, "solid"))
+		{
+			texture.type = SCENE_TEXTURE_SOLID;
+			parse_scene_floats(parser, texture.colors[0], 3);
+		}
+		else if (scene_token_is(type, type_length, "checker"))
+		{
+			texture.type = SCENE_TEXTURE_CHECKER;
+			parse_scene_floats(parser, &texture.colors[0][0], 6);
+		}
+		else if (scene_token_is(type, type_length, "image"))
+		{
+			texture.type = SCENE_TEXTURE_IMAGE;
+			texture.file = parse_scene_file_name(parser);
+		}
+		else
+		{
+			scene_error(parser, "unknown texture type, use solid, checker or image");
+		}
+		define_scene_name(parser, parser.textures, name, int(scene.textures.size()));
+		scene.textures.push_back(texture);
+	}
+	else if (scene_token_is(keyword, length, "camera") || scene_token_is(keyword, length, "render"))
+	{
+		parse_scene_settings(parser, options);
+	}
+	else if (scene_token_is(keyword, length, "background"))
+	{
+		parse_scene_floats(parser, options.background, 3);
+	}
+	else if (scene_token_is(keyword, length, "environment"))
+	{
+		options.environment_file = parse_scene_file_name(parser);
+		options.environment_width = 0;
+	}
+	else if (scene_token_is(keyword, length, "environment_cube"))
+	{
+		options.environment_file = parse_scene_file_name(parser);
+		options.environment_extension = parse_scene_file_name(parser);
+		options.environment_width = parse_scene_int(parser);
+		if (options.environment_width < 1)
+		{
+			scene_error(parser, "the cube map needs a width");
+		}
+	}
+	else
+	{
+		scene_error(parser, "unknown statement: ", std::string(keyword, length).c_str());
+	}
+
+	if (!at_scene_line_end(parser))
+	{
+		scene_error(parser, "unexpected text at the end of the line");
+	}
+}
+
+// text must end with a 0.
+inline bool
+parse_scene_text(const char* file_name, const char* text, Scene_Description& scene)
+{
+	scene = {};
+	scene.options = default_scene_options();
+	add_scene_string(scene, "", 0);
+
+	Scene_Parser parser = {};
+	parser.file_name = file_name;
+	parser.at = text;
+	parser.line = 1;
+	parser.scene = &scene;
+	parser.last_material_index = -1;
+
+	while (*parser.at && !parser.failed)
+	{
+		const char* keyword;
+		size_t length;
+		if (next_scene_token(parser, keyword, length))
+		{
+			parse_scene_statement(parser, keyword, length);
+		}
+		if (*parser.at == '\n')
+		{
+			parser.at++;
+			parser.line++;
+		}
+	}
+	return !parser.failed;
+}
+
+// Settings in the form of the camera and render statements on one line, "look_from 0 2 6 fov 40",
+// over those of a scene. Errors are reported against name and line.
+inline bool
+parse_scene_options(const char* name, const char* text, Scene_Options& options, int line = 1)
+{
+	Scene_Parser parser = {};
+	parser.file_name = name;
+	parser.at = text;
+	parser.line = line;
+	parse_scene_settings(parser, options);
+	if (!parser.failed && !at_scene_line_end(parser))
+	{
+		scene_error(parser, "unexpected text at the end of the line");
+	}
+	return !parser.failed;
+}
+
+inline bool
+read_scene_text(const char* file_name, Scene_Description& scene)
+{
+	FILE* f = fopen(file_name, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: Could not open scene file '%s'.\n", file_name);
+		return false;
+	}
+	std::vector<char> text(size_t(get_file_size(f)) + 1);
+	bool ok = seek_file(f, 0) && fread(text.data(), 1, text.size() - 1, f) == text.size() - 1;
+	fclose(f);
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Could not read scene file '%s'.\n", file_name);
+		return false;
+	}
+	text.back() = '\0';
+	return parse_scene_text(file_name, text.data(), scene);
+}
+
+// One frame of a batch, rendered with the camera and render settings over those of the scene.
+struct Scene_View
+{
+	std::string output;
+	std::string settings;
+};
+
+// A list of views, one per line: the image file and the settings in the form of the camera
+// statement, "frame_0001.ppm look_from 0 2 6 fov 40". Empty lines and # comments are skipped.
+inline bool
+read_scene_views(const char* file_name, std::vector<Scene_View>& views)
+{
+	FILE* f = fopen(file_name, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: Could not open view list '%s'.\n", file_name);
+		return false;
+	}
+
+	char line[4096];
+	for (int line_number = 1; fgets(line, sizeof(line), f); line_number++)
+	{
+		Scene_Parser parser = {};
+		parser.file_name = file_name;
+		parser.at = line;
+		parser.line = line_number;
+		const char* output;
+		size_t length;
+		if (at_scene_line_end(parser) || !next_scene_token(parser, output, length))
+		{
+			if (parser.failed)
+			{
+				fclose(f);
+				return false;
+			}
+			continue;
+		}
+
+		Scene_View view;
+		view.output.assign(output, length);
+		view.settings = parser.at;
+		Scene_Options options = default_scene_options();
+		if (!parse_scene_options(file_name, parser.at, options, line_number))
+		{
+			fclose(f);
+			return false;
+		}
+		views.push_back(view);
+	}
+	fclose(f);
+	return true;
+}
+
+//
+// Binary
+//
+
+template <typename T>
+inline void
+set_scene_section(Scene_File_Header& header, Scene_Section section, std::vector<T>& records, uint64_t& offset)
+{
+	header.sections[section].offset = offset;
+	header.sections[section].count = records.size();
+	offset = (offset + records.size() * sizeof(T) + 7) & ~uint64_t(7);
+}
+
+template <typename T>
+inline bool
+write_scene_section(FILE* f, Scene_File_Header& header, Scene_Section section, std::vector<T>& records)
+{
+	static const char padding[8] = {};
+	size_t bytes = records.size() * sizeof(T);
+	size_t padding_bytes = ((bytes + 7) & ~size_t(7)) - bytes;
+	// an empty vector may have no data at all
+	return seek_file(f, header.sections[section].offset) &&
+		(!bytes || fwrite(records.data(), 1, bytes, f) == bytes) &&
+		fwrite(padding, 1, padding_bytes, f) == padding_bytes;
+}
+
+inline bool
+write_scene_binary(const char* file_name, Scene_Description& scene)
+{
+	Scene_File_Header header = {};
+	header.magic = SCENE_FILE_MAGIC;
+	header.version = SCENE_FILE_VERSION;
+	header.options = scene.options;
+
+	uint64_t offset = (sizeof(header) + 7) & ~uint64_t(7);
+	set_scene_section(header, SCENE_SECTION_STRINGS, scene.strings, offset);
+	set_scene_section(header, SCENE_SECTION_TEXTURES, scene.textures, offset);
+	set_scene_section(header, SCENE_SECTION_MATERIALS, scene.materials, offset);
+	set_scene_section(header, SCENE_SECTION_SPHERES, scene.spheres, offset);
+	set_scene_section(header, SCENE_SECTION_PLANES, scene.planes, offset);
+	set_scene_section(header, SCENE_SECTION_TRIANGLES, scene.triangles, offset);
+	set_scene_section(header, SCENE_SECTION_MESHES, scene.meshes, offset);
+	set_scene_section(header, SCENE_SECTION_INSTANCES, scene.instances, offset);
+	set_scene_section(header, SCENE_SECTION_MESH_TRIANGLES, scene.mesh_triangles, offset);
+
+	FILE* f = fopen(file_name, "wb");
+	bool ok = f && fwrite(&header, sizeof(header), 1, f) == 1 &&
+		write_scene_section(f, header, SCENE_SECTION_STRINGS, scene.strings) &&
+		write_scene_section(f, header, SCENE_SECTION_TEXTURES, scene.textures) &&
+		write_scene_section(f, header, SCENE_SECTION_MATERIALS, scene.materials) &&
+		write_scene_section(f, header, SCENE_SECTION_SPHERES, scene.spheres) &&
+		write_scene_section(f, header, SCENE_SECTION_PLANES, scene.planes) &&
+		write_scene_section(f, header, SCENE_SECTION_TRIANGLES, scene.triangles) &&
+		write_scene_section(f, header, SCENE_SECTION_MESHES, scene.meshes) &&
+		write_scene_section(f, header, SCENE_SECTION_INSTANCES, scene.instances) &&
+		write_scene_section(f, header, SCENE_SECTION_MESH_TRIANGLES, scene.mesh_triangles);
+	if (f)
+	{
+		ok = fclose(f) == 0 && ok;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Could not write scene file '%s'.\n", file_name);
+	}
+	return ok;
+}
+
+template <typename T>
+inline void
+read_scene_section(Mapped_File& mapped, Scene_File_Header& header, Scene_Section section, std::vector<T>& records)
+{
+	Scene_File_Section& entry = header.sections[section];
+	records.resize(size_t(entry.count));
+	if (entry.count)
+	{
+		memcpy(records.data(), mapped.data + entry.offset, size_t(entry.count) * sizeof(T));
+	}
+}
+
+inline bool
+is_scene_binary(Mapped_File& mapped)
+{
+	uint32_t magic = 0;
+	if (mapped.size >= sizeof(magic))
+	{
+		memcpy(&magic, mapped.data, sizeof(magic));
+	}
+	return magic == SCENE_FILE_MAGIC;
+}
+
+inline bool
+parse_scene_binary(const char* file_name, Mapped_File& mapped, Scene_Description& scene)
+{
+	Scene_File_Header header;
+	bool ok = mapped.size >= sizeof(header);
+	if (ok)
+	{
+		memcpy(&header, mapped.data, sizeof(header));
+		ok = header.magic == SCENE_FILE_MAGIC && header.version == SCENE_FILE_VERSION;
+	}
+	for (int section = 0; ok && section < SCENE_SECTION_COUNT; section++)
+	{
+		Scene_File_Section& entry = header.sections[section];
+		ok = entry.offset <= mapped.size && entry.count <= (mapped.size - entry.offset) / scene_record_sizes[section];
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: '%s' is not a valid scene file.\n", file_name);
+		return false;
+	}
+
+	scene = {};
+	scene.options = header.options;
+	read_scene_section(mapped, header, SCENE_SECTION_STRINGS, scene.strings);
+	read_scene_section(mapped, header, SCENE_SECTION_TEXTURES, scene.textures);
+	read_scene_section(mapped, header, SCENE_SECTION_MATERIALS, scene.materials);
+	read_scene_section(mapped, header, SCENE_SECTION_SPHERES, scene.spheres);
+	read_scene_section(mapped, header, SCENE_SECTION_PLANES, scene.planes);
+	read_scene_section(mapped, header, SCENE_SECTION_TRIANGLES, scene.triangles);
+	read_scene_section(mapped, header, SCENE_SECTION_MESHES, scene.meshes);
+	read_scene_section(mapped, header, SCENE_SECTION_INSTANCES, scene.instances);
+	read_scene_section(mapped, header, SCENE_SECTION_MESH_TRIANGLES, scene.mesh_triangles);
+	if (scene.strings.empty() || scene.strings.front() != '\0' || scene.strings.back() != '\0')
+	{
+		fprintf(stderr, "ERROR: '%s' is not a valid scene file.\n", file_name);
+		return false;
+	}
+	return true;
+}
+
+// Either form, told apart by the magic of the binary one.
+inline bool
+read_scene_description(const char* file_name, Scene_Description& scene)
+{
+	Mapped_File mapped;
+	if (map_file(file_name, mapped) && is_scene_binary(mapped))
+	{
+		bool ok = parse_scene_binary(file_name, mapped, scene);
+		unmap_file(mapped);
+		return ok;
+	}
+	unmap_file(mapped);
+	return read_scene_text(file_name, scene);
+}
+
+//
+// World
+//
+
+// The binary form isn't checked while it is read, every reference is checked here instead.
+inline bool
+check_scene_description(const char* file_name, Scene_Description& scene)
+{
+	int32_t texture_count = int32_t(scene.textures.size());
+	int32_t material_count = int32_t(scene.materials.size());
+	int32_t mesh_count = int32_t(scene.meshes.size());
+	uint32_t strings_size = uint32_t(scene.strings.size());
+
+	bool ok = scene.options.environment_file < strings_size && scene.options.environment_extension < strings_size;
+	for (Scene_Texture& texture : scene.textures)
+	{
+		ok = ok && texture.type >= SCENE_TEXTURE_SOLID && texture.type <= SCENE_TEXTURE_IMAGE && texture.file < strings_size;
+	}
+	for (Scene_Material& material : scene.materials)
+	{
+		ok = ok && material.type >= SCENE_MATERIAL_LAMBERTIAN && material.type <= SCENE_MATERIAL_LIGHT &&
+			material.texture >= -1 && material.texture < texture_count;
+	}
+	for (Scene_Sphere& sphere : scene.spheres) ok = ok && sphere.material >= 0 && sphere.material < material_count;
+	for (Scene_Plane& plane : scene.planes) ok = ok && plane.material >= 0 && plane.material < material_count;
+	for (Scene_Triangle& triangle : scene.triangles) ok = ok && triangle.material >= 0 && triangle.material < material_count;
+	for (Scene_Mesh& mesh : scene.meshes)
+	{
+		ok = ok && mesh.file < strings_size && mesh.material >= 0 && mesh.material < material_count;
+		ok = ok && (!mesh.embedded || uint64_t(mesh.first_triangle) + mesh.triangle_count <= scene.mesh_triangles.size());
+	}
+	for (Scene_Instance& instance : scene.instances)
+	{
+		ok = ok && instance.mesh >= 0 && instance.mesh < mesh_count && scene.meshes[instance.mesh].instanced;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Scene file '%s' refers to things it doesn't have.\n", file_name);
+	}
+	return ok;
+}
+
+// Relative files are next to the scene file.
+inline std::string
+scene_file_path(const char* scene_file, const char* file)
+{
+	bool absolute = file[0] == '/' || file[0] == '\\' || (file[0] && file[1] == ':');
+	const char* slash = strrchr(scene_file, '/');
+	const char* backslash = strrchr(scene_file, '\\');
+	if (backslash > slash)
+	{
+		slash = backslash;
+	}
+	if (absolute || !slash)
+	{
+		return file;
+	}
+	return std::string(scene_file, slash + 1 - scene_file) + file;
+}
+
+// image.jpg is used as image.rtex when there is one, made with "ray_tracer convert".
+inline std::string
+tiled_texture_path(std::string& file)
+{
+	size_t dot = file.rfind('.');
+	size_t slash = file.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+	{
+		return file + ".rtex";
+	}
+	return file.substr(0, dot) + ".rtex";
+}
+
+// Textures, meshes and the environment load on the pool like in generate_world.
+inline bool
+build_scene_world(const char* file_name, Scene_Description& scene, Thread_Pool* pool, Texture_Cache& texture_cache, World& world)
+{
+	if (!check_scene_description(file_name, scene))
+	{
+		return false;
+	}
+
+	world = {};
+	Asset_Loader loader = {};
+	start_loading(loader, pool, texture_cache);
+
+	Scene_Options& options = scene.options;
+	world.background = scene_v3f(options.background);
+	if (options.environment_file)
+	{
+		std::string environment_file = scene_file_path(file_name, get_scene_string(scene, options.environment_file));
+		if (options.environment_width > 0)
+		{
+			world.environment = load_cube_environment(loader, environment_file.c_str(), get_scene_string(scene, options.environment_extension), options.environment_width);
+		}
+		else
+		{
+			world.environment = load_environment(loader, environment_file.c_str());
+		}
+	}
+
+	std::vector<shared_ptr<Texture>> textures;
+	textures.reserve(scene.textures.size());
+	for (Scene_Texture& texture : scene.textures)
+	{
+		switch (texture.type)
+		{
+			case SCENE_TEXTURE_SOLID:
+				textures.push_back(make_shared<Solid_Color>(scene_v3f(texture.colors[0])));
+				break;
+			case SCENE_TEXTURE_CHECKER:
+				textures.push_back(make_shared<Checker_Texture>(scene_v3f(texture.colors[0]), scene_v3f(texture.colors[1])));
+				break;
+			case SCENE_TEXTURE_IMAGE:
+			{
+				std::string image_file = scene_file_path(file_name, get_scene_string(scene, texture.file));
+				textures.push_back(load_texture(loader, image_file.c_str(), tiled_texture_path(image_file).c_str()));
+			} break;
+		}
+	}
+
+	std::vector<shared_ptr<Material>> materials;
+	materials.reserve(scene.materials.size());
+	for (Scene_Material& material : scene.materials)
+	{
+		switch (material.type)
+		{
+			case SCENE_MATERIAL_LAMBERTIAN:
+				materials.push_back(material.texture >= 0 ? make_shared<Lambertian>(textures[material.texture]) : make_shared<Lambertian>(scene_v3f(material.color)));
+				break;
+			case SCENE_MATERIAL_METAL:
+				materials.push_back(make_shared<Metal>(scene_v3f(material.color), material.parameter));
+				break;
+			case SCENE_MATERIAL_DIELECTRIC:
+				materials.push_back(make_shared<Dielectric>(material.parameter));
+				break;
+			case SCENE_MATERIAL_LIGHT:
+				materials.push_back(material.texture >= 0 ? make_shared<Diffuse_Light>(textures[material.texture]) : make_shared<Diffuse_Light>(scene_v3f(material.color)));
+				break;
+		}
+	}
+
+	world.objects.reserve(scene.spheres.size() + scene.planes.size() + scene.triangles.size() + scene.instances.size());
+	for (Scene_Sphere& sphere : scene.spheres)
+	{
+		world.add_object(make_shared<Sphere>(scene_v3f(sphere.center), sphere.radius, materials[sphere.material]));
+	}
+	for (Scene_Plane& plane : scene.planes)
+	{
+		world.add_object(make_shared<Plane>(scene_v3f(plane.normal), plane.d, materials[plane.material]));
+	}
+	for (Scene_Triangle& triangle : scene.triangles)
+	{
+		world.add_object(make_shared<Triangle>(scene_v3f(triangle.vertices[0]), scene_v3f(triangle.vertices[1]), scene_v3f(triangle.vertices[2]), materials[triangle.material]));
+	}
+
+	// instanced meshes get their bvh built in the load task
+	std::vector<shared_ptr<Instanced_Mesh>> instanced_meshes(scene.meshes.size());
+	for (size_t i = 0; i < scene.meshes.size(); i++)
+	{
+		Scene_Mesh& mesh = scene.meshes[i];
+		std::string mesh_file = scene_file_path(file_name, get_scene_string(scene, mesh.file));
+		// scene outlives finish_loading, the tasks can read its triangles in place
+		bool embedded = mesh.embedded != 0;
+		const float* positions = embedded ? &scene.mesh_triangles.data()[mesh.first_triangle].vertices[0][0] : nullptr;
+		size_t triangle_count = mesh.triangle_count;
+		if (!mesh.instanced)
+		{
+			if (embedded)
+			{
+				load_mesh_positions(loader, positions, triangle_count, scene_v3f(mesh.offset), materials[mesh.material]);
+			}
+			else
+			{
+				load_mesh(loader, mesh_file.c_str(), scene_v3f(mesh.offset), materials[mesh.material]);
+			}
+			continue;
+		}
+
+		shared_ptr<Instanced_Mesh> instanced = make_shared<Instanced_Mesh>();
+		shared_ptr<Material> material = materials[mesh.material];
+		instanced_meshes[i] = instanced;
+		run_load_task(loader, [instanced, mesh_file, embedded, positions, triangle_count, material]
+		{
+			TRACE_SCOPE("mesh load");
+			std::vector<shared_ptr<Hittable>> triangles;
+			if (embedded)
+			{
+				add_mesh_triangles(positions, triangle_count, v3f{ .0f, .0f, .0f }, material, triangles);
+			}
+			else
+			{
+				build_mesh_triangles(mesh_file.c_str(), v3f{ .0f, .0f, .0f }, material, triangles);
+			}
+			if (!triangles.empty())
+			{
+				*instanced = *make_instanced_mesh(triangles);
+			}
+		});
+	}
+
+	finish_loading(loader, world);
+
+	// instances of meshes that didn't load are left out
+	for (Scene_Instance& instance : scene.instances)
+	{
+		shared_ptr<Instanced_Mesh>& mesh = instanced_meshes[instance.mesh];
+		if (mesh->bvh)
+		{
+			world.add_object(make_shared<Instance>(mesh, scene_v3f(instance.offset), instance.scale));
+		}
+	}
+	return true;
+}
+
+// Reads a scene file of either form into world, options gets the camera and settings of the scene.
+inline bool
+load_scene_file(const char* file_name, Thread_Pool* pool, Texture_Cache& texture_cache, World& world, Scene_Options& options)
+{
+	Scene_Description scene;
+	if (!read_scene_description(file_name, scene) || !build_scene_world(file_name, scene, pool, texture_cache, world))
+	{
+		return false;
+	}
+	options = scene.options;
+	return true;
+}
+
+// ray_tracer compile-scene, turns a scene file into the binary form with the triangles of its
+// meshes in it.
+inline bool
+compile_scene_file(const char* src_file_name, const char* dst_file_name)
+{
+	Scene_Description scene;
+	if (!read_scene_description(src_file_name, scene) || !check_scene_description(src_file_name, scene))
+	{
+		return false;
+	}
+
+	for (Scene_Mesh& mesh : scene.meshes)
+	{
+		if (mesh.embedded)
+		{
+			continue;
+		}
+		std::string mesh_file = scene_file_path(src_file_name, get_scene_string(scene, mesh.file));
+		std::vector<float> positions;
+		if (!read_mesh_positions(mesh_file.c_str(), positions))
+		{
+			return false;
+		}
+		size_t triangle_count = positions.size() / 9;
+		if (scene.mesh_triangles.size() + triangle_count > UINT32_MAX)
+		{
+			fprintf(stderr, "ERROR: The meshes of '%s' have too many triangles for a scene file.\n", src_file_name);
+			return false;
+		}
+		mesh.embedded = 1;
+		mesh.first_triangle = uint32_t(scene.mesh_triangles.size());
+		mesh.triangle_count = uint32_t(triangle_count);
+		scene.mesh_triangles.resize(scene.mesh_triangles.size() + triangle_count);
+		memcpy(scene.mesh_triangles.data() + mesh.first_triangle, positions.data(), triangle_count * sizeof(Scene_Mesh_Triangle));
+	}
+	return write_scene_binary(dst_file_name, scene);
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "asset_loader.h"
+
+// Scenes made up on the spot with as many primitives as asked for, from ten to tens of millions,
+// to see how loading, bvh build, memory and tracing scale. They all fill the same box in front of
+// the default camera above a ground sphere, so every count shows about the same picture made of
+// more and smaller pieces. The layout comes from random_float, seed it first.
+
+enum Stress_Scene_Type
+{
+	STRESS_NONE,
+	STRESS_SPHERES,
+	STRESS_INSTANCES,
+	STRESS_TRIANGLES,
+	STRESS_LIGHTS,
+
+	STRESS_SCENE_COUNT,
+};
+
+static const char* stress_scene_names[STRESS_SCENE_COUNT] =
+{
+	"none",
+	"spheres",   // random spheres
+	"instances", // grid of instances of one mesh
+	"triangles", // soup of random triangles
+	"lights",    // small emissive spheres lighting a few big ones
+};
+
+struct Stress_Scene
+{
+	Stress_Scene_Type type;
+	// spheres, triangles or lights, for instances the triangles of all of them together
+	int64_t count;
+	// triangulated OBJ the instances are made of, a procedural bumpy sphere when null
+	const char* mesh_file;
+};
+
+// Far more than fits in memory, it only keeps the conversion to int64_t defined.
+#define STRESS_SCENE_MAX_COUNT 1e9
+
+// "spheres:100000", the count also takes "1e6" but has to be a whole number.
+inline bool
+parse_stress_scene(const char* text, Stress_Scene& scene)
+{
+	const char* separator = strchr(text, ':');
+	if (!separator)
+	{
+		return false;
+	}
+
+	std::string name(text, separator - text);
+	for (int type = STRESS_NONE + 1; type < STRESS_SCENE_COUNT; type++)
+	{
+		if (name == stress_scene_names[type])
+		{
+			char* end = nullptr;
+			double count = strtod(separator + 1, &end);
+			// also false for nan
+			if (end == separator + 1 || *end || !(count >= 1.0 && count <= STRESS_SCENE_MAX_COUNT) || count != floor(count))
+			{
+				return false;
+			}
+			scene.type = Stress_Scene_Type(type);
+			scene.count = int64_t(count);
+			return true;
+		}
+	}
+	return false;
+}
+
+inline std::string
+stress_scene_name(Stress_Scene& scene)
+{
+	return std::string(stress_scene_names[scene.type]) + "_" + std::to_string((long long)scene.count);
+}
+
+inline v3f
+random_point_in_bounds(Bounds& bounds)
+{
+	return v3f{ random_float(bounds.min.x, bounds.max.x), random_float(bounds.min.y, bounds.max.y), random_float(bounds.min.z, bounds.max.z) };
+}
+
+// Materials shared by all the primitives, one each would take more memory than the primitives.
+inline std::vector<shared_ptr<Material>>
+make_stress_materials()
+{
+	std::vector<shared_ptr<Material>> materials;
+	for (int i = 0; i < 8; i++)
+	{
+		materials.push_back(make_shared<Lambertian>(V3f(random_float(.1f, .9f), random_float(.1f, .9f), random_float(.1f, .9f))));
+	}
+	materials.push_back(make_shared<Metal>(V3f(.8f, .6f, .2f), .3f));
+	materials.push_back(make_shared<Metal>(V3f(.7f, .7f, .8f), .0f));
+	materials.push_back(make_shared<Dielectric>(1.5f));
+	return materials;
+}
+
+inline shared_ptr<Material>
+pick_stress_material(std::vector<shared_ptr<Material>>& materials)
+{
+	int index = int(random_float() * float(materials.size()));
+	return materials[MIN(index, int(materials.size()) - 1)];
+}
+
+// Sphere of rings * segments * 2 triangles with bumps on it, so neighbouring triangles differ.
+inline void
+add_bumpy_sphere(std::vector<shared_ptr<Hittable>>& triangles, int rings, int segments, float radius, shared_ptr<Material> material)
+{
+	auto vertex = [rings, segments, radius](int ring, int segment)
+	{
+		float theta = PI * float(ring) / float(rings);
+		float phi = 2.0f * PI * float(segment % segments) / float(segments);
+		float r = radius * (1.0f + .025f * (float)sin(13.0f * theta) * (float)cos(17.0f * phi));
+		return r * V3f((float)sin(theta) * (float)cos(phi), (float)cos(theta), (float)sin(theta) * (float)sin(phi));
+	};
+
+	triangles.reserve(triangles.size() + size_t(2) * rings * segments);
+	for (int ring = 0; ring < rings; ring++)
+	{
+		for (int segment = 0; segment < segments; segment++)
+		{
+			v3f a = vertex(ring, segment);
+			v3f b = vertex(ring, segment + 1);
+			v3f c = vertex(ring + 1, segment);
+			v3f d = vertex(ring + 1, segment + 1);
+			triangles.push_back(make_shared<Triangle>(a, b, c, material));
+			triangles.push_back(make_shared<Triangle>(b, d, c, material));
+		}
+	}
+}
+
+// Instances of one mesh on a grid of cubic cells filling the box layer by layer from the ground
+// up, each scaled to fit its cell. There is always at least one.
+inline void
+add_mesh_instances(World& world, Stress_Scene& scene, Bounds& box, std::vector<shared_ptr<Material>>& materials)
+{
+	std::vector<shared_ptr<Hittable>> triangles;
+	if (scene.mesh_file)
+	{
+		build_mesh_triangles(scene.mesh_file, v3f{ .0f, .0f, .0f }, materials[0], triangles);
+	}
+	if (triangles.empty())
+	{
+		add_bumpy_sphere(triangles, 50, 50, 1.0f, materials[0]);
+	}
+	int64_t mesh_triangles = int64_t(triangles.size());
+	shared_ptr<Instanced_Mesh> mesh = make_instanced_mesh(triangles);
+
+	int64_t instance_count = MAX(scene.count / mesh_triangles, int64_t(1));
+	v3f size = box.max - box.min;
+	float cell = (float)cbrt(size.x * size.y * size.z / float(instance_count));
+	int cells_x = MAX(int(size.x / cell), 1);
+	int cells_z = MAX(int(size.z / cell), 1);
+	// the cells are made a little smaller when they don't divide the box evenly, so the layers
+	// of the whole count fit
+	int64_t per_layer = int64_t(cells_x) * int64_t(cells_z);
+	int64_t layers = (instance_count + per_layer - 1) / per_layer;
+	cell = MIN(cell, size.y / float(layers));
+
+	v3f mesh_size = mesh->bounds.max - mesh->bounds.min;
+	float mesh_extent = MAX(MAX(mesh_size.x, mesh_size.y), mesh_size.z);
+	float scale = mesh_extent > .0f ? .9f * cell / mesh_extent : 1.0f;
+	v3f mesh_center = bounds_center(mesh->bounds);
+
+	float spacing_x = size.x / float(cells_x);
+	float spacing_z = size.z / float(cells_z);
+	for (int64_t i = 0; i < instance_count; i++)
+	{
+		int64_t layer = i / per_layer;
+		int64_t in_layer = i % per_layer;
+		v3f cell_center = v3f{
+			box.min.x + (float(in_layer % cells_x) + .5f) * spacing_x,
+			box.min.y + (float(layer) + .5f) * cell,
+			box.min.z + (float(in_layer / cells_x) + .5f) * spacing_z };
+		world.add_object(make_shared<Instance>(mesh, cell_center - scale * mesh_center, scale));
+	}
+
+	printf("%lld instances of %lld triangles\n", (long long)instance_count, (long long)mesh_triangles);
+}
+
+inline World
+generate_stress_world(Stress_Scene& scene)
+{
+	World world = {};
+	world.background = v3f{ .7f, .8f, 1.0f };
+
+	auto checker_texture = make_shared<Checker_Texture>(v3f{ .2f, .3f, .1f }, v3f{ .9f, .9f, .9f });
+	world.add_object(make_shared<Sphere>(v3f{ .0f, -1000.0f, .0f }, 1000.0f, make_shared<Lambertian>(checker_texture)));
+
+	Bounds box = Bounds{ v3f{ -5.0f, .0f, -10.0f }, v3f{ 5.0f, 3.0f, .0f } };
+	v3f size = box.max - box.min;
+	// edge of the cube each primitive gets to itself
+	float cell = (float)cbrt(size.x * size.y * size.z / float(scene.count));
+	std::vector<shared_ptr<Material>> materials = make_stress_materials();
+
+	if (scene.type != STRESS_INSTANCES)
+	{
+		world.objects.reserve(size_t(scene.count) + 4);
+	}
+
+	switch (scene.type)
+	{
+		case STRESS_SPHERES:
+		{
+			float radius = .35f * cell;
+			for (int64_t i = 0; i < scene.count; i++)
+			{
+				world.add_object(make_shared<Sphere>(random_point_in_bounds(box), radius, pick_stress_material(materials)));
+			}
+		} break;
+
+		case STRESS_INSTANCES:
+		{
+			add_mesh_instances(world, scene, box, materials);
+		} break;
+
+		case STRESS_TRIANGLES:
+		{
+			float extent = .7f * cell;
+			for (int64_t i = 0; i < scene.count; i++)
+			{
+				v3f center = random_point_in_bounds(box);
+				v3f a = center + extent * random_in_unit_vector();
+				v3f b = center + extent * random_in_unit_vector();
+				v3f c = center + extent * random_in_unit_vector();
+				world.add_object(make_shared<Triangle>(a, b, c, pick_stress_material(materials)));
+			}
+		} break;
+
+		case STRESS_LIGHTS:
+		{
+			// the lights together give off about the same power at any count
+			float radius = .15f * cell;
+			float total_power = 400.0f;
+			float radiance = total_power / (float(scene.count) * 4.0f * PI * PI * radius * radius);
+			std::vector<shared_ptr<Material>> lights;
+			for (int i = 0; i < 8; i++)
+			{
+				v3f color = V3f(random_float(.5f, 1.0f), random_float(.5f, 1.0f), random_float(.5f, 1.0f));
+				lights.push_back(make_shared<Diffuse_Light>(radiance * color));
+			}
+			for (int64_t i = 0; i < scene.count; i++)
+			{
+				world.add_object(make_shared<Sphere>(random_point_in_bounds(box), radius, pick_stress_material(lights)));
+			}
+
+			world.add_object(make_shared<Sphere>(V3f(-2.0f, 1.0f, -3.0f), 1.0f, materials[0]));
+			world.add_object(make_shared<Sphere>(V3f(.0f, 1.0f, -4.0f), 1.0f, materials[8]));
+			world.add_object(make_shared<Sphere>(V3f(2.0f, 1.0f, -3.0f), 1.0f, materials[10]));
+			world.background = v3f{ .0f, .0f, .0f };
+		} break;
+
+		default:
+			printf("Couldn't generate such type of stress scene!\n");
+			break;
+	}
+
+	return world;
+}
@@ -3,12 +3,74 @@
 #include "ray_math.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "texture_file.h"
 
 struct Texture
 {
 	virtual v3f value(float u, float v, v3f& p) = 0;
+
+	// Lookup that can use the pixel footprint stored in the hit record to filter the texture.
+	virtual v3f sample(Hit_Record& rec)
+	{
+		return value(rec.u, rec.v, rec.p);
+	}
 };
 
+// Picks the mip level where one pixel of the footprint covers about one texel.
+inline float
+mip_lod(int width, int height, Hit_Record& rec)
+{
+	float dx = (float)sqrt(rec.dudx*rec.dudx*width*width + rec.dvdx*rec.dvdx*height*height);
+	float dy = (float)sqrt(rec.dudy*rec.dudy*width*width + rec.dvdy*rec.dvdy*height*height);
+	float footprint = dx > dy ? dx : dy;
+	if (footprint <= 1.0f)
+	{
+		return .0f;
+	}
+	return fast_log2(footprint);
+}
+
+// fetch(level, x, y) returns one texel of a mip level, the coordinates are always in range.
+template <typename Fetch>
+inline v3f
+sample_bilinear(int width, int height, int level, float u, float v, Fetch& fetch)
+{
+	int level_width = mip_level_size(width, level);
+	int level_height = mip_level_size(height, level);
+
+	float x = u * level_width - .5f;
+	float y = v * level_height - .5f;
+	int x0 = (int)floor(x);
+	int y0 = (int)floor(y);
+	float tx = x - x0;
+	float ty = y - y0;
+
+	int x1 = x0 + 1 < level_width ? x0 + 1 : level_width - 1;
+	int y1 = y0 + 1 < level_height ? y0 + 1 : level_height - 1;
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+
+	v3f top = lerp(fetch(level, x0, y0), tx, fetch(level, x1, y0));
+	v3f bottom = lerp(fetch(level, x0, y1), tx, fetch(level, x1, y1));
+	return lerp(top, ty, bottom);
+}
+
+template <typename Fetch>
+inline v3f
+sample_trilinear(int width, int height, int level_count, float u, float v, float lod, Fetch& fetch)
+{
+	lod = clamp(lod, .0f, float(level_count - 1));
+	int level = (int)lod;
+	float t = lod - level;
+
+	v3f result = sample_bilinear(width, height, level, u, v, fetch);
+	if (t > .0f && level + 1 < level_count)
+	{
+		result = lerp(result, t, sample_bilinear(width, height, level + 1, u, v, fetch));
+	}
+	return result;
+}
+
 struct Solid_Color : public Texture
 {
 	v3f color_value;
@@ -31,7 +93,8 @@ struct Checker_Texture : public Texture
 
 	virtual v3f value(float u, float v, v3f& p) override
 	{
-		float sines = sin(10.0f*p.x)*sin(10.0f*p.y)*sin(10.0f*p.z);
+		v3f s = fast_sin(10.0f*p);
+		float sines = s.x*s.y*s.z;
 		if (sines < 0)
 			return empty->value(u, v, p);
 		else
@@ -41,32 +104,65 @@ struct Checker_Texture : public Texture
 
 struct Image_Texture : public Texture 
 {
-	Image_Texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+	Image_Texture() : data(nullptr), mapping(), width(0), height(0) {}
 
-	Image_Texture(const char* filename) 
+	Image_Texture(const char* filename) : data(nullptr), mapping(), width(0), height(0)
 	{
-		auto components_per_pixel = bytes_per_pixel;
+		load(filename);
+	}
 
-		data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+	Image_Texture(const Image_Texture&) = delete;
+	Image_Texture& operator=(const Image_Texture&) = delete;
 
-		if (!data) 
+	~Image_Texture()
+	{
+		unmap_file(mapping);
+	}
+
+	// .rtex files (see texture_file.h) are mapped and sampled in place, any other image is decoded
+	// and tiled in memory first. Can run on any thread, as long as nobody samples the texture yet.
+	bool load(const char* filename)
+	{
+		unmap_file(mapping);
+		memory.clear();
+		data = nullptr;
+		width = height = 0;
+
+		size_t size = 0;
+		const char* extension = strrchr(filename, '.');
+		if (extension && strcmp(extension, ".rtex") == 0)
 		{
-			std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-			width = height = 0;
+			if (map_file(filename, mapping))
+			{
+				data = mapping.data;
+				size = mapping.size;
+			}
+		}
+		else
+		{
+			memory = load_tiled_texture(filename, TEXEL_FORMAT_RGB8);
+			data = memory.data();
+			size = memory.size();
 		}
 
-		bytes_per_scanline = bytes_per_pixel * width;
-	}
+		if (!data || !parse_tiled_texture_info(data, size, size, info))
+		{
+			std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+			unmap_file(mapping);
+			memory.clear();
+			data = nullptr;
+			return false;
+		}
 
-	~Image_Texture() 
-	{
-		delete data;
+		width = info.header.width;
+		height = info.header.height;
+		return true;
 	}
 
 	virtual v3f value(float u, float v, v3f& p) override 
 	{
 		// If we have no texture data, then return solid cyan as a debugging aid.
-		if (data == nullptr)
+		if (!data)
 			return v3f{ .0f, 1.0f, 1.0f };
 
 		// Clamp input texture coordinates to [0,1] x [1,0]
@@ -80,15 +176,34 @@ struct Image_Texture : public Texture
 		if (i >= width)  i = width - 1;
 		if (j >= height) j = height - 1;
 
-		const float color_scale = 1.0f / 255.0f;
-		auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
+		return texel(0, i, j);
+	}
+
+	// Trilinear lookup in the mip pyramid, the level comes from the ray differentials. Surfaces far
+	// away read the small levels, which stay in cache and don't alias.
+	virtual v3f sample(Hit_Record& rec) override
+	{
+		if (!data)
+			return v3f{ .0f, 1.0f, 1.0f };
 
-		return v3f{ color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2] };
+		float u = clamp(rec.u, .0f, 1.0f);
+		float v = 1.0f - clamp(rec.v, .0f, 1.0f);
+		float lod = mip_lod(width, height, rec);
+
+		auto fetch = [this](int level, int x, int y) { return texel(level, x, y); };
+		return sample_trilinear(width, height, info.header.level_count, u, v, lod, fetch);
 	}
 
 private:
-	unsigned char *data;
+	v3f texel(int level, int x, int y)
+	{
+		const unsigned char* tile = data + tile_offset(info, tile_index(info, level, x, y));
+		return decode_texel(info.header.format, tile + texel_offset_in_tile(info, x, y));
+	}
+
+	const unsigned char* data;
+	std::vector<unsigned char> memory;
+	Mapped_File mapping;
+	Tiled_Texture_Info info;
 	int width, height;
-	int bytes_per_scanline;
-	int bytes_per_pixel = 3;
 };
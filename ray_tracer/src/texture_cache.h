@@ -0,0 +1,314 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include "texture_file.h"
+
+// Texture cache for tiled textures (see texture_file.h). Tiles are read from disk the first time
+// a texel in them is needed and the cache evicts least recently used tiles (clock algorithm) to
+// stay under its memory budget, so the textures of a scene don't have to fit in memory.
+//
+// Every texture has one slot per tile that points at the resident tile or is null. Lookups that
+// hit don't take any lock: the reader pins the tile and checks that the slot still points at it.
+// The evictor does the opposite, it clears the slot and then checks that nobody pinned the tile,
+// so either the reader sees the cleared slot and retries, or the evictor sees the pin and picks
+// another tile. Tiles are never deleted while the cache is alive, so a reader that loses the race
+// only ever touches the pin count of a valid tile. Texels are only read from a tile that was found
+// pinned in its slot, so an evicted tile can have its texels freed, to make room when it's reused
+// for a tile of another size.
+
+struct Cache_Tile
+{
+	std::atomic<int> pins;
+	std::atomic<bool> referenced;
+
+	// slot that points at this tile, null when the tile is free
+	std::atomic<Cache_Tile*>* slot;
+	// null and 0 bytes for a tile that gave its texels up
+	unsigned char* texels;
+	int bytes;
+};
+
+struct Texture_Cache
+{
+	size_t budget_bytes;
+	size_t resident_bytes;
+
+	std::mutex lock;
+	std::vector<Cache_Tile*> tiles;
+	size_t clock_hand;
+
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> evictions;
+
+	Texture_Cache(size_t budget) : budget_bytes(budget), resident_bytes(0), clock_hand(0), misses(0), evictions(0) {}
+
+	~Texture_Cache()
+	{
+		for (Cache_Tile* tile : tiles)
+		{
+			free_aligned(tile->texels);
+			delete tile;
+		}
+	}
+};
+
+inline Cache_Tile*
+pin_tile(std::atomic<Cache_Tile*>& slot)
+{
+	for (;;)
+	{
+		Cache_Tile* tile = slot.load();
+		if (!tile)
+		{
+			return nullptr;
+		}
+
+		tile->pins.fetch_add(1);
+		if (slot.load() == tile)
+		{
+			if (!tile->referenced.load(std::memory_order_relaxed))
+			{
+				tile->referenced.store(true, std::memory_order_relaxed);
+			}
+			return tile;
+		}
+		tile->pins.fetch_sub(1);
+	}
+}
+
+inline void
+unpin_tile(Cache_Tile* tile)
+{
+	tile->pins.fetch_sub(1);
+}
+
+// Must be called with the cache lock held.
+inline Cache_Tile*
+evict_tile(Texture_Cache& cache)
+{
+	size_t tile_count = cache.tiles.size();
+	for (size_t step = 0; step < 2 * tile_count; step++)
+	{
+		Cache_Tile* tile = cache.tiles[cache.clock_hand];
+		cache.clock_hand = (cache.clock_hand + 1) % tile_count;
+
+		if (!tile->slot)
+		{
+			return tile;
+		}
+		if (tile->pins.load() > 0 || tile->referenced.exchange(false))
+		{
+			continue;
+		}
+
+		std::atomic<Cache_Tile*>* slot = tile->slot;
+		slot->store(nullptr);
+		if (tile->pins.load() > 0)
+		{
+			// somebody pinned it before seeing the cleared slot, give it back
+			slot->store(tile);
+			continue;
+		}
+
+		tile->slot = nullptr;
+		cache.evictions++;
+		return tile;
+	}
+
+	return nullptr;
+}
+
+// Gives a free tile texels of another size, none for 0. Must be called with the cache lock held.
+inline void
+resize_cache_tile(Texture_Cache& cache, Cache_Tile* tile, int bytes)
+{
+	free_aligned(tile->texels);
+	cache.resident_bytes -= tile->bytes;
+	tile->texels = bytes > 0 ? (unsigned char*)allocate_aligned(bytes, CACHE_LINE_SIZE) : nullptr;
+	tile->bytes = bytes;
+	cache.resident_bytes += bytes;
+}
+
+// Must be called with the cache lock held.
+inline Cache_Tile*
+allocate_cache_tile(Texture_Cache& cache, int bytes)
+{
+	Cache_Tile* tile = nullptr;
+	if (cache.resident_bytes + bytes > cache.budget_bytes && !cache.tiles.empty())
+	{
+		tile = evict_tile(cache);
+	}
+
+	// under budget, or every tile is pinned right now and the budget has to give
+	if (!tile)
+	{
+		tile = new Cache_Tile;
+		tile->pins = 0;
+		tile->referenced = false;
+		tile->slot = nullptr;
+		tile->texels = nullptr;
+		tile->bytes = 0;
+		cache.tiles.push_back(tile);
+	}
+
+	if (tile->bytes != bytes)
+	{
+		resize_cache_tile(cache, tile, bytes);
+
+		// took the place of a smaller tile, the texels of more tiles go until it fits the budget
+		for (size_t step = 0; step < cache.tiles.size() && cache.resident_bytes > cache.budget_bytes; step++)
+		{
+			Cache_Tile* victim = evict_tile(cache);
+			if (!victim)
+			{
+				break;
+			}
+			if (victim != tile)
+			{
+				resize_cache_tile(cache, victim, 0);
+			}
+		}
+	}
+
+	return tile;
+}
+
+// Slow path of a lookup, reads the tile from the file and publishes it in the slot. Returns the
+// tile pinned.
+inline Cache_Tile*
+load_tile(Texture_Cache& cache, std::atomic<Cache_Tile*>& slot, FILE* f, uint64_t offset, int bytes)
+{
+	std::lock_guard<std::mutex> guard(cache.lock);
+
+	// another thread might have loaded it while we were waiting for the lock
+	Cache_Tile* tile = pin_tile(slot);
+	if (tile)
+	{
+		return tile;
+	}
+
+	tile = allocate_cache_tile(cache, bytes);
+	if (!seek_file(f, offset) || fread(tile->texels, 1, bytes, f) != size_t(bytes))
+	{
+		memset(tile->texels, 0, bytes);
+	}
+
+	// stale readers may be pinning and unpinning it while they check the slot
+	tile->pins.fetch_add(1);
+	tile->referenced = true;
+	tile->slot = &slot;
+	slot.store(tile);
+	cache.misses++;
+
+	return tile;
+}
+
+inline void
+print_texture_cache_stats(Texture_Cache& cache)
+{
+	std::lock_guard<std::mutex> guard(cache.lock);
+	printf("Texture cache: %.1f/%.1f MB resident, %llu tile loads, %llu evictions\n",
+		   double(cache.resident_bytes) / (1024.0 * 1024.0), double(cache.budget_bytes) / (1024.0 * 1024.0),
+		   (unsigned long long)cache.misses.load(), (unsigned long long)cache.evictions.load());
+}
+
+// Texture read from a .rtex file through a Texture_Cache, only the tiles that are looked at are
+// ever loaded.
+struct Cached_Texture : public Texture
+{
+	Cached_Texture(Texture_Cache& cache, const char* filename) : cache(cache), file(nullptr), width(0), height(0)
+	{
+		file = fopen(filename, "rb");
+		if (!file || !read_tiled_texture_info(file, info))
+		{
+			std::cerr << "ERROR: Could not load tiled texture file '" << filename << "'.\n";
+			if (file)
+			{
+				fclose(file);
+				file = nullptr;
+			}
+			return;
+		}
+
+		width = info.header.width;
+		height = info.header.height;
+		slots.reset(new std::atomic<Cache_Tile*>[info.tile_count]);
+		for (int i = 0; i < info.tile_count; i++)
+		{
+			slots[i] = nullptr;
+		}
+	}
+
+	~Cached_Texture()
+	{
+		if (!file)
+			return;
+
+		// hand the tiles back to the cache as free tiles
+		std::lock_guard<std::mutex> guard(cache.lock);
+		for (int i = 0; i < info.tile_count; i++)
+		{
+			Cache_Tile* tile = slots[i].load();
+			if (tile)
+			{
+				tile->slot = nullptr;
+				slots[i] = nullptr;
+			}
+		}
+		fclose(file);
+	}
+
+	virtual v3f value(float u, float v, v3f& p) override
+	{
+		if (!file)
+			return v3f{ .0f, 1.0f, 1.0f };
+
+		u = clamp(u, .0f, 1.0f);
+		v = 1.0f - clamp(v, .0f, 1.0f);
+
+		int i = MIN(static_cast<int>(u * width), width - 1);
+		int j = MIN(static_cast<int>(v * height), height - 1);
+
+		return texel(0, i, j);
+	}
+
+	virtual v3f sample(Hit_Record& rec) override
+	{
+		if (!file)
+			return v3f{ .0f, 1.0f, 1.0f };
+
+		float u = clamp(rec.u, .0f, 1.0f);
+		float v = 1.0f - clamp(rec.v, .0f, 1.0f);
+		float lod = mip_lod(width, height, rec);
+
+		auto fetch = [this](int level, int x, int y) { return texel(level, x, y); };
+		return sample_trilinear(width, height, info.header.level_count, u, v, lod, fetch);
+	}
+
+private:
+	v3f texel(int level, int x, int y)
+	{
+		int index = tile_index(info, level, x, y);
+		std::atomic<Cache_Tile*>& slot = slots[index];
+		Cache_Tile* tile = pin_tile(slot);
+		if (!tile)
+		{
+			tile = load_tile(cache, slot, file, tile_offset(info, index), info.tile_bytes);
+		}
+
+		v3f result = decode_texel(info.header.format, tile->texels + texel_offset_in_tile(info, x, y));
+		unpin_tile(tile);
+
+		return result;
+	}
+
+	Texture_Cache& cache;
+	FILE* file;
+	Tiled_Texture_Info info;
+	std::unique_ptr<std::atomic<Cache_Tile*>[]> slots;
+	int width, height;
+};
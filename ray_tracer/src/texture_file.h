@@ -0,0 +1,649 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <vector>
+#include <type_traits>
+
+#include "ray_math.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Tiled, mipmapped texture file (.rtex). Layout:
+//   Tiled_Texture_Header
+//   Tiled_Texture_Level for every mip level
+//   tiles, starting at a page aligned offset
+// Every level is split in tile_size x tile_size tiles stored one after the other in row major
+// order, the texels inside a tile are row major as well. Tiles on the right and bottom edges are
+// padded by repeating the last column/row so every tile has the same size. Levels follow each
+// other without gaps, so the tiles of the whole file can be numbered in order.
+//
+// The texels are stored ready to use, so a file can be mapped and sampled in place without any
+// decoding, and the same layout is built in memory for textures loaded from regular images.
+
+#define TILED_TEXTURE_MAGIC 0x58455452 // "RTEX"
+#define TILED_TEXTURE_VERSION 1
+#define TILED_TEXTURE_TILE_SIZE 64
+// larger tile sizes in a file are taken for a broken header
+#define TILED_TEXTURE_MAX_TILE_SIZE 1024
+#define TILED_TEXTURE_ALIGNMENT 4096
+
+enum Texel_Format
+{
+	TEXEL_FORMAT_RGB8,
+	TEXEL_FORMAT_RGB16,
+	TEXEL_FORMAT_RGB16F, // half floats, for HDR images
+};
+
+struct Tiled_Texture_Header
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t level_count;
+	int32_t tile_size;
+	int32_t format;
+	int32_t reserved;
+};
+
+struct Tiled_Texture_Level
+{
+	int32_t width;
+	int32_t height;
+	int32_t tiles_x;
+	int32_t tiles_y;
+	uint64_t offset; // of the first tile, from the start of the file
+};
+
+struct Tiled_Texture_Info
+{
+	Tiled_Texture_Header header;
+	std::vector<Tiled_Texture_Level> levels;
+
+	// index of the first tile of every level if all the tiles of the file are numbered in order
+	std::vector<int> first_tile;
+	int tile_count;
+
+	int tile_shift;
+	int texel_bytes;
+	int tile_bytes;
+};
+
+inline int
+mip_level_size(int size, int level)
+{
+	int result = size >> level;
+	return result > 0 ? result : 1;
+}
+
+inline int
+mip_level_count(int width, int height)
+{
+	int levels = 1;
+	while (width > 1 || height > 1)
+	{
+		width = mip_level_size(width, 1);
+		height = mip_level_size(height, 1);
+		levels++;
+	}
+	return levels;
+}
+
+// Fills in levels 1 to n from level 0, which must already be in levels. Every level is a 2x2 box
+// filter of the previous one, odd sizes repeat the last row/column.
+template <typename T>
+inline void
+build_mip_levels(int width, int height, int components, std::vector<std::vector<T>>& levels)
+{
+	const float rounding = std::is_integral<T>::value ? .5f : .0f;
+
+	int level_count = mip_level_count(width, height);
+	for (int level = 1; level < level_count; level++)
+	{
+		int src_width = mip_level_size(width, level - 1);
+		int src_height = mip_level_size(height, level - 1);
+		int dst_width = mip_level_size(width, level);
+		int dst_height = mip_level_size(height, level);
+
+		std::vector<T>& src = levels[level - 1];
+		std::vector<T> dst(dst_width * dst_height * components);
+		for (int y = 0; y < dst_height; y++)
+		{
+			int y0 = MIN(2 * y, src_height - 1);
+			int y1 = MIN(2 * y + 1, src_height - 1);
+			for (int x = 0; x < dst_width; x++)
+			{
+				int x0 = MIN(2 * x, src_width - 1);
+				int x1 = MIN(2 * x + 1, src_width - 1);
+				for (int c = 0; c < components; c++)
+				{
+					float sum = float(src[(y0 * src_width + x0) * components + c]) + float(src[(y0 * src_width + x1) * components + c]) +
+								float(src[(y1 * src_width + x0) * components + c]) + float(src[(y1 * src_width + x1) * components + c]);
+					dst[(y * dst_width + x) * components + c] = T(sum * .25f + rounding);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+	}
+}
+
+inline uint16_t
+float_to_half(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent >= 31)
+	{
+		// too big and inf become inf, nan stays nan
+		bool is_nan = ((bits >> 23) & 0xff) == 0xff && mantissa;
+		return uint16_t(sign | 0x7c00 | (is_nan ? 0x200 : 0));
+	}
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+		{
+			return uint16_t(sign);
+		}
+		// denormal
+		mantissa |= 0x800000;
+		uint32_t shift = uint32_t(14 - exponent);
+		uint32_t half_mantissa = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half_mantissa & 1)))
+		{
+			half_mantissa++;
+		}
+		return uint16_t(sign | half_mantissa);
+	}
+
+	uint32_t result = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+	{
+		// a carry into the exponent is still the right answer, up to inf
+		result++;
+	}
+	return uint16_t(result);
+}
+
+inline float
+half_to_float(uint16_t value)
+{
+	uint32_t sign = uint32_t(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1f;
+	uint32_t mantissa = value & 0x3ff;
+
+	uint32_t bits;
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+		{
+			bits = sign;
+		}
+		else
+		{
+			// denormal, normalize it
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if (exponent == 31)
+	{
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else
+	{
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+inline int
+texel_size(int format)
+{
+	switch (format)
+	{
+		case TEXEL_FORMAT_RGB8: return 3;
+		case TEXEL_FORMAT_RGB16: return 6;
+		case TEXEL_FORMAT_RGB16F: return 6;
+	}
+	return 0;
+}
+
+inline v3f
+decode_texel(int format, const unsigned char* texel)
+{
+	switch (format)
+	{
+		case TEXEL_FORMAT_RGB8:
+		{
+			const float color_scale = 1.0f / 255.0f;
+			return v3f{ color_scale*texel[0], color_scale*texel[1], color_scale*texel[2] };
+		}
+		case TEXEL_FORMAT_RGB16:
+		{
+			const float color_scale = 1.0f / 65535.0f;
+			uint16_t rgb[3];
+			memcpy(rgb, texel, sizeof(rgb));
+			return v3f{ color_scale*rgb[0], color_scale*rgb[1], color_scale*rgb[2] };
+		}
+		case TEXEL_FORMAT_RGB16F:
+		{
+			uint16_t rgb[3];
+			memcpy(rgb, texel, sizeof(rgb));
+			return v3f{ half_to_float(rgb[0]), half_to_float(rgb[1]), half_to_float(rgb[2]) };
+		}
+	}
+	return v3f{};
+}
+
+// Index of the tile holding a texel, counting the tiles of all the levels in order.
+inline int
+tile_index(Tiled_Texture_Info& info, int level, int x, int y)
+{
+	return info.first_tile[level] + (y >> info.tile_shift) * info.levels[level].tiles_x + (x >> info.tile_shift);
+}
+
+inline uint64_t
+tile_offset(Tiled_Texture_Info& info, int tile)
+{
+	return info.levels[0].offset + uint64_t(tile) * info.tile_bytes;
+}
+
+inline int
+texel_offset_in_tile(Tiled_Texture_Info& info, int x, int y)
+{
+	int tile_mask = info.header.tile_size - 1;
+	return (((y & tile_mask) << info.tile_shift) + (x & tile_mask)) * info.texel_bytes;
+}
+
+// data holds the header and the level table of a file of file_size bytes.
+inline bool
+parse_tiled_texture_info(const unsigned char* data, size_t size, uint64_t file_size, Tiled_Texture_Info& info)
+{
+	if (size < sizeof(info.header))
+	{
+		return false;
+	}
+	memcpy(&info.header, data, sizeof(info.header));
+
+	Tiled_Texture_Header& header = info.header;
+	if (header.magic != TILED_TEXTURE_MAGIC ||
+		header.version != TILED_TEXTURE_VERSION ||
+		texel_size(header.format) == 0 ||
+		header.width <= 0 || header.height <= 0 ||
+		header.level_count != mip_level_count(header.width, header.height) ||
+		header.tile_size <= 0 || header.tile_size > TILED_TEXTURE_MAX_TILE_SIZE ||
+		(header.tile_size & (header.tile_size - 1)) != 0 ||
+		size < sizeof(header) + header.level_count * sizeof(Tiled_Texture_Level))
+	{
+		return false;
+	}
+
+	info.levels.resize(header.level_count);
+	memcpy(info.levels.data(), data + sizeof(header), header.level_count * sizeof(Tiled_Texture_Level));
+
+	info.tile_shift = 0;
+	while ((1 << info.tile_shift) < header.tile_size)
+	{
+		info.tile_shift++;
+	}
+	info.texel_bytes = texel_size(header.format);
+
+	// Sizes and offsets are worked out in 64 bits, nothing a header holds can overflow them before
+	// they are checked against the file.
+	uint64_t tile_bytes = uint64_t(header.tile_size) * uint64_t(header.tile_size) * uint64_t(info.texel_bytes);
+	uint64_t first_offset = info.levels[0].offset;
+	if (first_offset > file_size)
+	{
+		return false;
+	}
+	uint64_t max_tile_count = (file_size - first_offset) / tile_bytes;
+
+	info.first_tile.resize(header.level_count);
+	uint64_t tile_count = 0;
+	for (int level = 0; level < header.level_count; level++)
+	{
+		Tiled_Texture_Level& entry = info.levels[level];
+		if (entry.width != mip_level_size(header.width, level) ||
+			entry.height != mip_level_size(header.height, level) ||
+			entry.tiles_x != (int64_t(entry.width) + header.tile_size - 1) / header.tile_size ||
+			entry.tiles_y != (int64_t(entry.height) + header.tile_size - 1) / header.tile_size ||
+			entry.offset != first_offset + tile_count * tile_bytes)
+		{
+			return false;
+		}
+
+		info.first_tile[level] = int(tile_count);
+		tile_count += uint64_t(entry.tiles_x) * uint64_t(entry.tiles_y);
+		// every tile has to be in the file and tiles are numbered with an int
+		if (tile_count > max_tile_count || tile_count > uint64_t(INT_MAX))
+		{
+			return false;
+		}
+	}
+
+	info.tile_bytes = int(tile_bytes);
+	info.tile_count = int(tile_count);
+	return true;
+}
+
+inline bool
+seek_file(FILE* f, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// Leaves the file position at the end.
+inline uint64_t
+get_file_size(FILE* f)
+{
+#ifdef _WIN32
+	if (_fseeki64(f, 0, SEEK_END) != 0)
+		return 0;
+	return uint64_t(_ftelli64(f));
+#else
+	if (fseeko(f, 0, SEEK_END) != 0)
+		return 0;
+	return uint64_t(ftello(f));
+#endif
+}
+
+inline bool
+read_tiled_texture_info(FILE* f, Tiled_Texture_Info& info)
+{
+	uint64_t file_size = get_file_size(f);
+
+	// header and level table always fit before the page aligned tiles
+	std::vector<unsigned char> data(size_t(MIN(file_size, uint64_t(TILED_TEXTURE_ALIGNMENT))));
+	if (!seek_file(f, 0) || fread(data.data(), 1, data.size(), f) != data.size())
+	{
+		return false;
+	}
+
+	return parse_tiled_texture_info(data.data(), data.size(), file_size, info);
+}
+
+// Builds the whole file in memory from mip levels whose texels are already encoded in format.
+inline std::vector<unsigned char>
+build_tiled_texture(int width, int height, int format, std::vector<std::vector<unsigned char>>& levels)
+{
+	const int tile_size = TILED_TEXTURE_TILE_SIZE;
+	const int bytes_per_texel = texel_size(format);
+
+	Tiled_Texture_Header header = {};
+	header.magic = TILED_TEXTURE_MAGIC;
+	header.version = TILED_TEXTURE_VERSION;
+	header.width = width;
+	header.height = height;
+	header.level_count = int32_t(levels.size());
+	header.tile_size = tile_size;
+	header.format = format;
+
+	std::vector<Tiled_Texture_Level> level_table(levels.size());
+	uint64_t offset = sizeof(header) + level_table.size() * sizeof(Tiled_Texture_Level);
+	offset = (offset + TILED_TEXTURE_ALIGNMENT - 1) / TILED_TEXTURE_ALIGNMENT * TILED_TEXTURE_ALIGNMENT;
+	for (int level = 0; level < header.level_count; level++)
+	{
+		Tiled_Texture_Level& entry = level_table[level];
+		entry.width = mip_level_size(width, level);
+		entry.height = mip_level_size(height, level);
+		entry.tiles_x = (entry.width + tile_size - 1) / tile_size;
+		entry.tiles_y = (entry.height + tile_size - 1) / tile_size;
+		entry.offset = offset;
+		offset += uint64_t(entry.tiles_x) * entry.tiles_y * tile_size * tile_size * bytes_per_texel;
+	}
+
+	std::vector<unsigned char> file(size_t(offset), 0);
+	memcpy(file.data(), &header, sizeof(header));
+	memcpy(file.data() + sizeof(header), level_table.data(), level_table.size() * sizeof(Tiled_Texture_Level));
+
+	for (int level = 0; level < header.level_count; level++)
+	{
+		Tiled_Texture_Level& entry = level_table[level];
+		unsigned char* src = levels[level].data();
+		unsigned char* dst = file.data() + entry.offset;
+		for (int tile_y = 0; tile_y < entry.tiles_y; tile_y++)
+		{
+			for (int tile_x = 0; tile_x < entry.tiles_x; tile_x++)
+			{
+				for (int y = 0; y < tile_size; y++)
+				{
+					int src_y = MIN(tile_y * tile_size + y, entry.height - 1);
+					for (int x = 0; x < tile_size; x++)
+					{
+						int src_x = MIN(tile_x * tile_size + x, entry.width - 1);
+						memcpy(dst, &src[(src_y * entry.width + src_x) * bytes_per_texel], bytes_per_texel);
+						dst += bytes_per_texel;
+					}
+				}
+			}
+		}
+	}
+
+	return file;
+}
+
+// Texels of a decoded image, as loaded by stb_image, in the byte layout of format.
+template <typename T>
+inline std::vector<unsigned char>
+encode_texels(int format, std::vector<T>& components)
+{
+	std::vector<unsigned char> result(components.size() / 3 * texel_size(format));
+	if (format == TEXEL_FORMAT_RGB16F)
+	{
+		uint16_t* dst = (uint16_t*)result.data();
+		for (size_t i = 0; i < components.size(); i++)
+		{
+			dst[i] = float_to_half(float(components[i]));
+		}
+	}
+	else
+	{
+		memcpy(result.data(), components.data(), result.size());
+	}
+	return result;
+}
+
+template <typename T>
+inline std::vector<unsigned char>
+build_tiled_texture(int width, int height, int format, T* components)
+{
+	std::vector<std::vector<T>> levels;
+	levels.push_back(std::vector<T>(components, components + size_t(width) * height * 3));
+	build_mip_levels(width, height, 3, levels);
+
+	std::vector<std::vector<unsigned char>> encoded_levels;
+	for (std::vector<T>& level : levels)
+	{
+		encoded_levels.push_back(encode_texels(format, level));
+	}
+	return build_tiled_texture(width, height, format, encoded_levels);
+}
+
+// Decodes an image with stb_image and returns it as a tiled texture in format.
+inline std::vector<unsigned char>
+load_tiled_texture(const char* file_name, int format)
+{
+	std::vector<unsigned char> result;
+	int width = 0;
+	int height = 0;
+	int components = 0;
+	switch (format)
+	{
+		case TEXEL_FORMAT_RGB8:
+		{
+			unsigned char* data = stbi_load(file_name, &width, &height, &components, 3);
+			if (data)
+			{
+				result = build_tiled_texture(width, height, format, data);
+				stbi_image_free(data);
+			}
+			break;
+		}
+		case TEXEL_FORMAT_RGB16:
+		{
+			uint16_t* data = stbi_load_16(file_name, &width, &height, &components, 3);
+			if (data)
+			{
+				result = build_tiled_texture(width, height, format, data);
+				stbi_image_free(data);
+			}
+			break;
+		}
+		case TEXEL_FORMAT_RGB16F:
+		{
+			// keep 8 bit images in the same space the renderer reads them in
+			stbi_ldr_to_hdr_gamma(1.0f);
+			float* data = stbi_loadf(file_name, &width, &height, &components, 3);
+			if (data)
+			{
+				result = build_tiled_texture(width, height, format, data);
+				stbi_image_free(data);
+			}
+			break;
+		}
+	}
+	return result;
+}
+
+inline bool
+convert_texture(const char* src_file_name, const char* dst_file_name, int format)
+{
+	std::vector<unsigned char> texture = load_tiled_texture(src_file_name, format);
+	if (texture.empty())
+	{
+		fprintf(stderr, "ERROR: Could not load texture image file '%s'.\n", src_file_name);
+		return false;
+	}
+
+	FILE* f = fopen(dst_file_name, "wb");
+	bool ok = f && fwrite(texture.data(), 1, texture.size(), f) == texture.size();
+	if (f)
+	{
+		ok = fclose(f) == 0 && ok;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "ERROR: Could not write tiled texture '%s'.\n", dst_file_name);
+	}
+	return ok;
+}
+
+// Read only view of a whole file.
+struct Mapped_File
+{
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+inline bool
+map_file(const char* file_name, Mapped_File& mapped)
+{
+	mapped = {};
+#ifdef _WIN32
+	HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// the mapping keeps the file open
+	mapped.mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapped.mapping)
+	{
+		return false;
+	}
+
+	mapped.data = (const unsigned char*)MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!mapped.data)
+	{
+		CloseHandle(mapped.mapping);
+		mapped.mapping = nullptr;
+		return false;
+	}
+	mapped.size = size_t(size.QuadPart);
+	return true;
+#else
+	int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	mapped.data = (const unsigned char*)data;
+	mapped.size = size_t(file_stat.st_size);
+	return true;
+#endif
+}
+
+inline void
+unmap_file(Mapped_File& mapped)
+{
+	if (!mapped.data)
+	{
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(mapped.data);
+	CloseHandle(mapped.mapping);
+#else
+	munmap((void*)mapped.data, mapped.size);
+#endif
+	mapped = {};
+}
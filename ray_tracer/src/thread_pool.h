@@ -0,0 +1,159 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <atomic>
+
+#include "trace.h"
+
+// Persistent worker threads, created once at startup and reused by every render pass, frame and
+// loading step. Idle workers sleep on a condition variable instead of spinning, so the thread
+// that submits work is free to do something else (report progress, write files) while it waits.
+
+// Tracks a batch of tasks so a caller can wait for its own work without waiting on unrelated
+// tasks that happen to be in the pool at the same time.
+struct Task_Group
+{
+	int pending_tasks;
+};
+
+struct Pool_Task
+{
+	std::function<void()> work;
+	Task_Group* group;
+};
+
+struct Thread_Pool
+{
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable work_available;
+	std::condition_variable work_done;
+	std::deque<Pool_Task> tasks;
+	bool stopping;
+};
+
+inline void
+thread_pool_worker(Thread_Pool& pool, int thread_index, std::function<void(int)> on_thread_start)
+{
+	char thread_name[32];
+	snprintf(thread_name, sizeof(thread_name), "worker %d", thread_index);
+	TRACE_THREAD_NAME(thread_name);
+
+	if (on_thread_start)
+	{
+		on_thread_start(thread_index);
+	}
+
+	for (;;)
+	{
+		Pool_Task task;
+		{
+			std::unique_lock<std::mutex> guard(pool.lock);
+			pool.work_available.wait(guard, [&pool] { return pool.stopping || !pool.tasks.empty(); });
+			if (pool.tasks.empty())
+			{
+				return;
+			}
+
+			task = std::move(pool.tasks.front());
+			pool.tasks.pop_front();
+		}
+
+		task.work();
+
+		{
+			std::lock_guard<std::mutex> guard(pool.lock);
+			task.group->pending_tasks--;
+			if (task.group->pending_tasks == 0)
+			{
+				pool.work_done.notify_all();
+			}
+		}
+	}
+}
+
+// on_thread_start runs on every worker before it takes any task, e.g. to set its cpu affinity.
+inline void
+start_thread_pool(Thread_Pool& pool, int thread_count, std::function<void(int)> on_thread_start = nullptr)
+{
+	pool.stopping = false;
+	for (int thread_index = 0; thread_index < thread_count; thread_index++)
+	{
+		pool.threads.push_back(std::thread{ thread_pool_worker, std::ref(pool), thread_index, on_thread_start });
+	}
+}
+
+// Finishes the queued tasks and joins the workers.
+inline void
+stop_thread_pool(Thread_Pool& pool)
+{
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		pool.stopping = true;
+	}
+	pool.work_available.notify_all();
+
+	for (std::thread& t : pool.threads)
+	{
+		t.join();
+	}
+	pool.threads.clear();
+}
+
+inline int
+thread_count(Thread_Pool& pool)
+{
+	return int(pool.threads.size());
+}
+
+inline void
+submit_task(Thread_Pool& pool, Task_Group& group, std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		pool.tasks.push_back(Pool_Task{ std::move(task), &group });
+		group.pending_tasks++;
+	}
+	pool.work_available.notify_one();
+}
+
+// Blocks until every task of the group has finished. Must not be called from inside a task.
+inline void
+wait_for_tasks(Thread_Pool& pool, Task_Group& group)
+{
+	std::unique_lock<std::mutex> guard(pool.lock);
+	pool.work_done.wait(guard, [&group] { return group.pending_tasks == 0; });
+}
+
+// Same as above but gives up after timeout_ms, returns true when all the tasks are done.
+inline bool
+wait_for_tasks(Thread_Pool& pool, Task_Group& group, int timeout_ms)
+{
+	std::unique_lock<std::mutex> guard(pool.lock);
+	return pool.work_done.wait_for(guard, std::chrono::milliseconds(timeout_ms), [&group] { return group.pending_tasks == 0; });
+}
+
+// Runs body(index) for every index in [0, count) spread over all the workers and waits for it.
+inline void
+parallel_for(Thread_Pool& pool, int count, std::function<void(int)> body)
+{
+	Task_Group group = {};
+	std::atomic<int> next_index(0);
+	int worker_count = MIN(thread_count(pool), count);
+	for (int worker = 0; worker < worker_count; worker++)
+	{
+		submit_task(pool, group, [&next_index, &body, count]
+		{
+			for (int index = next_index.fetch_add(1); index < count; index = next_index.fetch_add(1))
+			{
+				body(index);
+			}
+		});
+	}
+	wait_for_tasks(pool, group);
+}
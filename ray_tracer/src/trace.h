@@ -0,0 +1,168 @@
+#pragma once
+
+// Timeline of what every thread did during a run, for finding load imbalance and stalls. Scoped
+// events are recorded into a ring buffer of the thread that ends them, without locks or atomics,
+// and write_trace dumps them as Chrome trace JSON for chrome://tracing or ui.perfetto.dev. A full
+// ring overwrites its oldest events. Built with USE_TRACING=0, the default, the macros expand to
+// nothing.
+
+#ifndef USE_TRACING
+#define USE_TRACING 0
+#endif
+
+#if USE_TRACING
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// events kept per thread, a power of two
+#define TRACE_RING_SIZE 65536
+
+struct Trace_Event
+{
+	// must outlive the trace, in practice a string literal
+	const char* name;
+	// tile the event belongs to, -1 for the rest
+	int tile_x;
+	int tile_y;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct Trace_Buffer
+{
+	int thread_id;
+	char thread_name[32];
+	uint64_t count;
+	Trace_Event events[TRACE_RING_SIZE];
+};
+
+struct Trace_Registry
+{
+	std::mutex lock;
+	// never freed, the threads can record until the program exits
+	std::vector<Trace_Buffer*> buffers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+inline Trace_Registry&
+get_trace_registry()
+{
+	static Trace_Registry registry;
+	return registry;
+}
+
+inline uint64_t
+trace_now()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - get_trace_registry().start).count());
+}
+
+// The calling thread's buffer, registered on its first event.
+inline Trace_Buffer*
+get_trace_buffer()
+{
+	static thread_local Trace_Buffer* buffer = nullptr;
+	if (!buffer)
+	{
+		Trace_Registry& registry = get_trace_registry();
+		std::lock_guard<std::mutex> guard(registry.lock);
+		buffer = new Trace_Buffer;
+		buffer->thread_id = int(registry.buffers.size());
+		snprintf(buffer->thread_name, sizeof(buffer->thread_name), "thread %d", buffer->thread_id);
+		buffer->count = 0;
+		registry.buffers.push_back(buffer);
+	}
+	return buffer;
+}
+
+inline void
+set_trace_thread_name(const char* name)
+{
+	Trace_Buffer* buffer = get_trace_buffer();
+	snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+}
+
+inline void
+record_trace_event(const char* name, int tile_x, int tile_y, uint64_t start_ns, uint64_t end_ns)
+{
+	Trace_Buffer* buffer = get_trace_buffer();
+	Trace_Event& event = buffer->events[buffer->count & (TRACE_RING_SIZE - 1)];
+	event.name = name;
+	event.tile_x = tile_x;
+	event.tile_y = tile_y;
+	event.start_ns = start_ns;
+	event.end_ns = end_ns;
+	buffer->count++;
+}
+
+struct Trace_Scope
+{
+	const char* name;
+	int tile_x;
+	int tile_y;
+	uint64_t start_ns;
+
+	Trace_Scope(const char* event_name, int x = -1, int y = -1) : name(event_name), tile_x(x), tile_y(y), start_ns(trace_now()) {}
+	~Trace_Scope() { record_trace_event(name, tile_x, tile_y, start_ns, trace_now()); }
+};
+
+// Only call while no other thread records, e.g. between frames with the pool idle.
+inline bool
+write_trace(const char* file_name)
+{
+	FILE* f = fopen(file_name, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Could not write the trace to '%s'.\n", file_name);
+		return false;
+	}
+
+	Trace_Registry& registry = get_trace_registry();
+	std::lock_guard<std::mutex> guard(registry.lock);
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (Trace_Buffer* buffer : registry.buffers)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", buffer->thread_id, buffer->thread_name);
+		first = false;
+
+		uint64_t begin = buffer->count > TRACE_RING_SIZE ? buffer->count - TRACE_RING_SIZE : 0;
+		for (uint64_t i = begin; i < buffer->count; i++)
+		{
+			Trace_Event& event = buffer->events[i & (TRACE_RING_SIZE - 1)];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				event.name, buffer->thread_id, double(event.start_ns) / 1000.0, double(event.end_ns - event.start_ns) / 1000.0);
+			if (event.tile_x >= 0)
+			{
+				fprintf(f, ",\"args\":{\"x\":%d,\"y\":%d}", event.tile_x, event.tile_y);
+			}
+			fprintf(f, "}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	return true;
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Records the rest of the enclosing scope as an event.
+#define TRACE_SCOPE(name) Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_TILE_SCOPE(name, x, y) Trace_Scope TRACE_CONCAT(trace_scope_, __LINE__)(name, x, y)
+#define TRACE_THREAD_NAME(name) set_trace_thread_name(name)
+#define TRACE_WRITE(file_name) write_trace(file_name)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_TILE_SCOPE(name, x, y)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_WRITE(file_name)
+
+#endif